@@ -19,7 +19,8 @@ fi
 cd "$WORK_DIR" || exit
 
 CONFIG_BLOCK_SZ=512
-BLOCK_COUNT=8192
+BLOCK_COUNT=8192                        # 读不到设备大小时按默认的 4M
+KERNEL_PARAM_PATH="/sys/module/ddriver/parameters"
 
 
 function usage(){
@@ -35,6 +36,7 @@ function usage(){
     echo "用法: ddriver [options]"
     echo "options: "
     echo "-i [k|u]      安装ddriver: [k] - kernel / [u] - user"
+    echo "              [k] 可用 DDRIVER_KPARAMS 传模块参数，如 \"disk_size=67108864 backing=/var/tmp/ddriver.img\""
     echo "-t            测试ddriver[请忽略]"
     echo "-d            导出ddriver至当前工作目录[PWD]"
     echo "-r            擦除ddriver"
@@ -80,7 +82,7 @@ function install() {
         sudo rm $KERNEL_DEV_PATH>/dev/null 2>&1 
         sudo rmmod ddriver>/dev/null 2>&1 
         sudo dmesg -C
-        sudo insmod ./ddriver.ko
+        sudo insmod ./ddriver.ko $DDRIVER_KPARAMS
         in=$(dmesg | tail -n 1)
         tokens=("$in")
         major_number=${tokens[${#tokens[*]}-1]}
@@ -120,7 +122,26 @@ function install() {
     fi
 }
 
+# 按设备实际大小设置 BLOCK_COUNT：内核设备取模块的 disk_size 参数（加载时已按 512 取整），
+# 读不到时从 DDRIVER_KPARAMS 中取；用户设备取镜像文件的大小
+function device_blocks() {
+    local size=""
+    if [ "$DDRIVER_TYPE" == "k" ]; then
+        if [ -r "$KERNEL_PARAM_PATH"/disk_size ]; then
+            size=$(cat "$KERNEL_PARAM_PATH"/disk_size)
+        else
+            size=$(echo "$DDRIVER_KPARAMS" | sed -n 's/.*\bdisk_size=\([0-9]*\).*/\1/p')
+        fi
+    elif [ -f "$USER_DEV_PATH" ]; then
+        size=$(stat -c %s "$USER_DEV_PATH")
+    fi
+    if [ -n "$size" ] && [ "$size" -ge $CONFIG_BLOCK_SZ ] 2>/dev/null; then
+        BLOCK_COUNT=$((size / CONFIG_BLOCK_SZ))
+    fi
+}
+
 function test(){
+    device_blocks
     if [ "$DDRIVER_TYPE" == "k" ]; then   
         # test read
         sudo dd if=$KERNEL_DEV_PATH of=read1 bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
@@ -142,6 +163,7 @@ function log() {
 }
 
 function dump(){
+    device_blocks
     sudo rm "$ORIGIN_WORK_DIR"/ddriver_dump>/dev/null 2>&1 
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
@@ -154,6 +176,7 @@ function dump(){
 }
 
 function clean(){
+    device_blocks
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
         sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
@@ -4,6 +4,18 @@
 #include <linux/fs.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/bitmap.h>
+#include <linux/err.h>
 #include "ddriver_ctl.h"
 /******************************************************************************
 * SECTION: Macro definitions
@@ -27,8 +39,10 @@
                         "filp_open/cpp-filp_open-function-examples.html>"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)           /* Default of the disk_size parameter */
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_STRIPE_SZ (64 * 1024)                  /* Layout locking granularity */
+#define CONFIG_STRIPES  (64)                          /* Stripe locks, hashed by stripe index */
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
@@ -36,14 +50,8 @@
 #define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
 #define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
 
-#define GET_HEAD_POS(disk)      (disk.head - disk.layout)
-#define FORWARD_HEAD(disk, dis) (disk.head += dis)
-#define SET_HEAD(disk, ofs)     (disk.head = disk.layout + ofs)
-#define RESET_HEAD(disk)        (SET_HEAD(disk, 0))
-
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define STRIPE_OF(pos)          (&stripes[div_u64(pos, CONFIG_STRIPE_SZ) % CONFIG_STRIPES])
+#define STRIPE_LEFT(pos)        (CONFIG_STRIPE_SZ - ((pos) & (CONFIG_STRIPE_SZ - 1)))
 /******************************************************************************
 * SECTION: Kernel Module Template
 *******************************************************************************/
@@ -51,44 +59,303 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);	    
 MODULE_DESCRIPTION(DRIVER_DESC);	
 MODULE_VERSION(DRIVER_VERSION);	
+
+static unsigned long disk_size = CONFIG_DISK_SZ;
+module_param(disk_size, ulong, 0444);
+MODULE_PARM_DESC(disk_size, "Disk size in bytes, rounded down to 512, at most 2G - 512 (default 4M)");
+
+static char *backing = NULL;
+module_param(backing, charp, 0444);
+MODULE_PARM_DESC(backing, "Load the disk from this file, write it back on last close and unload");
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
+/*
+ * Every open file has its own head (f_pos), so several user space file systems
+ * can use the disk at once. A request runs on the caller's CPU and copies as
+ * many blocks as asked, taking the stripe locks of the layout one stripe at a
+ * time; statistics are per CPU, only the trace ring is shared.
+ */
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
-    char *head;                                       /* Disk Head */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
+    char *layout;                                     /* Disk Layout, vmalloc'ed at load */
+    unsigned long *dirty;                             /* Stripes not yet written to backing */
     int  major_num;
-    int  open_count;
+    atomic_t open_count;
     int  layout_size;
     int  iounit_size;
 };
 
+struct ddriver_trace
+{
+    struct ddriver_trace_rec *recs;                   /* Ring buffer, NULL if never started */
+    unsigned int       cap;
+    unsigned long long total;                         /* Requests traced since start */
+    unsigned long long start_ns;
+    unsigned short     tag;
+    int                enabled;
+};
+
 static struct ddriver disk = {
-    .head        = NULL,
-    .read_cnt    = 0,
-    .write_cnt   = 0,
-    .seek_cnt    = 0,
     .major_num   = 0,
-    .open_count  = 0,
-    .layout_size = CONFIG_DISK_SZ,
+    .open_count  = ATOMIC_INIT(0),
+    .layout_size = 0,
     .iounit_size = CONFIG_BLOCK_SZ
 };
+
+static struct ddriver_trace trace = {
+    .recs        = NULL,
+    .enabled     = 0
+};
+
+static DEFINE_PER_CPU(struct ddriver_state_v2, pcpu_stats); /* Cleared by IOC_REQ_STATS_RESET */
+static u64 clock_origin;                             /* stats.clock_ns counts from here */
+
+static struct rw_semaphore stripes[CONFIG_STRIPES];
+static DEFINE_SPINLOCK(trace_lock);                  /* Ring slots and trace.total */
+static DEFINE_MUTEX(trace_mutex);                    /* Start / dump, may sleep */
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
+/**
+ * @brief Check a transfer at pos, return the bytes to transfer, clipped at the disk end
+ */
+static ssize_t check_valid(loff_t pos, size_t size){
+    if (pos < 0 || pos >= disk.layout_size) {
         kernel_alert("disk head reach the end");
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
+    if (size == 0 || !IS_ADDR_ALIGN(size)){
         kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
         return -EIO;
     }
+    return min_t(size_t, size, disk.layout_size - pos);
+}
+/**
+ * @brief Copy between user space and the layout, one stripe lock at a time.
+ *        Sectors never straddle stripes, so each sector is copied atomically.
+ * @return ssize_t      Bytes copied, -EFAULT if nothing could be copied
+ */
+static ssize_t layout_copy(char __user *ubuf, loff_t pos, size_t size, int write) {
+    struct rw_semaphore *lock;
+    size_t done = 0, chunk;
+    unsigned long left;
+
+    while (done < size) {
+        chunk = min_t(size_t, size - done, STRIPE_LEFT(pos + done));
+        lock = STRIPE_OF(pos + done);
+        if (write) {
+            down_write(lock);
+            set_bit(div_u64(pos + done, CONFIG_STRIPE_SZ), disk.dirty);
+            left = copy_from_user(disk.layout + pos + done, ubuf + done, chunk);
+            up_write(lock);
+        } else {
+            down_read(lock);
+            left = copy_to_user(ubuf + done, disk.layout + pos + done, chunk);
+            up_read(lock);
+        }
+        if (left)
+            return done ? done : -EFAULT;
+        done += chunk;
+    }
+    return done;
+}
+/**
+ * @brief Zero [pos, pos + len) under the stripe locks
+ */
+static void layout_zero(loff_t pos, size_t len) {
+    struct rw_semaphore *lock;
+    size_t done = 0, chunk;
+
+    while (done < len) {
+        chunk = min_t(size_t, len - done, STRIPE_LEFT(pos + done));
+        lock = STRIPE_OF(pos + done);
+        down_write(lock);
+        set_bit(div_u64(pos + done, CONFIG_STRIPE_SZ), disk.dirty);
+        memset(disk.layout + pos + done, 0, chunk);
+        up_write(lock);
+        done += chunk;
+    }
+}
+/**
+ * @brief Sum the per CPU statistics, every field is a u64 counter
+ */
+static void stats_sum(struct ddriver_state_v2 *sum) {
+    u64 *dst = (u64 *)sum, *src;
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        src = (u64 *)per_cpu_ptr(&pcpu_stats, cpu);
+        for (size_t i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+            dst[i] += src[i];
+    }
+}
+
+static void stats_reset(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&pcpu_stats, cpu), 0, sizeof(struct ddriver_state_v2));
+    clock_origin = ktime_get_ns();
+}
+/**
+ * @brief Fill the layout from the backing file. A missing file is an empty
+ *        disk, a short one leaves the rest zeroed.
+ */
+static int backing_load(void) {
+    struct file *fp = filp_open(backing, O_RDONLY, 0);
+    loff_t pos = 0;
+    ssize_t n = 1;
+
+    if (IS_ERR(fp))
+        return PTR_ERR(fp) == -ENOENT ? 0 : PTR_ERR(fp);
+    while (n > 0 && pos < disk.layout_size)
+        n = kernel_read(fp, disk.layout + pos, disk.layout_size - pos, &pos);
+    filp_close(fp, NULL);
+    return n < 0 ? n : 0;
+}
+/**
+ * @brief Write the dirty stripes back to the backing file and sync it
+ */
+static int backing_save(void) {
+    int stripe_cnt = DIV_ROUND_UP(disk.layout_size, CONFIG_STRIPE_SZ);
+    struct rw_semaphore *lock;
+    struct file *fp;
+    loff_t pos, start;
+    ssize_t n = 0;
+    size_t len;
+
+    fp = filp_open(backing, O_WRONLY | O_CREAT, 0644);
+    if (IS_ERR(fp))
+        return PTR_ERR(fp);
+    for (int i = 0; i < stripe_cnt && n >= 0; i++) {
+        if (!test_and_clear_bit(i, disk.dirty))
+            continue;
+        start = pos = (loff_t)i * CONFIG_STRIPE_SZ;
+        len = min_t(size_t, CONFIG_STRIPE_SZ, disk.layout_size - start);
+        lock = STRIPE_OF(start);
+        down_read(lock);
+        while (n >= 0 && pos < start + len)
+            n = kernel_write(fp, disk.layout + pos, start + len - pos, &pos);
+        up_read(lock);
+        if (n < 0)
+            set_bit(i, disk.dirty);                   /* Try again next time */
+    }
+    if (n >= 0)
+        n = vfs_fsync(fp, 0);
+    filp_close(fp, NULL);
+    return n < 0 ? n : 0;
+}
+/**
+ * @brief Histogram bucket of a latency, bucket i covers [2^(i-1), 2^i) us
+ */
+static int hist_bucket(u64 lat_ns) {
+    u64 us = div_u64(lat_ns, NSEC_PER_USEC);
+
+    return us == 0 ? 0 : min_t(int, fls64(us), DDRIVER_HIST_BUCKETS - 1);
+}
+/**
+ * @brief Record one request, the oldest record is overwritten when the ring is full
+ */
+static void trace_record(int op, loff_t offset, size_t size, u64 t0, u64 lat) {
+    struct ddriver_trace_rec *rec;
+    u32 slot;
+
+    if (!READ_ONCE(trace.enabled)) {
+        return;
+    }
+    spin_lock(&trace_lock);
+    if (!trace.enabled) {
+        spin_unlock(&trace_lock);
+        return;
+    }
+    div_u64_rem(trace.total, trace.cap, &slot);       /* No 64-bit '%' on 32-bit targets */
+    rec = &trace.recs[slot];
+    rec->ts_ns  = t0 - trace.start_ns;
+    rec->offset = offset;
+    rec->lat_ns = lat;
+    rec->size   = size;
+    rec->op     = op;
+    rec->tag    = trace.tag;
+    trace.total++;
+    spin_unlock(&trace_lock);
+}
+/**
+ * @brief Request finished, update the extended statistics and the trace.
+ *        This driver emulates no latency, so sim_ns stays 0.
+ */
+static void request_done(int op, loff_t offset, size_t size, u64 t0) {
+    u64 lat = ktime_get_ns() - t0;
+    struct ddriver_state_v2 *stats = get_cpu_ptr(&pcpu_stats);
+
+    stats->ops[op]++;
+    stats->bytes[op] += size;
+    stats->lat_ns[op] += lat;
+    stats->hist[op][hist_bucket(lat)]++;
+    put_cpu_ptr(&pcpu_stats);
+    trace_record(op, offset, size, t0, lat);
+}
+
+static int trace_start(int cap) {
+    struct ddriver_trace_rec *recs, *old;
+
+    if (cap < 0) {
+        return -EINVAL;
+    }
+    cap = cap == 0 ? DDRIVER_TRACE_DEF_RECS : cap;
+    recs = vzalloc((size_t)cap * sizeof(struct ddriver_trace_rec));
+    if (recs == NULL) {
+        return -ENOMEM;
+    }
+    mutex_lock(&trace_mutex);
+    spin_lock(&trace_lock);
+    old            = trace.recs;
+    trace.recs     = recs;
+    trace.cap      = cap;
+    trace.total    = 0;
+    trace.tag      = 0;
+    trace.start_ns = ktime_get_ns();
+    trace.enabled  = 1;
+    spin_unlock(&trace_lock);
+    mutex_unlock(&trace_mutex);
+    vfree(old);
+    return 0;
+}
+
+/**
+ * @brief Copy the newest min(traced, dump.max) records to user space, oldest first
+ */
+static int trace_dump(struct ddriver_trace_dump __user *udump) {
+    struct ddriver_trace_dump dump;
+    unsigned long long first, total;
+    u32 cnt = 0, idx, run;
+
+    if (copy_from_user(&dump, udump, sizeof(dump)))
+        return -EFAULT;
+    mutex_lock(&trace_mutex);                         /* Keeps the ring, records may still land */
+    spin_lock(&trace_lock);
+    total = trace.total;
+    spin_unlock(&trace_lock);
+    if (trace.recs != NULL) {
+        cnt = total < trace.cap ? total : trace.cap;
+        cnt = cnt < dump.max ? cnt : dump.max;
+    }
+    first = total - cnt;
+    for (unsigned int i = 0; i < cnt; i += run) {      /* At most two runs around the ring end */
+        div_u64_rem(first + i, trace.cap, &idx);
+        run = min_t(u32, cnt - i, trace.cap - idx);
+        if (copy_to_user((struct ddriver_trace_rec __user *)dump.recs + i, &trace.recs[idx],
+                         run * sizeof(struct ddriver_trace_rec))) {
+            mutex_unlock(&trace_mutex);
+            return -EFAULT;
+        }
+    }
+    dump.cnt = cnt;
+    dump.total = total;
+    mutex_unlock(&trace_mutex);
+    if (copy_to_user(udump, &dump, sizeof(dump)))
+        return -EFAULT;
     return 0;
 }
 /******************************************************************************
@@ -119,57 +386,64 @@ static struct file_operations file_ops = {
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param size          Multiple of Blocksize @CONFIG_BLOCK_SZ, clipped at the disk end
+ * @param offset        Head of this file
  * @return ssize_t      Bytes have been read 
  */
 static ssize_t 
 device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
+    u64 t0 = ktime_get_ns();
+    loff_t pos = *offset;
+    ssize_t res = check_valid(pos, size);
+
     IGNORE_ARG(file);
-    int res = check_valid(size);
     if(res < 0)
         return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    res = layout_copy((char __user *)user_buffer, pos, res, 0);
+    if (res < 0)
+        return res;
+    *offset += res;
+    request_done(DDRIVER_TRACE_READ, pos, res, t0);
+    return res;
 }
 /**
  * @brief Disk Write
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param size          Multiple of Blocksize @CONFIG_BLOCK_SZ, clipped at the disk end
+ * @param offset        Head of this file
  * @return ssize_t      Bytes have been written
  */
 static ssize_t 
 device_write(struct file *file, const char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
+    u64 t0 = ktime_get_ns();
+    loff_t pos = *offset;
+    ssize_t res = check_valid(pos, size);
+
     IGNORE_ARG(file);
-    int res = check_valid(size);
     if(res < 0)
         return res;
 
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    res = layout_copy((char __user *)user_buffer, pos, res, 1);
+    if (res < 0)
+        return res;
+    *offset += res;
+    request_done(DDRIVER_TRACE_WRITE, pos, res, t0);
+    return res;
 }
 /**
- * @brief Disk Seek
+ * @brief Disk Seek, moves the head of this file only
  * 
- * @param file          Ignored
+ * @param file          Opened disk
  * @param offset        Aligned to @CONFIG_BLOCK_SZ
  * @param whence        SEEK_CUR, SEEK_SET
  * @return loff_t       cur pos
  */
 static loff_t 
 device_seek(struct file *file, loff_t offset, int whence) {
-    IGNORE_ARG(file);
+    u64 t0 = ktime_get_ns();
+    loff_t cur = file->f_pos, pos = cur;
     if (!IS_ADDR_ALIGN(offset)) {
         kernel_alert("offset %lld must be aligned to block size %d", 
                       offset, CONFIG_BLOCK_SZ);
@@ -178,16 +452,20 @@ device_seek(struct file *file, loff_t offset, int whence) {
     switch (whence)
     {
     case SEEK_SET:
-        SET_HEAD(disk, offset);
+        pos = offset;
         break;
     case SEEK_CUR:
-        FORWARD_HEAD(disk, offset);
+        pos = cur + offset;
         break;
     default:
         break;
     }
-    INC_SEEKCNT(disk);
-    return GET_HEAD_POS(disk);
+    if (pos < 0 || pos > disk.layout_size)
+        return -EINVAL;
+    file->f_pos = pos;
+    this_cpu_add(pcpu_stats.seek_dist, pos > cur ? pos - cur : cur - pos);
+    request_done(DDRIVER_TRACE_SEEK, pos, 0, t0);
+    return pos;
 }
 /**
  * @brief Disk ioctl
@@ -199,9 +477,11 @@ device_seek(struct file *file, loff_t offset, int whence) {
  */
 static long 
 device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
-    IGNORE_ARG(file);
-    int ret;
+    int ret, val;
+    unsigned long long clock;
     struct ddriver_state state;
+    struct ddriver_state_v2 *stats;
+    struct ddriver_discard discard;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
@@ -209,25 +489,70 @@ device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
         if (ret) 
             return -EFAULT;
         break;
-    case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+    case IOC_REQ_DEVICE_STATE:                        /* Device State, requests of any size */
+        stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+        if (stats == NULL)
+            return -ENOMEM;
+        stats_sum(stats);
+        state.read_cnt = stats->ops[DDRIVER_TRACE_READ];
+        state.write_cnt = stats->ops[DDRIVER_TRACE_WRITE];
+        state.seek_cnt = stats->ops[DDRIVER_TRACE_SEEK];
+        kfree(stats);
         ret = copy_to_user((int __user *)arg, &state, sizeof(struct ddriver_state));
         if (ret) 
             return -EFAULT;
         break;
-    case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        disk.head = disk.layout;
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+    case IOC_REQ_DEVICE_RESET:                        /* Reset Device, zero the layout */
+        layout_zero(0, disk.layout_size);
+        file->f_pos = 0;                              /* Heads of other files stay */
+        stats_reset();
         break;
     case IOC_REQ_DEVICE_IO_SZ:
         ret = copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int));
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_TRACE_START:                         /* Start tracing, arg: ring size */
+        if (copy_from_user(&val, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        return trace_start(val);
+    case IOC_REQ_TRACE_STOP:
+        WRITE_ONCE(trace.enabled, 0);
+        break;
+    case IOC_REQ_TRACE_DUMP:
+        return trace_dump((struct ddriver_trace_dump __user *)arg);
+    case IOC_REQ_TRACE_TAG:                           /* Tag the following requests */
+        if (copy_from_user(&val, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        trace.tag = val;
+        break;
+    case IOC_REQ_DEVICE_STATE_V2:                     /* 64-bit counters and histograms */
+        stats = kmalloc(sizeof(*stats), GFP_KERNEL);  /* Too big for the stack */
+        if (stats == NULL)
+            return -ENOMEM;
+        stats_sum(stats);
+        stats->clock_ns = ktime_get_ns() - clock_origin;  /* Always the real clock */
+        ret = copy_to_user((void __user *)arg, stats, sizeof(struct ddriver_state_v2));
+        kfree(stats);
+        if (ret)
+            return -EFAULT;
+        break;
+    case IOC_REQ_STATS_RESET:                         /* Reset statistics, keep the disk */
+        stats_reset();
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Zero a range, keep the head */
+        if (copy_from_user(&discard, (struct ddriver_discard __user *)arg, sizeof(discard)))
+            return -EFAULT;
+        if (!IS_ADDR_ALIGN(discard.offset) || !IS_ADDR_ALIGN(discard.len) ||
+            discard.offset > disk.layout_size || discard.len > disk.layout_size - discard.offset)
+            return -EINVAL;
+        layout_zero(discard.offset, discard.len);
+        break;
+    case IOC_REQ_DEVICE_CLOCK:                        /* Device clock, no virtual time here */
+        clock = ktime_get_ns();
+        if (copy_to_user((unsigned long long __user *)arg, &clock, sizeof(clock)))
+            return -EFAULT;
+        break;
     default:
         break;
     }
@@ -243,13 +568,9 @@ device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
 static int 
 device_open(struct inode *inode, struct file *file) {
     IGNORE_ARG(inode);
-    IGNORE_ARG(file);
     
-    if (disk.open_count) {                            /* If device is open, return busy */
-        return -EBUSY;
-    }
-    RESET_HEAD(disk);                                 /* Everytime close device, reset head */
-    disk.open_count++;
+    file->f_pos = 0;                                  /* Every open file starts at block 0 */
+    atomic_inc(&disk.open_count);
     try_module_get(THIS_MODULE);
     return 0;
 }
@@ -264,9 +585,15 @@ static int
 device_release(struct inode *inode, struct file *file) {
                                                       /* Decrement the open counter and usage count. 
                                                          Without this, the module would not unload. */
+    int ret;
+
     IGNORE_ARG(inode);
     IGNORE_ARG(file);
-    disk.open_count--;
+    if (atomic_dec_and_test(&disk.open_count) && backing != NULL) {
+        ret = backing_save();                         /* Last user gone, persist */
+        if (ret)
+            kernel_alert("can't save to %s, ret %d", backing, ret);
+    }
     module_put(THIS_MODULE);
     return 0;
 }
@@ -276,19 +603,48 @@ device_release(struct inode *inode, struct file *file) {
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    int major_num, ret;
+
+    disk_size = disk_size / CONFIG_BLOCK_SZ * CONFIG_BLOCK_SZ;
+    if (disk_size == 0 || disk_size > INT_MAX) {      /* IOC_REQ_DEVICE_SIZE returns an int */
+        kernel_alert("invalid disk_size %lu", disk_size);
+        return -EINVAL;
+    }
+    disk.layout_size = disk_size;
+    disk.layout = vzalloc(disk_size);
+    disk.dirty = bitmap_zalloc(DIV_ROUND_UP(disk_size, CONFIG_STRIPE_SZ), GFP_KERNEL);
+    if (disk.layout == NULL || disk.dirty == NULL) {
+        kernel_alert("can't allocate a disk of %lu bytes", disk_size);
+        ret = -ENOMEM;
+        goto fail;
+    }
+    if (backing != NULL) {
+        ret = backing_load();
+        if (ret) {
+            kernel_alert("can't load %s, ret %d", backing, ret);
+            goto fail;
+        }
+        kernel_info("loaded %s", backing);
+    }
+    for (int i = 0; i < CONFIG_STRIPES; i++)          /* Ready before anyone can open */
+        init_rwsem(&stripes[i]);
+    clock_origin = ktime_get_ns();
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
-        return major_num;
+        ret = major_num;
+        goto fail;
     } 
-    else {                                            /* Register success */                                                  
-        kernel_info("module loaded with device major number %d", major_num);
-        disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
-        return 0;
-    }
+                                                      /* Register success, ddriver.sh reads
+                                                         the major number from the last line */
+    kernel_info("%lu bytes, module loaded with device major number %d", disk_size, major_num);
+    disk.major_num = major_num;
     return 0;
+fail:
+    bitmap_free(disk.dirty);
+    vfree(disk.layout);
+    return ret;
 }
 
 static void __exit 
@@ -299,6 +655,11 @@ ddriver_exit(void)
     if(major_num != 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    if (backing != NULL && backing_save())
+        kernel_alert("can't save to %s, data since the last close is lost", backing);
+    bitmap_free(disk.dirty);
+    vfree(disk.layout);
+    vfree(trace.recs);
 }
 
 module_init(ddriver_init);
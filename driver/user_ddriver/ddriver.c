@@ -1,3 +1,4 @@
+#define _GNU_SOURCE                                  /* fallocate */
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -10,6 +11,7 @@
 #include "errno.h"
 #include <pwd.h>
 #include <time.h>
+#include <pthread.h>
 
 extern int errno;
 
@@ -53,11 +55,26 @@ extern int errno;
 #define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
 #define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+/* 计数器可能被多个线程同时更新（例如 newfs 的回收线程和 FUSE 线程） */
+#define STAT_ADD(field, n)      __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define INC_READCNT(disk)       STAT_ADD(disk.read_cnt, 1)
+#define INC_WRITECNT(disk)      STAT_ADD(disk.write_cnt, 1)
+#define INC_SEEKCNT(disk)       STAT_ADD(disk.seek_cnt, 1)
 
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
+#define NSEC_PER_SEC            1000000000ull
+#define NSEC_PER_MSEC           1000000ull
+#define NSEC_PER_USEC           1000ull
+
+/* 延迟模型，打开设备时按环境变量 DDRIVER_LATENCY 选择，默认 legacy */
+#define LAT_ENV                 "DDRIVER_LATENCY"
+/* hdd：7200 转，4M 磁盘只占盘面上很窄的一圈，寻道都是短寻道 */
+#define HDD_REV_NS              (60 * NSEC_PER_SEC / 7200)
+#define HDD_TRACK_SZ            (512 * 1024)        /* 每道 1024 个扇区，约 63MB/s */
+#define HDD_SETTLE_NS           (800 * NSEC_PER_USEC)
+#define HDD_SEEK_NS             (200 * NSEC_PER_USEC) /* 乘 sqrt(跨过的道数) */
+#define FLASH_MAX_CHANNELS      16
+/* DDRIVER_CLOCK=virtual：模拟的延迟不睡眠，只推进调用线程的设备时钟 */
+#define CLOCK_ENV               "DDRIVER_CLOCK"
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
@@ -75,6 +92,40 @@ struct ddriver
     int  layout_size;
     int  iounit_size;
 };
+
+/* 闪存的参数：请求按页落到通道上，同一通道上的请求排队，不同通道可以并行 */
+struct flash_params
+{
+    unsigned int page_sz;
+    unsigned int channels;
+    unsigned long long cmd_ns;                       /* 每个请求的接口开销 */
+    unsigned long long read_ns;                      /* 每页 */
+    unsigned long long write_ns;                     /* 每页，写缓存命中的时间 */
+};
+
+/**
+ * seek 和 io 返回这次请求应该花的时间(ns)，now 是请求开始的时间；
+ * 请求做完后等到 now + 返回值才返回
+ */
+struct ddriver_lat_model
+{
+    const char *name;
+    unsigned long long (*seek)(const struct ddriver_lat_model *, off_t from, off_t to,
+                               unsigned long long now);
+    unsigned long long (*io)(const struct ddriver_lat_model *, int op, off_t pos, size_t size,
+                             unsigned long long now);
+    const struct flash_params *flash;
+};
+
+struct ddriver_trace
+{
+    struct ddriver_trace_rec *recs;                  /* Ring buffer, NULL if never started */
+    unsigned int       cap;
+    unsigned long long total;                        /* Requests traced since start */
+    unsigned long long start_ns;
+    unsigned short     tag;
+    int                enabled;
+};
 /******************************************************************************
 * SECTION: Global Variable
 *******************************************************************************/
@@ -92,6 +143,33 @@ struct ddriver disk = {
     .iounit_size = CONFIG_BLOCK_SZ
 };
 
+static struct ddriver_trace trace = {
+    .recs        = NULL,
+    .enabled     = 0
+};
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; /* 保护 trace 的环形缓冲区和下标 */
+
+static struct ddriver_state_v2 stats;               /* Cleared by IOC_REQ_STATS_RESET */
+
+static struct {
+    off_t              next_pos;                     /* 上一次读写结束的位置 */
+    int                moved;                        /* 之后磁头离开过，要等盘片转到扇区 */
+} hdd = { .next_pos = -1 };
+
+static unsigned long long flash_busy[FLASH_MAX_CHANNELS]; /* 各通道忙到什么时候 */
+
+/*
+ * 设备时钟 = CLOCK_MONOTONIC + 本线程跳过的等待。实时模式下跳过的等待为 0；
+ * 虚拟模式下每个线程各自往前走，请求在共享的通道上排队，不同线程的请求可以重叠
+ */
+static struct {
+    int                virtual;
+    unsigned long long origin;                       /* clock_ns 的起点 */
+    unsigned long long horizon;                      /* 各线程的请求最晚结束在什么时候 */
+} dclock;
+
+static __thread unsigned long long clock_skew;
+
 FILE *debugf = NULL;
 /******************************************************************************
 * SECTION: Helper Functions
@@ -104,18 +182,394 @@ int check_valid(size_t size) {
     return 0;
 }
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
-    
-    if (distance == 0) {
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief 调用线程看到的设备时钟
+ */
+static unsigned long long dev_now(void) {
+    return now_ns() + clock_skew;
+}
+
+/**
+ * @brief 设备时钟从起点起走过的时间，取各线程里走得最远的
+ */
+static unsigned long long clock_elapsed(void) {
+    unsigned long long now = dev_now();
+    unsigned long long horizon = __atomic_load_n(&dclock.horizon, __ATOMIC_RELAXED);
+
+    return (now > horizon ? now : horizon) - dclock.origin;
+}
+
+static void clock_reset(void) {
+    dclock.origin = dev_now();
+    __atomic_store_n(&dclock.horizon, dclock.origin, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 等到 start + sim，亚毫秒精度，被信号打断后接着等；
+ * 虚拟时钟下不睡眠，把本线程的时钟拨到 start + sim
+ */
+static void lat_wait(unsigned long long start, unsigned long long sim) {
+    unsigned long long deadline = start + sim, now, horizon;
+    struct timespec ts = { deadline / NSEC_PER_SEC, deadline % NSEC_PER_SEC };
+
+    if (sim == 0) {
+        return;
+    }
+    if (dclock.virtual) {
+        now = dev_now();
+        clock_skew += deadline > now ? deadline - now : 0;
+        horizon = __atomic_load_n(&dclock.horizon, __ATOMIC_RELAXED);
+        while (horizon < deadline &&
+               !__atomic_compare_exchange_n(&dclock.horizon, &horizon, deadline, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+        return;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static unsigned long long isqrt(unsigned long long x) {
+    unsigned long long r = 0, bit = 1ull << 62;
+
+    while (bit > x) {
+        bit >>= 2;
+    }
+    for (; bit != 0; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+/**
+ * @brief none：不模拟延迟
+ */
+static unsigned long long none_seek(const struct ddriver_lat_model *m, off_t from, off_t to,
+                                    unsigned long long now) {
+    return 0;
+}
+
+static unsigned long long none_io(const struct ddriver_lat_model *m, int op, off_t pos,
+                                  size_t size, unsigned long long now) {
+    return 0;
+}
+
+/**
+ * @brief legacy：原来的模型，读 read_lat ms，写 write_lat ms，seek 按移动距离在
+ * 一道内的余数折算 seek_lat，只是不再取整到毫秒
+ */
+static unsigned long long legacy_seek(const struct ddriver_lat_model *m, off_t from, off_t to,
+                                      unsigned long long now) {
+    unsigned long long bytes_per_track = disk.layout_size / disk.track_num;
+    unsigned long long distance = (to > from ? to - from : from - to) % bytes_per_track;
+
+    return distance * disk.seek_lat * NSEC_PER_MSEC / bytes_per_track;
+}
+
+static unsigned long long legacy_io(const struct ddriver_lat_model *m, int op, off_t pos,
+                                    size_t size, unsigned long long now) {
+    return (op == DDRIVER_TRACE_READ ? disk.read_lat : disk.write_lat) * NSEC_PER_MSEC;
+}
+
+/**
+ * @brief hdd：换道的寻道时间是 settle + k * sqrt(道数)；磁头离开过之后的第一次读写
+ * 要等盘片按当前时间转到扇区所在的角度，顺序读写只有传输时间
+ */
+static unsigned long long hdd_seek(const struct ddriver_lat_model *m, off_t from, off_t to,
+                                   unsigned long long now) {
+    off_t tracks = to / HDD_TRACK_SZ - from / HDD_TRACK_SZ;
+
+    if (to != from) {
+        hdd.moved = 1;
+    }
+    if (tracks == 0) {
         return 0;
     }
+    return HDD_SETTLE_NS + HDD_SEEK_NS * isqrt(tracks > 0 ? tracks : -tracks);
+}
+
+static unsigned long long hdd_io(const struct ddriver_lat_model *m, int op, off_t pos,
+                                 size_t size, unsigned long long now) {
+    unsigned long long xfer = size * HDD_REV_NS / HDD_TRACK_SZ;
+    unsigned long long rot = 0;
+
+    if (hdd.moved || pos != hdd.next_pos) {
+        unsigned long long head = now % HDD_REV_NS;
+        unsigned long long sector = (pos % HDD_TRACK_SZ) * HDD_REV_NS / HDD_TRACK_SZ;
+
+        rot = (sector + HDD_REV_NS - head) % HDD_REV_NS;
+        hdd.moved = 0;
+    }
+    hdd.next_pos = pos + size;
+    return rot + xfer;
+}
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+/**
+ * @brief ssd / nvme：按页计费，页所在的通道忙时排队，多个线程的请求落在不同通道上可以重叠
+ */
+static unsigned long long flash_seek(const struct ddriver_lat_model *m, off_t from, off_t to,
+                                     unsigned long long now) {
     return 0;
 }
+
+static unsigned long long flash_io(const struct ddriver_lat_model *m, int op, off_t pos,
+                                   size_t size, unsigned long long now) {
+    const struct flash_params *fp = m->flash;
+    unsigned long long pages = (pos + size + fp->page_sz - 1) / fp->page_sz - pos / fp->page_sz;
+    unsigned long long cost = fp->cmd_ns + pages * (op == DDRIVER_TRACE_READ ? fp->read_ns
+                                                                             : fp->write_ns);
+    unsigned long long *busy = &flash_busy[(pos / fp->page_sz) % fp->channels];
+    unsigned long long old = __atomic_load_n(busy, __ATOMIC_RELAXED), done;
+
+    do {
+        done = (old > now ? old : now) + cost;
+    } while (!__atomic_compare_exchange_n(busy, &old, done, 0, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return done - now;
+}
+
+static const struct flash_params ssd_params = {
+    .page_sz  = 4096,
+    .channels = 4,
+    .cmd_ns   = 10 * NSEC_PER_USEC,                  /* SATA */
+    .read_ns  = 70 * NSEC_PER_USEC,
+    .write_ns = 30 * NSEC_PER_USEC
+};
+
+static const struct flash_params nvme_params = {
+    .page_sz  = 4096,
+    .channels = 8,
+    .cmd_ns   = 2 * NSEC_PER_USEC,
+    .read_ns  = 20 * NSEC_PER_USEC,
+    .write_ns = 10 * NSEC_PER_USEC
+};
+
+static const struct ddriver_lat_model lat_models[] = {
+    { "legacy", legacy_seek, legacy_io, NULL },
+    { "hdd",    hdd_seek,    hdd_io,    NULL },
+    { "ssd",    flash_seek,  flash_io,  &ssd_params },
+    { "nvme",   flash_seek,  flash_io,  &nvme_params },
+    { "none",   none_seek,   none_io,   NULL },
+};
+
+static const struct ddriver_lat_model *lat_model = &lat_models[0];
+
+/**
+ * @brief 按 DDRIVER_LATENCY 选择延迟模型，按 DDRIVER_CLOCK 选择实时或虚拟时钟
+ */
+static void lat_select(void) {
+    const char *name = getenv(LAT_ENV);
+    const char *clock = getenv(CLOCK_ENV);
+
+    name = name != NULL && *name != '\0' ? name : NULL;
+    lat_model = &lat_models[0];
+    for (size_t i = 0; name != NULL && i < sizeof(lat_models) / sizeof(lat_models[0]); i++) {
+        if (strcmp(name, lat_models[i].name) == 0) {
+            lat_model = &lat_models[i];
+        }
+    }
+    if (name != NULL && strcmp(name, lat_model->name) != 0) {
+        user_alert("unknown " LAT_ENV " [%s], use %s", name, lat_model->name);
+    }
+    clock = clock != NULL && *clock != '\0' ? clock : "real";
+    dclock.virtual = strcmp(clock, "virtual") == 0;
+    if (!dclock.virtual && strcmp(clock, "real") != 0) {
+        user_alert("unknown " CLOCK_ENV " [%s], use real", clock);
+    }
+    fprintf(debugf, USER_INFO DEVICE_NAME " latency model %s, %s clock\n", lat_model->name,
+            dclock.virtual ? "virtual" : "real");
+}
+
+static void lat_reset(void) {
+    hdd.next_pos = -1;
+    hdd.moved = 0;
+    memset(flash_busy, 0, sizeof(flash_busy));
+}
+
+/**
+ * @brief 延迟所在的直方图桶，桶 i 为 [2^(i-1), 2^i) us
+ */
+static int hist_bucket(unsigned long long lat_ns) {
+    unsigned long long us = lat_ns / 1000;
+    int bucket = 0;
+
+    while (us != 0 && bucket < DDRIVER_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * @brief 记录一次请求，环形缓冲区满了覆盖最早的记录
+ * 
+ * @param op DDRIVER_TRACE_*
+ * @param offset 请求的位置
+ * @param size 请求大小
+ * @param t0 请求开始的时间
+ * @param lat 请求耗时
+ */
+static void trace_record(int op, off_t offset, size_t size, unsigned long long t0,
+                         unsigned long long lat) {
+    struct ddriver_trace_rec *rec;
+
+    if (!__atomic_load_n(&trace.enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace.enabled) {
+        rec = &trace.recs[trace.total % trace.cap];
+        rec->ts_ns  = t0 - trace.start_ns;
+        rec->offset = offset;
+        rec->lat_ns = lat;
+        rec->size   = size;
+        rec->op     = op;
+        rec->tag    = trace.tag;
+        trace.total++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * @brief 请求完成，更新扩展统计并写跟踪记录
+ * 
+ * @param sim_ns 这次请求模拟的延迟
+ */
+static void request_done(int op, off_t offset, size_t size, unsigned long long sim_ns,
+                         unsigned long long t0) {
+    unsigned long long lat = dev_now() - t0;
+
+    STAT_ADD(stats.ops[op], 1);
+    STAT_ADD(stats.bytes[op], size);
+    STAT_ADD(stats.sim_ns[op], sim_ns);
+    STAT_ADD(stats.lat_ns[op], lat);
+    STAT_ADD(stats.hist[op][hist_bucket(lat)], 1);
+    trace_record(op, offset, size, t0, lat);
+}
+
+/**
+ * @brief 调用者绕过驱动直接读写了镜像（newfs --zero-copy），按一次普通的读写请求
+ * 计入延迟模型、统计和跟踪，结果和经过 ddriver_read / ddriver_write 时可比；
+ * 不移动磁头位置，另外计入 direct_bytes
+ */
+static int device_direct(int fd, const struct ddriver_direct *direct) {
+    unsigned long long t0, sim;
+    off_t cur;
+
+    if ((direct->op != DDRIVER_TRACE_READ && direct->op != DDRIVER_TRACE_WRITE) ||
+        direct->offset > CONFIG_DISK_SZ || direct->len > CONFIG_DISK_SZ - direct->offset) {
+        return -EINVAL;
+    }
+    t0 = dev_now();
+    cur = lseek(fd, 0, SEEK_CUR);
+    sim = lat_model->seek(lat_model, cur, direct->offset, t0);
+    sim += lat_model->io(lat_model, direct->op, direct->offset, direct->len, t0 + sim);
+    lat_wait(t0, sim);
+    if (direct->op == DDRIVER_TRACE_READ) {
+        STAT_ADD(disk.read_cnt, direct->len / CONFIG_BLOCK_SZ);
+    } else {
+        STAT_ADD(disk.write_cnt, direct->len / CONFIG_BLOCK_SZ);
+    }
+    STAT_ADD(stats.direct_bytes[direct->op], direct->len);
+    request_done(direct->op, direct->offset, direct->len, sim, t0);
+    return 0;
+}
+
+static int trace_start(int cap) {
+    struct ddriver_trace_rec *recs;
+
+    if (cap < 0) {
+        return -EINVAL;
+    }
+    cap = cap == 0 ? DDRIVER_TRACE_DEF_RECS : cap;
+    recs = (struct ddriver_trace_rec *)calloc(cap, sizeof(struct ddriver_trace_rec));
+    if (recs == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_lock(&trace_lock);
+    free(trace.recs);
+    trace.recs     = recs;
+    trace.cap      = cap;
+    trace.total    = 0;
+    trace.tag      = 0;
+    trace.start_ns = dev_now();
+    trace.enabled  = 1;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/**
+ * @brief 拷贝最新的 min(记录数, dump->max) 条记录，按时间先后
+ */
+static int trace_dump(struct ddriver_trace_dump *dump) {
+    unsigned long long first;
+    unsigned int cnt;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace.recs == NULL) {
+        dump->cnt = 0;
+        dump->total = 0;
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+    cnt = trace.total < trace.cap ? trace.total : trace.cap;
+    cnt = cnt < dump->max ? cnt : dump->max;
+    first = trace.total - cnt;
+    for (unsigned int i = 0; i < cnt; i++) {
+        dump->recs[i] = trace.recs[(first + i) % trace.cap];
+    }
+    dump->cnt = cnt;
+    dump->total = trace.total;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/**
+ * @brief 把 [offset, offset + len) 变成 0：优先在镜像里打洞，文件系统不支持时写 0
+ * 
+ * 打洞和写 0 都用 pwrite 语义，不移动磁头
+ * @return int 0成功，否则返回 -EIO
+ */
+static int disk_zero_range(int fd, off_t offset, off_t len) {
+    char buf[4096] = {'\0'};
+    off_t done;
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    for (done = 0; done < len; done += sizeof(buf)) {
+        size_t sz = len - done < (off_t)sizeof(buf) ? len - done : sizeof(buf);
+        if (pwrite(fd, buf, sz, offset + done) != (ssize_t)sz) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 整盘清零：打洞，不支持时截断再扩回原大小，最后才逐块写 0
+ */
+static int disk_wipe(int fd) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, CONFIG_DISK_SZ) == 0) {
+        return 0;
+    }
+    if (ftruncate(fd, 0) == 0 && ftruncate(fd, CONFIG_DISK_SZ) == 0) {
+        return 0;
+    }
+    return disk_zero_range(fd, 0, CONFIG_DISK_SZ);
+}
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
@@ -125,7 +579,8 @@ int emulate_rotate(int fd, off_t start, off_t end) {
  * @return int 文件描述符
  */
 int ddriver_open(char *path) {
-    int fd, ret = 0;
+    struct stat st;
+    int fd;
     char device_path[128] = {0};
     char log_path[128] = {0};
     
@@ -147,10 +602,11 @@ int ddriver_open(char *path) {
         user_panic("can't open device: %d", fd);
         return fd;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
-        return ret;
+    /* 镜像是稀疏文件：只在不够大时扩到磁盘大小，没写过的块读出来是 0，不再预分配整盘 */
+    if (fstat(fd, &st) < 0 || (st.st_size < CONFIG_DISK_SZ && ftruncate(fd, CONFIG_DISK_SZ) < 0)) {
+        user_panic("can't size device: %s", strerror(errno));
+        close(fd);
+        return -1;
     }
 
     debugf = fopen(log_path, "w+");
@@ -158,6 +614,9 @@ int ddriver_open(char *path) {
         user_panic("can't init log: %s", log_path);
         return -1;
     }
+    lat_select();
+    lat_reset();
+    clock_reset();
 
     return fd;
 }
@@ -168,6 +627,11 @@ int ddriver_open(char *path) {
  * @return int 
  */
 int ddriver_close(int fd) {
+    pthread_mutex_lock(&trace_lock);
+    free(trace.recs);
+    trace.recs = NULL;
+    trace.enabled = 0;
+    pthread_mutex_unlock(&trace_lock);
     return close(fd) && fclose(debugf);
 }
 /**
@@ -181,6 +645,7 @@ int ddriver_close(int fd) {
 int ddriver_seek(int fd, off_t offset, int whence){
     int ret = 0;
     int cur = 0;
+    unsigned long long t0, sim;
 
     if (!IS_ADDR_ALIGN(offset)) {
         user_alert("offset %ld must be aligned to block size %d", 
@@ -188,6 +653,7 @@ int ddriver_seek(int fd, off_t offset, int whence){
         return -EINVAL;
     }
 
+    t0 = dev_now();
     INC_SEEKCNT(disk);
     cur = lseek(fd, 0, SEEK_CUR);
     ret = lseek(fd, offset, whence);
@@ -195,7 +661,10 @@ int ddriver_seek(int fd, off_t offset, int whence){
         user_panic("seek error: %s", strerror(errno));
         return ret;
     }
-    emulate_rotate(fd, cur, ret);
+    sim = lat_model->seek(lat_model, cur, ret, t0);
+    lat_wait(t0, sim);
+    STAT_ADD(stats.seek_dist, abs(ret - cur));
+    request_done(DDRIVER_TRACE_SEEK, ret, 0, sim, t0);
     return ret;
 }
 /**
@@ -207,14 +676,22 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
+    unsigned long long t0, sim;
+    off_t pos = 0;
     int res = check_valid(size);
     if(res < 0)
         return res;
         
-    RW_DELAY(disk, write);
+    t0 = dev_now();
+    if (__atomic_load_n(&trace.enabled, __ATOMIC_RELAXED) || lat_model->io != none_io) {
+        pos = lseek(fd, 0, SEEK_CUR);
+    }
+    sim = lat_model->io(lat_model, DDRIVER_TRACE_WRITE, pos, size, t0);
     write(fd, buf, size);
+    lat_wait(t0, sim);
 
     INC_WRITECNT(disk);
+    request_done(DDRIVER_TRACE_WRITE, pos, size, sim, t0);
     return CONFIG_BLOCK_SZ;
 }
 /**
@@ -226,14 +703,22 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
+    unsigned long long t0, sim;
+    off_t pos = 0;
     int res = check_valid(size);
     if(res < 0)
         return res;
 
-    RW_DELAY(disk, read);
+    t0 = dev_now();
+    if (__atomic_load_n(&trace.enabled, __ATOMIC_RELAXED) || lat_model->io != none_io) {
+        pos = lseek(fd, 0, SEEK_CUR);
+    }
+    sim = lat_model->io(lat_model, DDRIVER_TRACE_READ, pos, size, t0);
     read(fd, buf, size);
+    lat_wait(t0, sim);
 
     INC_READCNT(disk);
+    request_done(DDRIVER_TRACE_READ, pos, size, sim, t0);
     return CONFIG_BLOCK_SZ;
 }
 /**
@@ -246,6 +731,7 @@ int ddriver_read(int fd, char *buf, size_t size){
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
     struct ddriver_state state;
+    struct ddriver_discard *discard;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
@@ -258,20 +744,61 @@ int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
+        if (disk_wipe(fd) < 0) {
+            return -EIO;
         }
         lseek(fd, 0, SEEK_SET);
+        lat_reset();
+        clock_reset();
         disk.read_cnt = 0;
         disk.write_cnt = 0;
         disk.seek_cnt = 0;
+        memset(&stats, 0, sizeof(stats));
         break;
     case IOC_REQ_DEVICE_IO_SZ:
         memcpy(arg, &disk.iounit_size, sizeof(int));
         break;
+    case IOC_REQ_TRACE_START:                         /* Start tracing, arg: ring size */
+        return trace_start(arg == NULL ? 0 : *(int *)arg);
+    case IOC_REQ_TRACE_STOP:
+        pthread_mutex_lock(&trace_lock);
+        trace.enabled = 0;
+        pthread_mutex_unlock(&trace_lock);
+        break;
+    case IOC_REQ_TRACE_DUMP:
+        return trace_dump((struct ddriver_trace_dump *)arg);
+    case IOC_REQ_TRACE_TAG:                           /* Tag the following requests */
+        pthread_mutex_lock(&trace_lock);
+        trace.tag = *(int *)arg;
+        pthread_mutex_unlock(&trace_lock);
+        break;
+    case IOC_REQ_DEVICE_STATE_V2:                     /* 64-bit counters and histograms */
+        stats.clock_ns = clock_elapsed();
+        stats.clock_virtual = dclock.virtual;
+        memcpy(arg, &stats, sizeof(struct ddriver_state_v2));
+        break;
+    case IOC_REQ_STATS_RESET:                         /* Reset statistics, keep the disk */
+        disk.read_cnt = 0;
+        disk.write_cnt = 0;
+        disk.seek_cnt = 0;
+        memset(&stats, 0, sizeof(stats));
+        clock_reset();
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Zero a range, keep the head */
+        discard = (struct ddriver_discard *)arg;
+        if (!IS_ADDR_ALIGN(discard->offset) || !IS_ADDR_ALIGN(discard->len) ||
+            discard->offset > CONFIG_DISK_SZ || discard->len > CONFIG_DISK_SZ - discard->offset) {
+            return -EINVAL;
+        }
+        if (discard->len == 0) {
+            break;
+        }
+        return disk_zero_range(fd, discard->offset, discard->len);
+    case IOC_REQ_DEVICE_CLOCK:                        /* Device clock of the calling thread */
+        *(unsigned long long *)arg = dev_now();
+        break;
+    case IOC_REQ_DEVICE_DIRECT:                       /* Account an IO done on the image directly */
+        return device_direct(fd, (struct ddriver_direct *)arg);
     default:
         break;
     }
@@ -13,9 +13,76 @@ struct ddriver_state
     int seek_cnt;
 };
 
+/* 请求跟踪：每次 read / write / seek 记录一条，放在驱动内的环形缓冲区里 */
+#define DDRIVER_TRACE_READ      0
+#define DDRIVER_TRACE_WRITE     1
+#define DDRIVER_TRACE_SEEK      2
+#define DDRIVER_TRACE_DEF_RECS  65536
+
+struct ddriver_trace_rec
+{
+    unsigned long long ts_ns;           /* 距开始跟踪的时间 */
+    unsigned int       offset;          /* 读写时的磁头位置，SEEK 为目标位置 */
+    unsigned int       lat_ns;          /* 请求耗时，包括模拟的延迟 */
+    unsigned int       size;
+    unsigned short     op;              /* DDRIVER_TRACE_* */
+    unsigned short     tag;             /* IOC_REQ_TRACE_TAG 设置的调用方标记 */
+};
+
+struct ddriver_trace_dump
+{
+    struct ddriver_trace_rec *recs;     /* 调用方的缓冲区 */
+    unsigned int       max;             /* 缓冲区能放的记录数 */
+    unsigned int       cnt;             /* 返回: 拷贝的记录数，最新的 cnt 条，按时间先后 */
+    unsigned long long total;           /* 返回: 开始跟踪以来的请求数，大于 cnt 时更早的已被覆盖 */
+};
+
+/* 扩展统计：64 位计数器和按操作分的对数延迟直方图，数组下标同 DDRIVER_TRACE_* */
+#define DDRIVER_STAT_OPS        3
+#define DDRIVER_HIST_BUCKETS    32
+
+struct ddriver_state_v2
+{
+    unsigned long long ops[DDRIVER_STAT_OPS];       /* 请求数 */
+    unsigned long long bytes[DDRIVER_STAT_OPS];     /* 传输的字节数，SEEK 为 0 */
+    unsigned long long seek_dist;                   /* SEEK 移动磁头的总距离（字节） */
+    unsigned long long sim_ns[DDRIVER_STAT_OPS];    /* 模拟的寻道、旋转、读写延迟之和 */
+    unsigned long long lat_ns[DDRIVER_STAT_OPS];    /* 请求按设备时钟的耗时之和，包括模拟的延迟 */
+    unsigned long long hist[DDRIVER_STAT_OPS][DDRIVER_HIST_BUCKETS];
+                                                    /* 桶 0: <1us，桶 i: [2^(i-1), 2^i) us，最后一个桶不封顶 */
+    unsigned long long clock_ns;                    /* 设备时钟从打开或清零统计起走过的时间 */
+    unsigned long long clock_virtual;               /* 1: 虚拟时钟，模拟的延迟不睡眠，只推进时钟 */
+    unsigned long long direct_bytes[DDRIVER_STAT_OPS];
+                                                    /* bytes 中调用者绕过驱动直接读写镜像的部分，见 IOC_REQ_DEVICE_DIRECT */
+};
+
+/* 丢弃一段磁盘内容，之后读出来是 0；offset 和 len 按 IO 大小对齐 */
+struct ddriver_discard
+{
+    unsigned int offset;
+    unsigned int len;
+};
+
+/* 调用者绕过驱动直接读写了镜像中的一段（newfs --zero-copy），op 为 DDRIVER_TRACE_READ / WRITE */
+struct ddriver_direct
+{
+    unsigned int offset;
+    unsigned int len;
+    int          op;
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小 */
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)    /* 请求设备状态，返回 ddriver_state */
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)                           /* 请求重置设备 */
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)                     /* 请求设备IO大小 */
+#define IOC_REQ_TRACE_START     _IOW(IOC_MAGIC, 4, int)                     /* 开始跟踪，参数为环形缓冲区记录数，0 用默认值 */
+#define IOC_REQ_TRACE_STOP      _IO(IOC_MAGIC, 5)                           /* 停止跟踪，已有记录保留到下次开始 */
+#define IOC_REQ_TRACE_DUMP      _IOWR(IOC_MAGIC, 6, struct ddriver_trace_dump) /* 导出跟踪记录 */
+#define IOC_REQ_TRACE_TAG       _IOW(IOC_MAGIC, 7, int)                     /* 设置之后请求的调用方标记 */
+#define IOC_REQ_DEVICE_STATE_V2 _IOR(IOC_MAGIC, 8, struct ddriver_state_v2) /* 请求扩展统计，返回 ddriver_state_v2 */
+#define IOC_REQ_STATS_RESET     _IO(IOC_MAGIC, 9)                           /* 清零全部统计，不动磁盘内容 */
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 10, struct ddriver_discard) /* 丢弃一段磁盘内容，用户态 ddriver 在镜像里打洞 */
+#define IOC_REQ_DEVICE_CLOCK    _IOR(IOC_MAGIC, 11, unsigned long long)     /* 调用线程看到的设备时钟(ns)，实时模式下即 CLOCK_MONOTONIC */
+#define IOC_REQ_DEVICE_DIRECT   _IOW(IOC_MAGIC, 12, struct ddriver_direct)  /* 按一次读写请求计入统计、跟踪和延迟模型，内核 ddriver 不支持 */
 
 #endif
\ No newline at end of file
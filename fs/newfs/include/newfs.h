@@ -1,7 +1,7 @@
 #ifndef _NEWFS_H_
 #define _NEWFS_H_
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 29
 #include "stdio.h"
 #include <unistd.h>
 #include "fcntl.h"
@@ -22,6 +22,7 @@ void* 			   newfs_init(struct fuse_conn_info *);
 void  			   newfs_destroy(void *);
 int   			   newfs_mkdir(const char *, mode_t);
 int   			   newfs_getattr(const char *, struct stat *);
+int   			   newfs_fgetattr(const char *, struct stat *, struct fuse_file_info *);
 int   			   newfs_readdir(const char *, void *, fuse_fill_dir_t, off_t,
 						                struct fuse_file_info *);
 int   			   newfs_mknod(const char *, mode_t, dev_t);
@@ -29,14 +30,22 @@ int   			   newfs_write(const char *, const char *, size_t, off_t,
 					                  struct fuse_file_info *);
 int   			   newfs_read(const char *, char *, size_t, off_t,
 					                 struct fuse_file_info *);
+int   			   newfs_write_buf(const char *, struct fuse_bufvec *, off_t,
+					                      struct fuse_file_info *);
+int   			   newfs_read_buf(const char *, struct fuse_bufvec **, size_t, off_t,
+					                     struct fuse_file_info *);
 int   			   newfs_access(const char *, int);
 int   			   newfs_unlink(const char *);
 int   			   newfs_rmdir(const char *);
 int   			   newfs_rename(const char *, const char *);
+int   			   newfs_rename2(const char *, const char *, unsigned int);
 int   			   newfs_utimens(const char *, const struct timespec tv[2]);
 int   			   newfs_truncate(const char *, off_t);
+int   			   newfs_ftruncate(const char *, off_t, struct fuse_file_info *);
+int   			   newfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
+int   			   newfs_release(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
 /******************************************************************************
 * SECTION: newfs_util.c
@@ -45,11 +54,97 @@ struct newfs_inode*  allocate_inode(struct newfs_dentry * dentry);
 int allocate_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry);
 int newfs_driver_read(int offset, uint8_t *out_content, int size);
 int newfs_driver_write(int offset, uint8_t *out_content, int size);
+int newfs_driver_discard(int offset, int size);
+void newfs_driver_direct(int op, off_t offset, size_t size);
 int sync_inode(struct newfs_inode * inode);
 struct newfs_dentry* lookup(const char * path, boolean* is_find, boolean * is_root);
 struct newfs_inode* read_inode(struct newfs_dentry * dentry, int ino);
+int newfs_load_dentries(struct newfs_inode * inode);
+uint8_t* newfs_load_data(struct newfs_inode * inode, int blk_idx);
+uint8_t* newfs_prepare_write(struct newfs_inode * inode, int blk_idx, boolean is_full);
+int newfs_inline_fit(struct newfs_inode * inode, off_t end);
+uint8_t* newfs_inode_slot(int ino);
+int newfs_flush_inodes(void);
 char* get_fname(const char * path);
 struct newfs_dentry* get_dentry(struct newfs_inode * inode, int dir);
 void dump_map();
-void allocate_data(struct newfs_inode *inode);
+int allocate_data(struct newfs_inode *inode, int blk_idx);
+int allocate_data_no(struct newfs_inode *inode, int blk_idx);
+int allocate_data_run(struct newfs_inode *inode, int blk_idx, int blk_cnt);
+int reserve_data(struct newfs_inode *inode, int blk_idx);
+void unreserve_data(int cnt);
+int allocate_delayed(struct newfs_inode *inode);
+void free_data(struct newfs_inode *inode, int blk_idx);
+int free_data_from(struct newfs_inode *inode, int blk_idx);
+void release_blocks(int *datanos, int data_cnt, int *inos, int ino_cnt);
+int newfs_drop_dentry(struct newfs_inode *inode, struct newfs_dentry *dentry);
+int newfs_trace_tag(int tag);
+int newfs_trace_save(const char *path);
+/******************************************************************************
+* SECTION: newfs_stats.c
+*******************************************************************************/
+extern struct newfs_stats nfs_stats;
+extern struct newfs_stats_seq nfs_stats_seq;
+
+#define NFS_STAT_ADD(field, n)  __atomic_fetch_add(&nfs_stats.field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define NFS_STAT_SUB(field, n)  __atomic_fetch_sub(&nfs_stats.field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define NFS_STAT_INC(field)     NFS_STAT_ADD(field, 1)
+/* 需要彼此一致的几个计数器放在 BEGIN / END 之间更新，读者据此重试，见 newfs_ctl_open */
+#define NFS_STAT_BEGIN()        do { __atomic_fetch_add(&nfs_stats_seq.begin, 1, __ATOMIC_RELAXED); \
+                                     __atomic_thread_fence(__ATOMIC_RELEASE); } while (0)
+#define NFS_STAT_END()          __atomic_fetch_add(&nfs_stats_seq.end, 1, __ATOMIC_RELEASE)
+
+void     newfs_stats_reset(void);
+uint64_t newfs_stats_now(void);
+void     newfs_stats_op(int op, uint64_t t0);
+void     newfs_stats_lookup(int depth, int scanned, boolean found);
+int      newfs_ctl_path(const char *path);
+int      newfs_ctl_getattr(int ctl, struct stat *st);
+int      newfs_ctl_open(struct fuse_file_info *fi);
+int      newfs_ctl_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+void     newfs_ctl_release(struct fuse_file_info *fi);
+
+/* 标记文件的数据块为脏，新变脏的块计入 dirty_blks，inode 第一次有脏块时计入 dirty_inodes */
+static inline void newfs_mark_dirty(struct newfs_inode *inode, uint32_t bits) {
+	uint32_t added = bits & ~inode->dirty_blks;
+
+	if (added != 0 && IS_REG(inode)) {
+		NFS_STAT_BEGIN();
+		if (inode->dirty_blks == 0) {
+			NFS_STAT_INC(dirty_inodes);
+		}
+		NFS_STAT_ADD(dirty_blks, __builtin_popcount(added));
+		NFS_STAT_END();
+	}
+	inode->dirty_blks |= bits;
+}
+
+static inline void newfs_clear_dirty(struct newfs_inode *inode, uint32_t bits) {
+	uint32_t removed = bits & inode->dirty_blks;
+
+	inode->dirty_blks &= ~bits;
+	if (removed != 0 && IS_REG(inode)) {
+		NFS_STAT_BEGIN();
+		NFS_STAT_SUB(dirty_blks, __builtin_popcount(removed));
+		if (inode->dirty_blks == 0) {
+			NFS_STAT_SUB(dirty_inodes, 1);
+		}
+		NFS_STAT_END();
+	}
+}
+/******************************************************************************
+* SECTION: newfs_layout.c
+*******************************************************************************/
+boolean newfs_valid_blk_sz(int sz_blk, int sz_io);
+int newfs_layout_init(struct newfs_super_d *super_d, int sz_disk, int sz_io,
+                      int sz_blk, int inode_ratio);
+int newfs_layout_check(const struct newfs_super_d *super_d, int sz_disk, int sz_io);
+/******************************************************************************
+* SECTION: newfs_reaper.c
+*******************************************************************************/
+int  newfs_reaper_start(void);
+void newfs_reaper_stop(void);
+void newfs_inode_open(struct newfs_inode *inode);
+void newfs_inode_release(struct newfs_inode *inode);
+void newfs_inode_unlink(struct newfs_inode *inode);
 #endif  /* _newfs_H_ */
\ No newline at end of file
@@ -19,7 +19,10 @@ typedef uint16_t     flag16;
 
 
 #define IO_SZ()				(super.sz_io)
-#define LOGIC_SZ()			(super.sz_io * 2)
+#define LOGIC_SZ()			(super.sz_blk)
+#define NFS_DEFAULT_BLK_SZ()	(super.sz_io * 2)	/* 旧镜像和默认格式化用的逻辑块大小 */
+#define NFS_MIN_BLK_SZ		1024
+#define NFS_MAX_BLK_SZ		(64 * 1024)
 #define DISK_SZ()			(super.sz_disk)
 
 
@@ -45,6 +48,24 @@ typedef uint16_t     flag16;
 #define NFS_ERROR_UNSUPPORTED   ENXIO
 #define NFS_ERROR_IO            EIO     /* Error Input/Output */
 #define NFS_ERROR_INVAL         EINVAL  /* Invalid Args */
+#define NFS_ERROR_FBIG          EFBIG   /* 超过单个文件的最大块数 */
+#define NFS_ERROR_OPNOTSUPP     EOPNOTSUPP
+#define NFS_ERROR_NOTEMPTY      ENOTEMPTY
+#define NFS_ERROR_NOTDIR        ENOTDIR
+#define NFS_ERROR_BUSY          EBUSY
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE        (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE         (1 << 1)
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE     0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE    0x02
+#endif
 
 #define NFS_MAX_FILE_NAME       128
 #define NFS_INODE_PER_FILE      1
@@ -55,16 +76,50 @@ typedef uint16_t     flag16;
 * SECTION: Macro Function
 *******************************************************************************/
 
-#define BLKS_SZ(blks)               ((blks) * IO_SZ()*2) // logic block size 
+#define BLKS_SZ(blks)               ((blks) * LOGIC_SZ()) // logic block size 
 // #define SFS_ASSIGN_FNAME(psfs_dentry, _fname)
                                         // memcpy(psfs_dentry->fname, _fname, strlen(_fname))
-#define INO_OFS(ino)                (super.inode_offset + ino * LOGIC_SZ())
+/*
+ * inode 表中每个 inode 占 super.sz_inode 字节，一个逻辑块放多个 inode。
+ * 新格式化的磁盘 sz_inode = NFS_INODE_SZ，旧镜像 sz_inode = LOGIC_SZ()。
+ */
+#define NFS_INODE_SZ                256
+#define INO_OFS(ino)                (super.inode_offset + (ino) * super.sz_inode)
+#define INO_BLK(ino)                ((ino) * super.sz_inode / LOGIC_SZ())   /* inode 表中的第几块 */
+#define INO_BLK_OFS(ino)            ((ino) * super.sz_inode % LOGIC_SZ())   /* 块内偏移 */
 #define DENTRY_OFS(data_no)              (super.data_offset + data_no* LOGIC_SZ())
+#define DENTRY_PER_BLK()            (LOGIC_SZ() / sizeof(struct newfs_dentry_d))
  
 #define DATA_OFS(datano)               (super.data_offset + datano * LOGIC_SZ())
 
-#define IS_DIR(pinode)              (pinode->dentry->file_type == NFS_DIR)
-#define IS_REG(pinode)              (pinode->dentry->file_type == NFS_REG_FILE)
+#define MAX_FILE_SZ()               (DATA_PER_FILE * LOGIC_SZ())
+
+/*
+ * 小文件的数据直接放在 inode 槽中 newfs_inode_d 之后的空闲部分，不占数据块。
+ * 内联文件的内容在内存里放在 data[0]，data_block_no 全部为 -1。
+ */
+#define NFS_INODE_INLINE            0x1
+#define NFS_INLINE_DATA_OFS         128     /* newfs_inode_d 不能超过这个大小 */
+#define NFS_INLINE_DATA_SZ()        (super.sz_inode - NFS_INLINE_DATA_OFS)
+#define IS_INLINE(pinode)           ((pinode)->flags & NFS_INODE_INLINE)
+#define BLK_IS_HOLE(pinode, idx)    ((pinode)->data_block_no[idx] == -1 && (pinode)->data[idx] == NULL)
+
+#define BLK_DIRTY(pinode, idx)      ((pinode)->dirty_blks & (1u << (idx)))
+#define SET_BLK_DIRTY(pinode, idx)  newfs_mark_dirty(pinode, 1u << (idx))      /* 同时维护脏块统计 */
+#define CLR_BLK_DIRTY(pinode, idx)  newfs_clear_dirty(pinode, 1u << (idx))
+
+/* fallocate 预分配、还没写过的块：磁盘上是旧内容，读出来按 0 处理 */
+/* 延迟分配：已写入缓存、只预留了额度，还没有选磁盘块，data_block_no 为 -1 */
+#define BLK_DELAYED(pinode, idx)        ((pinode)->delayed_blks & (1u << (idx)))
+#define SET_BLK_DELAYED(pinode, idx)    ((pinode)->delayed_blks |= (1u << (idx)))
+#define CLR_BLK_DELAYED(pinode, idx)    ((pinode)->delayed_blks &= ~(1u << (idx)))
+
+#define BLK_UNWRITTEN(pinode, idx)      ((pinode)->unwritten_blks & (1u << (idx)))
+#define SET_BLK_UNWRITTEN(pinode, idx)  ((pinode)->unwritten_blks |= (1u << (idx)))
+#define CLR_BLK_UNWRITTEN(pinode, idx)  ((pinode)->unwritten_blks &= ~(1u << (idx)))
+
+#define IS_DIR(pinode)              (pinode->file_type == NFS_DIR)
+#define IS_REG(pinode)              (pinode->file_type == NFS_REG_FILE)
 // #define IS_SYM_LINK(pinode)         (pinode->dentry->ftype == SFS_SYM_LINK)
 /******************************************************************************
 * SECTION: macro debug
@@ -79,8 +134,133 @@ typedef enum newfs_file_type {
 
 struct custom_options {
 	const char*        device;
+	int                zero_copy;   /* --zero-copy: 数据块由 FUSE 直接经驱动 fd 读写，照样记到驱动的统计和延迟模型上 */
+	const char*        trace;       /* --trace=<file>: 挂载期间跟踪驱动请求，卸载时写到 file */
+	int                discard;     /* --discard: 释放的数据块通知驱动丢弃 */
 };
 
+/*
+ * 驱动请求跟踪的标记，说明请求是哪段代码发出的，见 newfs_trace_tag。
+ * 读-改-写时在当前标记上加 NFS_TRACE_RMW。
+ */
+typedef enum newfs_trace_tag {
+    NFS_TRACE_NONE,
+    NFS_TRACE_MOUNT,            /* 读超级块和位图 */
+    NFS_TRACE_UNMOUNT,          /* 写回超级块和位图 */
+    NFS_TRACE_INODE_READ,       /* read_inode 读 inode 表块 */
+    NFS_TRACE_INODE_FLUSH,      /* newfs_flush_inodes 写回 inode 表块 */
+    NFS_TRACE_SYNC_DATA,        /* sync_inode 写回文件数据块 */
+    NFS_TRACE_SYNC_DENTRY,      /* sync_inode 写回目录项块 */
+    NFS_TRACE_LOAD_DATA,        /* newfs_load_data 读文件数据块 */
+    NFS_TRACE_LOAD_DENTRY,      /* newfs_load_dentries 读目录项块 */
+    NFS_TRACE_TAG_CNT
+} NFS_TRACE_TAG;
+
+#define NFS_TRACE_RMW           0x8000
+#define NFS_TRACE_TAG_NAMES     { "none", "mount", "unmount", "inode_read", "inode_flush", \
+                                  "sync_data", "sync_dentry", "load_data", "load_dentry" }
+
+/* --trace 写出的文件：newfs_trace_hdr 后面是 cnt 条 ddriver_trace_rec */
+#define NFS_TRACE_MAGIC         0x5254464e      /* "NFTR" */
+#define NFS_TRACE_VERSION       1
+
+struct newfs_trace_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_sz;            /* sizeof(struct ddriver_trace_rec) */
+    uint32_t sz_io;
+    uint32_t sz_disk;
+    uint32_t cnt;               /* 文件中的记录数 */
+    uint64_t total;             /* 跟踪到的请求数，大于 cnt 时最早的记录已被覆盖 */
+};
+
+/*
+ * 运行时统计，由虚拟文件 /.newfs/stats 输出，见 newfs_stats.c。
+ * 字段全部是 uint64_t：更新时原子加减，读的一方逐个原子读出，双方都不加锁。
+ */
+typedef enum newfs_op {         /* 按 FUSE 回调统计延迟 */
+    NFS_OP_GETATTR,
+    NFS_OP_READDIR,
+    NFS_OP_MKDIR,
+    NFS_OP_MKNOD,
+    NFS_OP_WRITE,
+    NFS_OP_WRITE_BUF,
+    NFS_OP_READ,
+    NFS_OP_READ_BUF,
+    NFS_OP_UTIMENS,
+    NFS_OP_TRUNCATE,
+    NFS_OP_FALLOCATE,
+    NFS_OP_UNLINK,
+    NFS_OP_RMDIR,
+    NFS_OP_RENAME,
+    NFS_OP_OPEN,
+    NFS_OP_RELEASE,
+    NFS_OP_ACCESS,
+    NFS_OP_CNT
+} NFS_OP;
+
+#define NFS_OP_NAMES            { "getattr", "readdir", "mkdir", "mknod", "write", "write_buf", \
+                                  "read", "read_buf", "utimens", "truncate", "fallocate",       \
+                                  "unlink", "rmdir", "rename", "open", "release", "access" }
+#define NFS_HIST_BUCKETS        32      /* 桶 0: <1us，桶 i: [2^(i-1), 2^i) us，最后一个桶不封顶 */
+
+struct newfs_stats {
+    uint64_t lookups;           /* lookup 次数 */
+    uint64_t lookup_found;
+    uint64_t lookup_depth;      /* 走过的路径分量数之和 */
+    uint64_t lookup_depth_max;
+    uint64_t lookup_scanned;    /* 比较过的目录项数之和 */
+    uint64_t inode_mem_hit;     /* dentry 的 inode 已在内存 */
+    uint64_t inode_mem_miss;    /* 要 read_inode */
+    uint64_t inode_blk_hit;     /* inode 表块缓存 */
+    uint64_t inode_blk_miss;
+    uint64_t dentries_hit;      /* 目录项已读入 */
+    uint64_t dentries_miss;
+    uint64_t data_hit;          /* 数据块缓存 */
+    uint64_t data_miss;
+    uint64_t data_zero;         /* 预分配未写入，不读盘直接清零 */
+    uint64_t alloc_inode;       /* allocate_inode 次数 */
+    uint64_t alloc_inode_scan;  /* 扫描过的 inode 位图位数 */
+    uint64_t alloc_inode_fail;
+    uint64_t alloc_data;
+    uint64_t alloc_data_scan;
+    uint64_t alloc_data_fail;
+    uint64_t alloc_run;         /* 找连续空闲段（预分配、延迟分配落盘）次数 */
+    uint64_t alloc_run_scan;
+    uint64_t dirty_inodes;      /* 当前有脏数据块的文件数 */
+    uint64_t dirty_blks;        /* 当前文件的脏数据块数 */
+    uint64_t wb_data_bytes;     /* sync_inode 写回的文件数据 */
+    uint64_t wb_dentry_bytes;   /* sync_inode 写回的目录项块 */
+    uint64_t wb_inode_bytes;    /* newfs_flush_inodes 写回的 inode 表块 */
+    uint64_t drv_read_bytes;    /* 经过驱动读写的字节数，按 IO 块对齐后计 */
+    uint64_t drv_write_bytes;
+    uint64_t drv_rmw;           /* 不对齐的写入引起的读-改-写次数 */
+    uint64_t drv_discard_bytes; /* --discard 时丢弃的已释放数据块 */
+    uint64_t op_cnt[NFS_OP_CNT];
+    uint64_t op_ns[NFS_OP_CNT];
+    uint64_t op_hist[NFS_OP_CNT][NFS_HIST_BUCKETS];
+};
+
+struct newfs_stats_seq {
+    uint64_t begin;             /* NFS_STAT_BEGIN 次数 */
+    uint64_t end;               /* NFS_STAT_END 次数，两者相等时没有正在进行的成组更新 */
+};
+
+/* 控制目录，不在磁盘上，由 newfs 自己应答；根目录的 readdir 不列出它 */
+#define NFS_CTL_DIR             "/.newfs"
+#define NFS_CTL_STATS           NFS_CTL_DIR "/stats"
+
+typedef enum newfs_ctl {
+    NFS_CTL_NONE,               /* 普通路径 */
+    NFS_CTL_ROOT,               /* /.newfs */
+    NFS_CTL_STAT_FILE,          /* /.newfs/stats */
+    NFS_CTL_NOENT               /* /.newfs 下不存在的名字 */
+} NFS_CTL;
+
+/* 打开控制文件时 fi->fh 是快照的地址加上这一位，inode 按 cache line 对齐，最低位不会被占用 */
+#define NFS_FH_CTL              0x1
+#define NFS_FH_IS_CTL(fi)       ((fi) != NULL && ((fi)->fh & NFS_FH_CTL))
+
 struct newfs_super {
     // uint     magic;
     int      driver_fd;         // driver_fd
@@ -104,49 +284,73 @@ struct newfs_super {
 
     int     sz_disk;            // 磁盘总大小
     int     sz_io;              // IO 块大小
+    int     sz_blk;             // 逻辑块大小，格式化时确定，记录在超级块里
     int     sz_usage; // 磁盘使用量
+    int     reserved_blks;      // 延迟分配预留、还没有落到位图上的块数
+    int     sz_inode;           // 每个 inode 在 inode 表中占的字节数
+    int     inode_blks;         // inode 表的块数
+    uint8_t** inode_cache;      // inode 表的块缓存，第一次访问时整块读入
+    uint8_t*  inode_cache_dirty; // inode_cache[i] 需要写回时为 1
 
     boolean is_mounted; // 已挂载
+    boolean is_fd_direct; // 驱动 fd 是普通文件（用户态 ddriver），数据块可以按偏移直接读写
+    boolean is_tracing;   // 挂载时指定了 --trace，驱动在记录请求
+    int     trace_tag;    // 最近一次设置给驱动的跟踪标记
+    boolean is_discard;   // 挂载时指定了 --discard，释放数据块时让驱动丢弃
     struct newfs_dentry* root_dentry; // 根目录指针
 };
 
+/*
+ * 内存中的 inode / dentry 按冷热字段拆分：
+ * lookup 遍历 brother 链表时只访问每个 dentry 的首个 cache line（hash、长度、
+ * brother、inode），inode 的 ino、类型、大小和子目录项指针也集中在首个 cache line，
+ * data_block_no / data 等只有读写文件时才用到的字段放在后面。
+ */
+#define NFS_CACHE_LINE          64
+#define NFS_INLINE_NAME_LEN     16      /* 含结尾 '\0'，更长的名字放到堆上 */
+
 struct newfs_inode {
+    /* hot */
     int      ino;
-    // file infos
+    NFS_FILE_TYPE file_type;
     int      file_size;
-    int      link;  //
     int      dir_dentry_cnt;    //若文件为目录，下面有几个目录项
-    // 如果是这个inode对应的文件是一个目录，这里就是它的数据的目录项的指针？
     struct newfs_dentry* dentry; // 父 dentry， 从这个dentry可以找到当前的inode
-
     struct newfs_dentry* dentries;  // 子 dentry， 从当前inode可以找到这些dentries
+    boolean  dentries_loaded;   // 目录项是否已从磁盘读入，目录在首次访问时才加载
+    int      link;              // 指向该 inode 的目录项个数，unlink 后为 0
 
-    // pointer to data block
+    /* cold */
     // 如果这个 inode 对应的是一个文件，那么 data 就是他的在内存中的文件数据块指针，data_block_no 是物理存储中的磁盘块号
     // 如果这个 inode 对应的是一个目录，那么它的文件数据块里面存放的都是它目录下的文件的 dentries
-    uint8_t*   data[6];      //数据内容, 在内存中
-    uint32_t      data_block_no[6];
-
-
-
-    NFS_FILE_TYPE file_type;
-
-    // other infos
-    /*      in-mem      */
-};
+    uint32_t      data_block_no[DATA_PER_FILE];
+    uint8_t*   data[DATA_PER_FILE];      //数据内容, 在内存中
+    uint32_t   dirty_blks;               // data[i] 被修改过、需要写回时第 i 位为 1
+    uint32_t   unwritten_blks;           // 第 i 块已预分配但从未写入时为 1
+    uint32_t   delayed_blks;             // 第 i 块延迟分配、还没有磁盘块时为 1，不写到磁盘
+    uint32_t   flags;                    // NFS_INODE_INLINE
+    int        open_cnt;                 // 打开计数，unlink 后要等到归零才回收
+    struct newfs_inode* reap_next;       // 回收队列中的下一个
+} __attribute__((aligned(NFS_CACHE_LINE)));
 
 struct newfs_dentry {
-    char     name[MAX_NAME_LEN];
+    /* hot: lookup 先比较 hash 和长度，命中后才比较名字 */
+    uint32_t name_hash;
+    uint16_t name_len;
+    NFS_FILE_TYPE   file_type;
     int      ino;
+    struct newfs_dentry* brother;
     struct newfs_inode* inode;
-    NFS_FILE_TYPE   file_type;
-
     struct newfs_dentry* parent;
-    struct newfs_dentry* brother;
-    // struct newfs_dentry* child;
-
-};
+    struct newfs_dentry** pprev; /* 指向链表中前一个 dentry 的 brother（或目录的 dentries），摘下时 O(1) */
+    union {
+        char  inline_name[NFS_INLINE_NAME_LEN];
+        char* ext_name;         /* name_len >= NFS_INLINE_NAME_LEN 时使用 */
+    };
+} __attribute__((aligned(NFS_CACHE_LINE)));
 
+#define NFS_DNAME(pdentry)  ((pdentry)->name_len < NFS_INLINE_NAME_LEN ?       \
+                             (pdentry)->inline_name : (pdentry)->ext_name)
 
 // in-disk
 struct newfs_dentry_d{
@@ -168,7 +372,10 @@ struct newfs_inode_d{
 
     // other infos
     uint32_t      dir_dentry_cnt;    // 
+    uint32_t      unwritten_blks;    // 预分配未写入的块，旧镜像里这里是 0
+    uint32_t      flags;             // NFS_INODE_INLINE 时文件内容紧跟在 NFS_INLINE_DATA_OFS 处
 };
+_Static_assert(sizeof(struct newfs_inode_d) <= NFS_INLINE_DATA_OFS, "newfs_inode_d overlaps inline data");
 
 struct newfs_super_d{
     uint32_t     magic;
@@ -185,19 +392,96 @@ struct newfs_super_d{
     uint32_t      map_data_offset; // 数据位图offset
 
     // uint32_t      root_dentry_inode;//根目录索引
-    
+    uint32_t      sz_inode;         // inode 槽大小，旧镜像里是 0
+    uint32_t      sz_blk;           // 逻辑块大小，旧镜像里是 0（sz_io * 2）
 };
 
-static inline struct newfs_dentry* new_dentry(char * fname, NFS_FILE_TYPE ftype) {
-    struct newfs_dentry * dentry = (struct newfs_dentry *)malloc(sizeof(struct newfs_dentry));
+/* FNV-1a */
+static inline uint32_t newfs_name_hash(const char * name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline boolean newfs_dentry_match(struct newfs_dentry * dentry, const char * name,
+                                         int len, uint32_t hash) {
+    return dentry->name_hash == hash && dentry->name_len == len &&
+           memcmp(NFS_DNAME(dentry), name, len) == 0;
+}
+
+/* 设置 dentry 的名字，原来放在堆上的名字会被释放 */
+static inline void newfs_dentry_set_name(struct newfs_dentry * dentry, const char * fname) {
+    int len = strnlen(fname, MAX_NAME_LEN - 1);
+    char * name;
+
+    if (len >= NFS_INLINE_NAME_LEN) {
+        name = (char *)malloc(len + 1);
+        memcpy(name, fname, len);
+        name[len] = '\0';
+    }
+    if (dentry->name_len >= NFS_INLINE_NAME_LEN) {
+        free(dentry->ext_name);
+    }
+    dentry->name_len  = len;
+    dentry->name_hash = newfs_name_hash(fname, len);
+    if (len >= NFS_INLINE_NAME_LEN) {
+        dentry->ext_name = name;
+    }
+    else {
+        memcpy(dentry->inline_name, fname, len);
+        dentry->inline_name[len] = '\0';
+    }
+}
+
+/* 挂到 *head 所在的位置，head 是目录的 dentries 或者某个 dentry 的 brother */
+static inline void newfs_dentry_link(struct newfs_dentry ** head, struct newfs_dentry * dentry) {
+    dentry->brother = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &dentry->brother;
+    }
+    *head = dentry;
+    dentry->pprev = head;
+}
+
+static inline void newfs_dentry_unlink(struct newfs_dentry * dentry) {
+    *dentry->pprev = dentry->brother;
+    if (dentry->brother != NULL) {
+        dentry->brother->pprev = dentry->pprev;
+    }
+    dentry->brother = NULL;
+    dentry->pprev   = NULL;
+}
+
+static inline struct newfs_dentry* new_dentry(const char * fname, NFS_FILE_TYPE ftype) {
+    struct newfs_dentry * dentry;
+
+    dentry = (struct newfs_dentry *)aligned_alloc(NFS_CACHE_LINE, sizeof(struct newfs_dentry));
     memset(dentry, 0, sizeof(struct newfs_dentry));
-    memcpy(dentry->name, fname, strlen(fname));
+    newfs_dentry_set_name(dentry, fname);
     dentry->file_type = ftype;
     dentry->ino     = -1;
     dentry->inode   = NULL;
     dentry->parent  = NULL;
     dentry->brother = NULL;
-    // dentry->child   = NULL;
+    return dentry;
+}
+
+static inline struct newfs_inode* new_inode() {
+    struct newfs_inode * inode;
+
+    inode = (struct newfs_inode *)aligned_alloc(NFS_CACHE_LINE, sizeof(struct newfs_inode));
+    memset(inode, 0, sizeof(struct newfs_inode));
+    return inode;
+}
+
+static inline void free_dentry(struct newfs_dentry * dentry) {
+    if (dentry->name_len >= NFS_INLINE_NAME_LEN) {
+        free(dentry->ext_name);
+    }
+    free(dentry);
 }
 
 #endif /* _TYPES_H_ */
@@ -10,43 +10,68 @@
 
 #include "newfs.h"
 
-/******************************************************************************
-* SECTION: 宏定义
-*******************************************************************************/
-#define OPTION(t, p)        { t, offsetof(struct custom_options, p), 1 }
-
 /******************************************************************************
 * SECTION: 全局变量
 *******************************************************************************/
-static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
-	OPTION("--device=%s", device),
-	FUSE_OPT_END
-};
-
 struct custom_options newfs_options;			 /* 全局选项 */
 struct newfs_super super; 
-/******************************************************************************
-* SECTION: FUSE操作定义
-*******************************************************************************/
-static struct fuse_operations operations = {
-	.init = newfs_init,						 /* mount文件系统 */		
-	.destroy = newfs_destroy,				 /* umount文件系统 */
-	.mkdir = newfs_mkdir,					 /* 建目录，mkdir */
-	.getattr = newfs_getattr,				 /* 获取文件属性，类似stat，必须完成 */
-	.readdir = newfs_readdir,				 /* 填充dentrys */
-	.mknod = newfs_mknod,					 /* 创建文件，touch相关 */
-	.write = newfs_write,								  	 /* 写入文件 */
-	.read = newfs_read,								  	 /* 读文件 */
-	.utimens = newfs_utimens,				 /* 修改时间，忽略，避免touch报错 */
-	.truncate = newfs_truncate,						  		 /* 改变文件大小 */
-	.unlink = NULL,							  		 /* 删除文件 */
-	.rmdir	= NULL,							  		 /* 删除目录， rm -r */
-	.rename = NULL,							  		 /* 重命名，mv */
-
-	.open = newfs_open,							
-	.opendir = NULL,
-	.access = newfs_access
-};
+/**
+ * @brief 取得读写操作的文件 inode
+ * 打开过的文件直接用 fi->fh 中保存的 inode，已经 unlink 的文件也能继续读写；
+ * 否则按路径查找
+ * 
+ * @param path 相对于挂载点的路径，可能为 NULL
+ * @param fi 文件信息，可能为 NULL
+ * @return struct newfs_inode* 找不到时返回 NULL
+ */
+static struct newfs_inode* newfs_file_inode(const char* path, struct fuse_file_info* fi) {
+	boolean	is_find, is_root;
+	struct newfs_dentry* dentry;
+
+	if (fi != NULL && fi->fh != 0) {
+		return (struct newfs_inode*)(uintptr_t)fi->fh;
+	}
+	if (path == NULL) {
+		return NULL;
+	}
+	dentry = lookup(path, &is_find, &is_root);
+	return is_find ? dentry->inode : NULL;
+}
+/**
+ * @brief 按 inode 填充文件属性
+ * 
+ * @param inode 文件或目录的 inode
+ * @param is_root 是否是根目录，根目录的大小是整个文件系统的用量
+ * @param newfs_stat 返回状态
+ */
+static void newfs_fill_stat(struct newfs_inode* inode, boolean is_root, struct stat* newfs_stat) {
+	if(inode->file_type == NFS_DIR){
+		newfs_stat->st_mode = S_IFDIR | NEWFS_DEFAULT_PERM;
+		newfs_stat->st_size = inode->dir_dentry_cnt * sizeof(struct newfs_dentry_d);
+	}
+	else if(inode->file_type == NFS_REG_FILE){
+		newfs_stat->st_mode = S_IFREG | NEWFS_DEFAULT_PERM;
+		newfs_stat->st_size = inode->file_size;
+		newfs_stat->st_blocks = 0;						/* 只统计实际分配的块，空洞不算 */
+		for (int i = 0; i < DATA_PER_FILE; i++) {
+			if (inode->data_block_no[i] != -1 ||		/* 内联文件不占数据块 */
+				BLK_DELAYED(inode, i)) {				/* 延迟分配的块已经预留 */
+				newfs_stat->st_blocks += LOGIC_SZ() / 512;
+			}
+		}
+	}
+	newfs_stat->st_uid = getuid();
+	newfs_stat->st_gid = getgid();
+	newfs_stat->st_atime = time(NULL);
+	newfs_stat->st_mtime = time(NULL);
+	newfs_stat->st_blksize = IO_SZ() * 2;
+
+	if(is_root){
+		NFS_DBG("\n---get attr: is root\n");
+		newfs_stat->st_size = super.sz_usage + super.reserved_blks * LOGIC_SZ();	/* 预留的块也算已用 */
+		newfs_stat->st_blocks = super.max_blks;
+	}
+}
 /******************************************************************************
 * SECTION: 必做函数实现
 *******************************************************************************/
@@ -64,18 +89,6 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 	struct	newfs_dentry* root_dentry;  // 根目录 dentry
 	struct	newfs_inode*	root_inode;  // 根目录的inode
 
-	int logic_num;	// 逻辑块 总数量
-
-	int inode_num;  // inode总数量
-	int map_inode_blks; // inode 位图总数
-
-	int data_num;		//数据块总数量
-	int map_data_blks;  // 数据位图（为1）
-	int map_data_blk_offset; 	// 数据位图的偏移
-
-	int super_blks; // 超级块的位置
-	boolean is_init = FALSE; // 初始化flag
-
 	driver_fd = ddriver_open(newfs_options.device);
     printf("\n\n successfully opened \n\n");
     fflush(stdout);
@@ -85,92 +98,97 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 		return NULL;
 	}
 	super.driver_fd = driver_fd;
+	newfs_stats_reset();
+	if (conn_info != NULL && newfs_options.zero_copy) {
+		conn_info->want |= conn_info->capable &
+						   (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	// 跟踪时所有读写都要经过驱动，不走 --zero-copy 的直接读写
+	super.is_tracing = FALSE;
+	super.trace_tag = NFS_TRACE_NONE;
+	if (newfs_options.trace != NULL) {
+		int recs = 0;
+		super.is_tracing = ddriver_ioctl(driver_fd, IOC_REQ_TRACE_START, &recs) == 0;
+		if (!super.is_tracing) {
+			printf("can't trace %s, continue without tracing\n", newfs_options.device);
+		}
+	}
+	{
+		struct stat driver_stat;
+		super.is_fd_direct = newfs_options.zero_copy && !super.is_tracing &&
+							   fstat(driver_fd, &driver_stat) == 0 && S_ISREG(driver_stat.st_mode);
+	}
+	// 元数据只在卸载时写回，丢弃后崩溃的话旧元数据会指向全 0 的块，所以要显式打开
+	super.is_discard = newfs_options.discard;
 	ddriver_ioctl(driver_fd, IOC_REQ_DEVICE_SIZE, &super.sz_disk);
 	ddriver_ioctl(driver_fd, IOC_REQ_DEVICE_IO_SZ, &super.sz_io);
-
-    root_dentry = new_dentry("/", NFS_DIR);
+	newfs_trace_tag(NFS_TRACE_MOUNT);
 
     if (newfs_driver_read(0, (uint8_t *)(&super_d), 
                         sizeof(struct newfs_super_d)) != 0) {
         printf("error!") ;
     }  
 
-	// 如果没有初始化
-	// 修改的是to-disk结构
-	if(super_d.magic != NEWFS_MAGIC){
-		// 初始化做什么工作
-		// 估算磁盘布局信息
-		// super_blks = SFS_ROUND_UP(sizeof(struct sfs_super_d), SFS_IO_SZ()) / SFS_IO_SZ();
-		super_blks = ROUND_UP(sizeof(struct newfs_super_d),LOGIC_SZ() ) / LOGIC_SZ(); // super block 的位置
-
-		logic_num = DISK_SZ() / LOGIC_SZ() ;// 总共的逻辑块数
-
-		inode_num =  DISK_SZ() / ((INODE_PER_FILE + DATA_PER_FILE) * LOGIC_SZ()); // 不考虑其他，总共可以用这么多inode来表示整个磁盘
-		// inode_num = 585
-		map_inode_blks = 1;//ROUND_UP((ROUND_UP(inode_num, UINT32_BITS)),LOGIC_SZ())/ LOGIC_SZ(); // 基于上述，最多需要这么多个inode bitmap
-		map_data_blks = 1;// data bitmap ROUND_UP((ROUND_UP(logic_num, UINT32_BITS)),LOGIC_SZ()) / LOGIC_SZ()
-		// map_inode_blks = 1, map_data_blks = 1
-		super.max_ino = (inode_num - map_inode_blks - super_blks - map_data_blks);// 考虑完超级块和位图所占的块之后，最多可以有这么多个inode
-		// max_ino = 585 - 1 - 1 -1 = 582
-		super.max_data =  logic_num - inode_num - map_inode_blks - map_data_blks - super_blks;
-		// max_data = 4096 - 585 - 1 - 1 - 1 = 3507
-
-		// super_d
-		// inode 位图的偏移 // 第一个块为超级块 // 所以 inode 位图的偏移为一个超级块的大小，也就是一个逻辑块的大小。
-		super_d.map_inode_offset = LOGIC_SZ(); 
-		super_d.map_data_offset = super_d.map_inode_offset + LOGIC_SZ(); // data 位图位于 inode 位图的下一个块
-		super_d.inode_offset = super_d.map_data_offset + LOGIC_SZ();//inode 开始位置位于map_data的后方
-		// inode 使用了 max_ino (582)个块。
-		super_d.data_offset = super_d.inode_offset + super.max_ino * LOGIC_SZ(); // 所有数据块的开始，在 inode 区域的后面
-		// 清零索引节点和数据块位图
-		super_d.map_inode_blks = map_inode_blks;
-		super_d.map_data_blks = map_data_blks;  // map_data 只需要1个块
-		super_d.sz_usage = 0;//初次挂载
-		
-		is_init = TRUE;
-        }
-		super.sz_usage = super_d.sz_usage;
+	// 磁盘由 mkfs.newfs 格式化，挂载只读入并校验超级块，布局全部以超级块为准
+	if (newfs_layout_check(&super_d, super.sz_disk, super.sz_io) != NFS_ERROR_NONE) {
+		printf("%s is not a newfs image, format it with mkfs.newfs first\n", newfs_options.device);
+		ddriver_close(driver_fd);
+		return NULL;
+	}
+	// 旧镜像没有记录逻辑块大小和 inode 槽大小：逻辑块为 sz_io * 2，每个 inode 独占一个逻辑块
+	super.sz_blk = super_d.sz_blk != 0 ? super_d.sz_blk : NFS_DEFAULT_BLK_SZ();
+	super.sz_inode = super_d.sz_inode != 0 ? super_d.sz_inode : LOGIC_SZ();
+	super.max_ino = super_d.max_inode;
+
+    root_dentry = new_dentry("/", NFS_DIR);
 
-        super.map_inode = (uint8_t *) malloc(LOGIC_SZ()); // 分配一个 inode 位图块 sizeof((super_d.map_inode_blks)*super.sz_io)*2
-		super.map_inode_blks = super_d.map_inode_blks;
+        super.map_inode_blks = super_d.map_inode_blks;
+        super.map_inode = (uint8_t *) malloc(BLKS_SZ(super.map_inode_blks)); // inode 位图
 		super.map_inode_offset = super_d.map_inode_offset; // inode 位图的偏移	
 		super.inode_offset = super_d.inode_offset; 	// inode 的偏移
 	
-		super.map_data = (uint8_t *) malloc(LOGIC_SZ()); // 分配一个 data 位图块
 		super.map_data_blks = super_d.map_data_blks;
+		super.map_data = (uint8_t *) malloc(BLKS_SZ(super.map_data_blks)); // data 位图
 		super.map_data_offset = super_d.map_data_offset;// data 位图的偏移
 		super.data_offset = super_d.data_offset;
+		super.inode_blks = ROUND_UP(super.max_ino * super.sz_inode, LOGIC_SZ()) / LOGIC_SZ();
+		super.max_data = (DISK_SZ() - super.data_offset) / LOGIC_SZ();
+		if (super.max_data > BLKS_SZ(super.map_data_blks) * UINT8_BITS) {	/* 位图能表示的块数 */
+			super.max_data = BLKS_SZ(super.map_data_blks) * UINT8_BITS;
+		}
+		super.inode_cache = (uint8_t **)calloc(super.inode_blks, sizeof(uint8_t *));
+		super.inode_cache_dirty = (uint8_t *)calloc(super.inode_blks, sizeof(uint8_t));
 	
 		printf("\n--------------------------------------------------------------------------------\n\n");
 		// 尝试从磁盘中读取 inode 位图块
 		NFS_DBG("reading inode map\n");
-		if (newfs_driver_read(super_d.map_inode_offset, (uint8_t*)(super.map_inode), LOGIC_SZ()) != 0 ){
+		if (newfs_driver_read(super_d.map_inode_offset, (uint8_t*)(super.map_inode),
+							  BLKS_SZ(super.map_inode_blks)) != 0 ){
 			NFS_DBG("---- error reading inode map");
 		}
 
 		// 尝试从磁盘中读取 data 位图块
 		NFS_DBG("reading data map\n");
-		if (newfs_driver_read(super_d.map_data_offset, (uint8_t*)(super.map_data), LOGIC_SZ()) != 0 ){
+		if (newfs_driver_read(super_d.map_data_offset, (uint8_t*)(super.map_data),
+							  BLKS_SZ(super.map_data_blks)) != 0 ){
 			NFS_DBG("---- error reading data map");
 		}
-
-		NFS_DBG("\n--is_init: %d\n", is_init);	
-		// 如果这次需要初始化
-		if (is_init){
-			NFS_DBG("\n--- initialized\n");
-			root_inode = allocate_inode(root_dentry);
-			NFS_DBG("--- in initiallize : root inode : %s",root_inode->dentry->name);
-			sync_inode(root_inode);// todo
+		// 旧镜像里 sz_usage 从来没有维护过，按数据位图重新统计
+		super.sz_usage = 0;
+		for (int i = 0; i < BLKS_SZ(super.map_data_blks); i++) {
+			super.sz_usage += __builtin_popcount(super.map_data[i]) * LOGIC_SZ();
 		}
 
+		newfs_trace_tag(NFS_TRACE_NONE);
 		root_inode = read_inode(root_dentry,0);
-		NFS_DBG("---finished reading root inode : %s",root_inode->dentry->name);	
+		NFS_DBG("---finished reading root inode : %s",NFS_DNAME(root_inode->dentry));	
 		root_dentry->inode = root_inode;
 		root_dentry->ino = root_inode->ino;
 
 		super.root_dentry = root_dentry;
 		super.root_dentry_inode = root_inode;
 		super.is_mounted  = TRUE;
+		newfs_reaper_start();
 	
 
 		printf("\n\n successfully mounted \n\n");
@@ -197,6 +215,9 @@ void newfs_destroy(void* p) {
 	}
 	sync_inode(super.root_dentry->inode);
 	NFS_DBG("\n-----sync_inode");
+	newfs_reaper_stop();								/* 回收完再写回位图 */
+	newfs_flush_inodes();
+	newfs_trace_tag(NFS_TRACE_UNMOUNT);
 
 	super_d.magic = NEWFS_MAGIC;
 	super_d.map_inode_blks = super.map_inode_blks;
@@ -209,6 +230,8 @@ void newfs_destroy(void* p) {
 	// super_d.root_dentry_inode = super.root_dentry_inode;
 	super_d.map_data_blks = super.map_data_blks;
 	super_d.map_inode_blks = super.map_inode_blks;
+	super_d.sz_inode = super.sz_inode;
+	super_d.sz_blk = super.sz_blk;
 
     NFS_DBG("-------magic : %x",super_d.magic);
 
@@ -218,17 +241,27 @@ NFS_DBG("\n newfs_driver_write in destroy\n");
 		return ;
 	}		
 	NFS_DBG("\n\n ------------ map_inode_offset : %d  ", super.map_inode_offset);
-	if(newfs_driver_write(super.map_inode_offset, (uint8_t *)(super.map_inode), LOGIC_SZ())!=0){
+	if(newfs_driver_write(super.map_inode_offset, (uint8_t *)(super.map_inode),
+						  BLKS_SZ(super.map_inode_blks))!=0){
 		NFS_DBG("-------error writing back map_inode");
 		return ;
 	}
 	NFS_DBG("\n\n ------------ map_data_offset : %d  ", super.map_data_offset);
-	if(newfs_driver_write(super.map_data_offset, (uint8_t *)(super.map_data), LOGIC_SZ())!=0){
+	if(newfs_driver_write(super.map_data_offset, (uint8_t *)(super.map_data),
+						  BLKS_SZ(super.map_data_blks))!=0){
 		NFS_DBG("-------error writing back map_inode");
 		return ;
 	}
 	free(super.map_inode);
 	free(super.map_data);
+	for (int i = 0; i < super.inode_blks; i++) {
+		free(super.inode_cache[i]);
+	}
+	free(super.inode_cache);
+	free(super.inode_cache_dirty);
+	if (super.is_tracing && newfs_trace_save(newfs_options.trace) != NFS_ERROR_NONE) {
+		printf("can't save trace to %s\n", newfs_options.trace);
+	}
 	ddriver_close(super.driver_fd);
 	return;
 }
@@ -243,11 +276,16 @@ NFS_DBG("\n newfs_driver_write in destroy\n");
 int newfs_mkdir(const char* path, mode_t mode) {
 	/* TODO: 解析路径，创建目录 */
 	boolean is_find , is_root;
+	int ret;
 	char* fname ;
-	struct newfs_dentry* last_dentry = lookup(path, &is_find, &is_root);
+	struct newfs_dentry* last_dentry;
 	struct newfs_dentry* dentry;
 	struct newfs_inode* inode;
 
+	if (newfs_ctl_path(path) != NFS_CTL_NONE) {			/* 控制目录只读 */
+		return -NFS_ERROR_ACCESS;
+	}
+	last_dentry = lookup(path, &is_find, &is_root);
 	if(is_find){
 		return -NFS_ERROR_EXISTS;
 	}
@@ -257,13 +295,16 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	fname = get_fname(path);
 	dentry = new_dentry(fname, NFS_DIR);
 
-	inode = allocate_inode(dentry);
-
 	dentry->parent = last_dentry;
 	dentry->brother = NULL;
 
-	allocate_dentry(last_dentry->inode, dentry);
-	NFS_DBG("\n [%s] allocated dentry\nfather:%s,child:%s", __func__, last_dentry->name, dentry->name);
+	ret = allocate_dentry(last_dentry->inode, dentry);
+	if (ret < 0) {
+		free_dentry(dentry);
+		return ret;
+	}
+	inode = allocate_inode(dentry);
+	NFS_DBG("\n [%s] allocated dentry\nfather:%s,child:%s", __func__, NFS_DNAME(last_dentry), NFS_DNAME(dentry));
 
 	return 0;
 }
@@ -278,32 +319,40 @@ int newfs_mkdir(const char* path, mode_t mode) {
 int newfs_getattr(const char* path, struct stat * newfs_stat) {
 	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/sfs.c的sfs_getattr()函数实现 */
 	boolean is_find, is_root;
+	int ctl = newfs_ctl_path(path);
 	// debug
 	NFS_DBG("\n---getattr %s\n",path);
+	if (ctl != NFS_CTL_NONE) {
+		return newfs_ctl_getattr(ctl, newfs_stat);
+	}
 	
 	struct newfs_dentry * dentry = lookup(path, &is_find, &is_root);
 	if(is_find == FALSE){
 		return -NFS_ERROR_NOTFOUND;
 	}
-	if(dentry->file_type == NFS_DIR){
-		newfs_stat->st_mode = S_IFDIR | NEWFS_DEFAULT_PERM;
-		newfs_stat->st_size = dentry->inode->dir_dentry_cnt * sizeof(struct newfs_dentry_d);
-	}
-	else if(dentry->file_type == NFS_REG_FILE){
-		newfs_stat->st_mode = S_IFREG | NEWFS_DEFAULT_PERM;
-		newfs_stat->st_size = dentry->inode->file_size;
-	}
-	newfs_stat->st_uid = getuid();
-	newfs_stat->st_gid = getgid();
-	newfs_stat->st_atime = time(NULL);
-	newfs_stat->st_mtime = time(NULL);
-	newfs_stat->st_blksize = IO_SZ() * 2;
+	newfs_fill_stat(dentry->inode, is_root, newfs_stat);
+	return NFS_ERROR_NONE;
+}
 
-	if(is_root){
-		NFS_DBG("\n---get attr: is root\n");
-		newfs_stat->st_size = super.sz_usage;
-		newfs_stat->st_blocks = super.max_blks;
+/**
+ * @brief 获取打开着的文件的属性，已经 unlink 的文件 path 为 NULL，用 fi->fh 中的 inode
+ * 
+ * @param path 相对于挂载点的路径，可能为 NULL
+ * @param newfs_stat 返回状态
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fgetattr(const char* path, struct stat * newfs_stat, struct fuse_file_info* fi) {
+	struct newfs_inode* inode;
+
+	if (NFS_FH_IS_CTL(fi)) {
+		return newfs_ctl_getattr(NFS_CTL_STAT_FILE, newfs_stat);
+	}
+	if (fi == NULL || fi->fh == 0) {					/* 目录打开时没有记录 inode */
+		return path != NULL ? newfs_getattr(path, newfs_stat) : -NFS_ERROR_NOTFOUND;
 	}
+	inode = newfs_file_inode(path, fi);
+	newfs_fill_stat(inode, inode == super.root_dentry_inode, newfs_stat);
 	return NFS_ERROR_NONE;
 }
 
@@ -332,15 +381,29 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 	int ls_count = 0;
 	int cur_dir = offset;
 	// int cur_dir = 0;
-	struct newfs_dentry * dentry = lookup(path, &is_find, &is_root);
+	int ctl = newfs_ctl_path(path);
+	struct newfs_dentry * dentry;
 	struct newfs_dentry * sub_dentry;
 	struct newfs_inode  * inode;
+	if (ctl != NFS_CTL_NONE) {							/* 控制目录下只有 stats */
+		if (ctl != NFS_CTL_ROOT) {
+			return ctl == NFS_CTL_NOENT ? -NFS_ERROR_NOTFOUND : -NFS_ERROR_NOTDIR;
+		}
+		if (offset == 0) {
+			filler(buf, NFS_CTL_STATS + strlen(NFS_CTL_DIR) + 1, NULL, ++offset);
+		}
+		return 0;
+	}
+	if (path == NULL) {									/* 打开着的目录已经被删除，是空的 */
+		return 0;
+	}
+	dentry = lookup(path, &is_find, &is_root);
 	if(is_find){
 		inode = dentry->inode;
 		sub_dentry = get_dentry(inode, cur_dir);
 		if(sub_dentry){
 
-			filler(buf, sub_dentry->name, NULL, ++offset);
+			filler(buf, NFS_DNAME(sub_dentry), NULL, ++offset);
 		}
 		return 0;
 	}
@@ -359,12 +422,17 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	/* TODO: 解析路径，并创建相应的文件 */
 	boolean is_find, is_root;
+	int ret;
 
-	struct newfs_dentry * last_dentry = lookup(path, &is_find, &is_root);
+	struct newfs_dentry * last_dentry;
 	struct newfs_dentry * dentry;
 	struct newfs_inode * inode;
 	char * fname;
 
+	if (newfs_ctl_path(path) != NFS_CTL_NONE) {			/* 控制目录只读 */
+		return -NFS_ERROR_ACCESS;
+	}
+	last_dentry = lookup(path, &is_find, &is_root);
 	if(is_find == TRUE){
 		return -NFS_ERROR_EXISTS;
 	}
@@ -381,8 +449,12 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 		dentry = new_dentry(fname, NFS_REG_FILE);
 	}
 	dentry->parent = last_dentry;
+	ret = allocate_dentry(last_dentry->inode, dentry);
+	if (ret < 0) {
+		free_dentry(dentry);
+		return ret;
+	}
 	inode = allocate_inode(dentry);
-	allocate_dentry(last_dentry->inode, dentry);
 	
 	return NFS_ERROR_NONE; 
 }
@@ -413,57 +485,173 @@ int newfs_utimens(const char* path, const struct timespec tv[2]) {
  */
 int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
-	 boolean	is_find, is_root;
-	struct newfs_dentry* dentry = lookup(path, &is_find, &is_root);
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+	bufv.buf[0].mem = (void *)buf;
+	return newfs_write_buf(path, &bufv, offset, fi);
+}
+
+/**
+ * @brief 直接写到磁盘镜像的写入需要马上有块号：把 [offset, end) 内还没有磁盘块的
+ * 块（空洞或延迟分配的块）按连续段一次分配，这次写入的内容落在连续的磁盘块上。
+ * 分配不到的块留给 newfs_write_buf 逐块处理
+ *
+ * @param inode 文件 inode，不是内联文件
+ * @param offset 写入的起始偏移
+ * @param end 写入的末尾
+ */
+static void newfs_alloc_direct(struct newfs_inode* inode, off_t offset, off_t end) {
+	int blk_idx = offset / LOGIC_SZ();
+	int blk_end = (end + LOGIC_SZ() - 1) / LOGIC_SZ();
+
+	if (blk_end > DATA_PER_FILE) {
+		blk_end = DATA_PER_FILE;
+	}
+	while (blk_idx < blk_end) {
+		int run_len = 0;
+		int ret;
+
+		if (inode->data_block_no[blk_idx] != -1) {
+			blk_idx++;
+			continue;
+		}
+		while (blk_idx + run_len < blk_end && inode->data_block_no[blk_idx + run_len] == -1) {
+			if (BLK_DELAYED(inode, blk_idx + run_len)) {	/* 缓存保留，改成马上分配 */
+				CLR_BLK_DELAYED(inode, blk_idx + run_len);
+				unreserve_data(1);
+			}
+			run_len++;
+		}
+		ret = allocate_data_run(inode, blk_idx, run_len);
+		if (ret < 0) {
+			return;
+		}
+		blk_idx += ret;
+	}
+}
+
+/**
+ * @brief 写入文件，数据以 fuse_bufvec 的形式给出（可能是内存，也可能是管道 fd）
+ * 
+ * 覆盖整个逻辑块的写入不读旧内容；挂载时指定了 --zero-copy 且驱动是普通文件时，
+ * 这类写入直接由 FUSE 拷贝（splice）到磁盘镜像中对应的位置，并丢弃该块的缓存，
+ * 写完后用 IOC_REQ_DEVICE_DIRECT 记到驱动的统计、跟踪和延迟模型上。
+ * 其余写入落到块缓存里，标记为脏，空洞只预留额度，等 sync_inode 写回时再分配磁盘块。
+ * 可以写到文件末尾之后，中间没有写过的块不分配，成为空洞。
+ * 空文件的第一次写入不超过 NFS_INLINE_DATA_SZ() 时内容内联在 inode 槽中，不分配数据块。
+ * 
+ * @param path 相对于挂载点的路径
+ * @param bufv 写入的内容
+ * @param offset 相对文件的偏移
+ * @param fi 可忽略
+ * @return int 写入大小
+ */
+int newfs_write_buf(const char* path, struct fuse_bufvec* bufv, off_t offset,
+					struct fuse_file_info* fi) {
 	struct newfs_inode*  inode;
-	
-	if (is_find == FALSE) {
+
+	if (NFS_FH_IS_CTL(fi) || newfs_ctl_path(path) != NFS_CTL_NONE) {
+		return -NFS_ERROR_ACCESS;
+	}
+	inode = newfs_file_inode(path, fi);
+	if (inode == NULL) {
 		return -NFS_ERROR_NOTFOUND;
 	}
-
-	inode = dentry->inode;
 	
-	if (inode->dentry->file_type == NFS_DIR) {
+	if (inode->file_type == NFS_DIR) {
 		return -NFS_ERROR_ISDIR;	
 	}
 
-	if (inode->file_size < offset) {
-		return -NFS_ERROR_SEEK;
-	}
-
-	size_t remaining_size = size;
+	size_t remaining_size = fuse_buf_size(bufv);
     size_t written_size = 0;
     size_t cur_offset = offset;
 
+    if (remaining_size > 0 && newfs_inline_fit(inode, offset + remaining_size) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    // 有整块直接写到磁盘镜像时，这次写入涉及的块一起分配
+    if (super.is_fd_direct && !IS_INLINE(inode) &&
+        ROUND_UP(offset, LOGIC_SZ()) + LOGIC_SZ() <= offset + remaining_size) {
+        newfs_alloc_direct(inode, offset, offset + remaining_size);
+    }
+
     while (remaining_size > 0) {
         // 计算当前偏移所在块和块内偏移
         int block_idx = cur_offset / LOGIC_SZ();
         int block_offset = cur_offset % LOGIC_SZ();
+        struct fuse_bufvec dst;
+        ssize_t copied;
 
         if (block_idx >= DATA_PER_FILE) {
-            return -NFS_ERROR_NOSPACE;
-        }
-
-        // 检查是否需要分配新块
-        if (!inode->data[block_idx]) {
-            allocate_data(inode);
+            break;
         }
 
         // 计算本次写入的数据量
         size_t write_size = (remaining_size < LOGIC_SZ() - block_offset ? (remaining_size) : LOGIC_SZ()-block_offset);
+        boolean is_full = (write_size == LOGIC_SZ());
+
+        // 写到文件末尾之后时中间留下空洞；内联文件不分配。写进缓存的块只预留额度，
+        // 写回时再分配磁盘块；整块直接写到磁盘镜像时需要马上有块号
+        if (!IS_INLINE(inode) && inode->data_block_no[block_idx] == -1) {
+            if (is_full && super.is_fd_direct) {
+                if (BLK_DELAYED(inode, block_idx)) {
+                    CLR_BLK_DELAYED(inode, block_idx);
+                    unreserve_data(1);
+                }
+                if (allocate_data_no(inode, block_idx) < 0) {
+                    break;
+                }
+            }
+            else if (!BLK_DELAYED(inode, block_idx) && reserve_data(inode, block_idx) < 0) {
+                break;
+            }
+        }
+
+        dst = FUSE_BUFVEC_INIT(write_size);
+        if (is_full && super.is_fd_direct) {
+            // 整块直接写到磁盘镜像，缓存里的旧内容作废
+            free(inode->data[block_idx]);
+            inode->data[block_idx] = NULL;
+            CLR_BLK_DIRTY(inode, block_idx);
+            CLR_BLK_UNWRITTEN(inode, block_idx);
+            dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            dst.buf[0].fd = super.driver_fd;
+            dst.buf[0].pos = DATA_OFS(inode->data_block_no[block_idx]);
+        }
+        else {
+            uint8_t* blk = newfs_prepare_write(inode, block_idx, is_full);
+            if (blk == NULL) {
+                break;
+            }
+            dst.buf[0].mem = blk + block_offset;
+        }
 
         // 写入数据
-        memcpy(inode->data[block_idx] + block_offset, buf + written_size, write_size);
+        copied = fuse_buf_copy(&dst, bufv, 0);
+        if (copied <= 0) {
+            break;
+        }
+        if (dst.buf[0].flags & FUSE_BUF_IS_FD) {
+            newfs_driver_direct(DDRIVER_TRACE_WRITE, dst.buf[0].pos, copied);
+        }
 
         // 更新写入状态
-        remaining_size -= write_size;
-        written_size += write_size;
-        cur_offset += write_size;
+        remaining_size -= copied;
+        written_size += copied;
+        cur_offset += copied;
+        if ((size_t)copied < write_size) {
+            break;
+        }
     }
 
     // 更新文件大小
-    inode->file_size = inode->file_size >  cur_offset ? inode->file_size : cur_offset;
+    if (written_size > 0) {
+        inode->file_size = inode->file_size >  cur_offset ? inode->file_size : cur_offset;
+    }
 
+    if (written_size == 0 && remaining_size > 0) {
+        return cur_offset >= MAX_FILE_SZ() ? -NFS_ERROR_FBIG : -NFS_ERROR_NOSPACE;
+    }
     return written_size;
 }
 
@@ -479,22 +667,25 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
  */
 int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		       struct fuse_file_info* fi) {
-	 boolean	is_find, is_root;
-	struct newfs_dentry* dentry = lookup(path, &is_find, &is_root);
 	struct newfs_inode*  inode;
-	
-	if (is_find == FALSE) {
+
+	if (NFS_FH_IS_CTL(fi)) {
+		return newfs_ctl_read(fi, buf, size, offset);
+	}
+	inode = newfs_file_inode(path, fi);
+	if (inode == NULL) {
 		return -NFS_ERROR_NOTFOUND;
 	}
-
-	inode = dentry->inode;
 	
-	if (inode->dentry->file_type == NFS_DIR) {
+	if (inode->file_type == NFS_DIR) {
 		return -NFS_ERROR_ISDIR;	
 	}
 
-	if (inode->file_size < offset) {
-		return -NFS_ERROR_SEEK;
+	if (inode->file_size <= offset) {
+		return 0;
+	}
+	if (offset + size > inode->file_size) {		/* 不读到文件末尾之后 */
+		size = inode->file_size - offset;
 	}
 
 	size_t remaining_size = size;
@@ -506,41 +697,172 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
         int block_idx = cur_offset / LOGIC_SZ();
         int block_offset = cur_offset % LOGIC_SZ();
 
-        if (block_idx >= DATA_PER_FILE) {
-            return -NFS_ERROR_NOSPACE;
-        }
+        // 计算本次读出的数据量
+        size_t copy_size = (remaining_size < LOGIC_SZ() - block_offset ? (remaining_size) : LOGIC_SZ()-block_offset);
 
-        // 检查是否需要分配新块 //
-        if (!inode->data[block_idx]) {
-            allocate_data(inode);
+        if (BLK_IS_HOLE(inode, block_idx)) {		/* 空洞读出来是 0，不分配块 */
+            memset(buf + read_size, 0, copy_size);
+        }
+        else if (newfs_load_data(inode, block_idx) == NULL) {
+            return -NFS_ERROR_IO;
+        }
+        else {
+            memcpy(buf + read_size, inode->data[block_idx] + block_offset, copy_size);
         }
 
-        // 计算本次写入的数据量
-        size_t write_size = (remaining_size < LOGIC_SZ() - block_offset ? (remaining_size) : LOGIC_SZ()-block_offset);
+        // 更新读取状态
+        remaining_size -= copy_size;
+        read_size += copy_size;
+        cur_offset += copy_size;
+    }
 
-        // 写入数据
-        memcpy(buf + read_size, inode->data[block_idx] + block_offset, write_size);
+    return read_size;
+}
 
-        // 更新写入状态
-        remaining_size -= write_size;
-        read_size += write_size;
-        cur_offset += write_size;
-    }
+/**
+ * @brief 读取文件，结果以 fuse_bufvec 的形式交给 FUSE
+ * 
+ * 已缓存的数据块拷贝一次到交给 FUSE 的缓冲区（FUSE 用完会 free 每个 mem，
+ * 不能直接借出缓存块）；挂载时指定了 --zero-copy 且驱动是普通文件时，
+ * 未缓存的数据块以 fd + 偏移的形式交给 FUSE，由内核直接从磁盘镜像读取，
+ * 物理上连续的块合并成一项，并用 IOC_REQ_DEVICE_DIRECT 记到驱动上。
+ * 
+ * @param path 相对于挂载点的路径
+ * @param bufp 返回的 fuse_bufvec，由 FUSE 释放
+ * @param size 读取的字节数
+ * @param offset 相对文件的偏移
+ * @param fi 可忽略
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_read_buf(const char* path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+				   struct fuse_file_info* fi) {
+	struct newfs_inode*  inode;
+	struct fuse_bufvec*  bufv;
+	struct fuse_buf*     cur_buf = NULL;
+	int                  max_bufs;
+
+	if (NFS_FH_IS_CTL(fi)) {							/* 控制文件从打开时的快照中拷贝 */
+		bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+		*bufv = FUSE_BUFVEC_INIT(0);
+		bufv->buf[0].mem = malloc(size > 0 ? size : 1);
+		bufv->buf[0].size = newfs_ctl_read(fi, bufv->buf[0].mem, size, offset);
+		*bufp = bufv;
+		return NFS_ERROR_NONE;
+	}
+	inode = newfs_file_inode(path, fi);
+	if (inode == NULL) {
+		return -NFS_ERROR_NOTFOUND;
+	}
 
-    // 更新文件大小
-    inode->file_size = inode->file_size >  cur_offset ? inode->file_size : cur_offset;
+	if (inode->file_type == NFS_DIR) {
+		return -NFS_ERROR_ISDIR;
+	}
 
-    return read_size;
+	if (inode->file_size <= offset) {
+		size = 0;
+	}
+	else if (offset + size > inode->file_size) {
+		size = inode->file_size - offset;
+	}
+
+	max_bufs = size / LOGIC_SZ() + 2;
+	bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) +
+										(max_bufs - 1) * sizeof(struct fuse_buf));
+	*bufv = FUSE_BUFVEC_INIT(0);
+	if (size > 0) {
+		bufv->count = 0;
+	}
+
+	size_t remaining_size = size;
+	size_t cur_offset = offset;
+
+	while (remaining_size > 0) {
+		int block_idx = cur_offset / LOGIC_SZ();
+		int block_offset = cur_offset % LOGIC_SZ();
+		size_t copy_size = (remaining_size < LOGIC_SZ() - block_offset ? (remaining_size) : LOGIC_SZ()-block_offset);
+		uint32_t blk_no = inode->data_block_no[block_idx];
+		boolean from_fd = super.is_fd_direct && inode->data[block_idx] == NULL && blk_no != -1 &&
+						  !BLK_UNWRITTEN(inode, block_idx);
+
+		if (from_fd) {
+			off_t pos = DATA_OFS(blk_no) + block_offset;
+			if (cur_buf == NULL || !(cur_buf->flags & FUSE_BUF_IS_FD) ||
+				cur_buf->pos + cur_buf->size != pos) {
+				cur_buf = &bufv->buf[bufv->count++];
+				cur_buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				cur_buf->mem = NULL;
+				cur_buf->fd = super.driver_fd;
+				cur_buf->pos = pos;
+				cur_buf->size = 0;
+			}
+		}
+		else {
+			if (cur_buf == NULL || (cur_buf->flags & FUSE_BUF_IS_FD)) {
+				cur_buf = &bufv->buf[bufv->count++];
+				cur_buf->flags = 0;
+				cur_buf->mem = malloc(remaining_size);	/* 容纳剩余部分，多余的不会被用到 */
+				cur_buf->fd = -1;
+				cur_buf->pos = 0;
+				cur_buf->size = 0;
+			}
+			if (BLK_IS_HOLE(inode, block_idx)) {		/* 空洞读出来是 0 */
+				memset((uint8_t *)cur_buf->mem + cur_buf->size, 0, copy_size);
+			}
+			else if (newfs_load_data(inode, block_idx) == NULL) {
+				for (size_t i = 0; i < bufv->count; i++) {
+					free(bufv->buf[i].mem);
+				}
+				free(bufv);
+				return -NFS_ERROR_IO;
+			}
+			else {
+				memcpy((uint8_t *)cur_buf->mem + cur_buf->size,
+					   inode->data[block_idx] + block_offset, copy_size);
+			}
+		}
+		cur_buf->size += copy_size;
+		remaining_size -= copy_size;
+		cur_offset += copy_size;
+	}
+	for (size_t i = 0; i < bufv->count; i++) {			/* FUSE 稍后直接从镜像读，先记到驱动上 */
+		if (bufv->buf[i].flags & FUSE_BUF_IS_FD) {
+			newfs_driver_direct(DDRIVER_TRACE_READ, bufv->buf[i].pos, bufv->buf[i].size);
+		}
+	}
+
+	*bufp = bufv;
+	return NFS_ERROR_NONE;
 }
 /**
  * @brief 删除文件
  * 
+ * 目录项摘下后立即返回，数据块和 inode 由后台回收线程批量释放；
+ * 仍被打开着的文件成为孤儿，最后一次 release 之后才回收。
+ * 
  * @param path 相对于挂载点的路径
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_unlink(const char* path) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct newfs_dentry* dentry;
+	struct newfs_inode*  inode;
+
+	if (newfs_ctl_path(path) != NFS_CTL_NONE) {			/* 控制目录只读 */
+		return -NFS_ERROR_ACCESS;
+	}
+	dentry = lookup(path, &is_find, &is_root);
+	if (is_find == FALSE) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	inode = dentry->inode;
+	if (inode->file_type == NFS_DIR) {
+		return -NFS_ERROR_ISDIR;
+	}
+
+	newfs_drop_dentry(dentry->parent->inode, dentry);
+	free_dentry(dentry);
+	newfs_inode_unlink(inode);							/* 块和 inode 由回收线程释放 */
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -550,14 +872,105 @@ int newfs_unlink(const char* path) {
  * rm ./tests/mnt/j/ -r
  *  1) Step 1. rm ./tests/mnt/j/j
  *  2) Step 2. rm ./tests/mnt/j
- * 即，先删除最深层的文件，再删除目录文件本身
+ * 即，先删除最深层的文件，再删除目录文件本身，所以这里只删除空目录
  * 
  * @param path 相对于挂载点的路径
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_rmdir(const char* path) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct newfs_dentry* dentry;
+	struct newfs_inode*  inode;
+
+	if (newfs_ctl_path(path) != NFS_CTL_NONE) {			/* 控制目录只读 */
+		return -NFS_ERROR_ACCESS;
+	}
+	dentry = lookup(path, &is_find, &is_root);
+	if (is_find == FALSE) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (is_root) {
+		return -NFS_ERROR_BUSY;
+	}
+	inode = dentry->inode;
+	if (inode->file_type != NFS_DIR) {
+		return -NFS_ERROR_NOTDIR;
+	}
+	if (inode->dir_dentry_cnt > 0) {
+		return -NFS_ERROR_NOTEMPTY;
+	}
+
+	newfs_drop_dentry(dentry->parent->inode, dentry);
+	free_dentry(dentry);
+	newfs_inode_unlink(inode);
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 查找 path 所在的父目录
+ * 
+ * @param path 相对于挂载点的路径
+ * @return struct newfs_dentry* 父目录的 dentry，父目录不存在或者不是目录时返回 NULL
+ */
+static struct newfs_dentry* newfs_lookup_parent(const char* path) {
+	boolean	is_find, is_root;
+	char* parent_path = strdup(path);
+	char* slash = strrchr(parent_path, '/');
+	struct newfs_dentry* dentry;
+
+	if (slash == parent_path) {
+		slash[1] = '\0';
+	}
+	else {
+		slash[0] = '\0';
+	}
+	dentry = lookup(parent_path, &is_find, &is_root);
+	free(parent_path);
+	if (!is_find || dentry->inode->file_type != NFS_DIR) {
+		return NULL;
+	}
+	return dentry;
+}
+
+/**
+ * @brief dir 是否是 dentry 本身或者在 dentry 的子树中
+ */
+static boolean newfs_is_subtree(struct newfs_dentry* dir, struct newfs_dentry* dentry) {
+	for (; dir != NULL; dir = dir->parent) {
+		if (dir == dentry) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @brief 交换两个目录项：互换名字和所在的目录，dentry 仍然跟着各自的 inode，
+ * 子目录项的 parent 不用修改
+ */
+static void newfs_exchange_dentry(struct newfs_dentry* a, struct newfs_dentry* b) {
+	struct newfs_dentry* a_parent = a->parent;
+	struct newfs_dentry* b_parent = b->parent;
+	struct newfs_dentry  tmp;
+
+	tmp.name_hash = a->name_hash;
+	tmp.name_len  = a->name_len;
+	memcpy(tmp.inline_name, a->inline_name, NFS_INLINE_NAME_LEN);	/* 也覆盖了 ext_name */
+	a->name_hash = b->name_hash;
+	a->name_len  = b->name_len;
+	memcpy(a->inline_name, b->inline_name, NFS_INLINE_NAME_LEN);
+	b->name_hash = tmp.name_hash;
+	b->name_len  = tmp.name_len;
+	memcpy(b->inline_name, tmp.inline_name, NFS_INLINE_NAME_LEN);
+
+	if (a_parent != b_parent) {
+		newfs_dentry_unlink(a);
+		newfs_dentry_unlink(b);
+		newfs_dentry_link(&b_parent->inode->dentries, a);
+		newfs_dentry_link(&a_parent->inode->dentries, b);
+		a->parent = b_parent;
+		b->parent = a_parent;
+	}
 }
 
 /**
@@ -568,8 +981,108 @@ int newfs_rmdir(const char* path) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_rename(const char* from, const char* to) {
-	/* 选做 */
-	return 0;
+	return newfs_rename2(from, to, 0);
+}
+
+/**
+ * @brief 带 flags 的重命名，对应 renameat2
+ * 
+ * 只把 dentry 从原来的父目录摘下（通过 pprev，O(1)）挂到新父目录的链表头，
+ * 改名字，不移动任何数据块；目录的子目录项和 inode 都不动。
+ * 被覆盖的目标和 unlink 一样交给回收线程。
+ * newfs 的元数据只在卸载时从根目录整体写回，没有日志，这里只修改内存中的目录树。
+ * FUSE 2.9 的 rename 没有 flags，newfs_rename 以 flags = 0 调用。
+ * 
+ * @param from 源文件路径
+ * @param to 目标文件路径
+ * @param flags 0、RENAME_NOREPLACE 或 RENAME_EXCHANGE
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_rename2(const char* from, const char* to, unsigned int flags) {
+	boolean	is_find, is_root, to_find;
+	struct newfs_dentry* from_dentry;
+	struct newfs_dentry* from_parent;
+	struct newfs_dentry* to_parent;
+	struct newfs_dentry* to_dentry;
+	struct newfs_inode*  to_inode = NULL;
+	int ret;
+
+	if (newfs_ctl_path(from) != NFS_CTL_NONE || newfs_ctl_path(to) != NFS_CTL_NONE) {
+		return -NFS_ERROR_ACCESS;
+	}
+	from_dentry = lookup(from, &is_find, &is_root);
+	if (is_find == FALSE) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (is_root) {
+		return -NFS_ERROR_BUSY;
+	}
+	if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+		(flags & RENAME_NOREPLACE && flags & RENAME_EXCHANGE)) {
+		return -NFS_ERROR_INVAL;
+	}
+	to_parent = newfs_lookup_parent(to);
+	if (to_parent == NULL) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	from_parent = from_dentry->parent;
+	to_dentry = lookup(to, &to_find, &is_root);
+	if (to_find && to_dentry == from_dentry) {
+		return NFS_ERROR_NONE;
+	}
+	if (from_dentry->file_type == NFS_DIR && newfs_is_subtree(to_parent, from_dentry)) {
+		return -NFS_ERROR_INVAL;						/* 目录不能移到自己的子树下 */
+	}
+
+	if (flags & RENAME_EXCHANGE) {
+		if (!to_find) {
+			return -NFS_ERROR_NOTFOUND;
+		}
+		if (to_dentry->file_type == NFS_DIR && newfs_is_subtree(from_parent, to_dentry)) {
+			return -NFS_ERROR_INVAL;
+		}
+		newfs_exchange_dentry(from_dentry, to_dentry);
+		return NFS_ERROR_NONE;
+	}
+
+	if (to_find) {
+		if (flags & RENAME_NOREPLACE) {
+			return -NFS_ERROR_EXISTS;
+		}
+		if (is_root) {
+			return -NFS_ERROR_BUSY;
+		}
+		to_inode = to_dentry->inode;
+		if (to_inode->file_type == NFS_DIR) {
+			if (from_dentry->file_type != NFS_DIR) {
+				return -NFS_ERROR_ISDIR;
+			}
+			if (to_inode->dir_dentry_cnt > 0) {
+				return -NFS_ERROR_NOTEMPTY;
+			}
+		}
+		else if (from_dentry->file_type == NFS_DIR) {
+			return -NFS_ERROR_NOTDIR;
+		}
+		newfs_drop_dentry(to_parent->inode, to_dentry);
+	}
+
+	if (from_parent != to_parent) {
+		newfs_drop_dentry(from_parent->inode, from_dentry);
+		ret = allocate_dentry(to_parent->inode, from_dentry);
+		if (ret < 0) {								/* 新目录满了，挂回原处 */
+			allocate_dentry(from_parent->inode, from_dentry);
+			return ret;
+		}
+		from_dentry->parent = to_parent;
+	}
+	newfs_dentry_set_name(from_dentry, get_fname(to));
+
+	if (to_inode != NULL) {
+		free_dentry(to_dentry);
+		newfs_inode_unlink(to_inode);
+	}
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -581,6 +1094,40 @@ int newfs_rename(const char* from, const char* to) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_open(const char* path, struct fuse_file_info* fi) {
+	boolean	is_find, is_root;
+	int ctl = newfs_ctl_path(path);
+	struct newfs_dentry* dentry;
+
+	if (ctl != NFS_CTL_NONE) {
+		if (ctl == NFS_CTL_STAT_FILE) {
+			return (fi->flags & O_ACCMODE) == O_RDONLY ? newfs_ctl_open(fi) : -NFS_ERROR_ACCESS;
+		}
+		return ctl == NFS_CTL_ROOT ? -NFS_ERROR_ISDIR : -NFS_ERROR_NOTFOUND;
+	}
+	dentry = lookup(path, &is_find, &is_root);
+	if (is_find == FALSE) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	newfs_inode_open(dentry->inode);
+	fi->fh = (uintptr_t)dentry->inode;
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 关闭文件，已经被 unlink 的文件在最后一次关闭后回收
+ * 
+ * @param path 相对于挂载点的路径，可能为 NULL
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_release(const char* path, struct fuse_file_info* fi) {
+	if (NFS_FH_IS_CTL(fi)) {
+		newfs_ctl_release(fi);
+	}
+	else if (fi->fh != 0) {
+		newfs_inode_release((struct newfs_inode*)(uintptr_t)fi->fh);
+		fi->fh = 0;
+	}
 	return NFS_ERROR_NONE;
 }
 
@@ -598,30 +1145,165 @@ int newfs_opendir(const char* path, struct fuse_file_info* fi) {
 /**
  * @brief 改变文件大小
  * 
+ * 缩小时释放新大小之后的所有数据块，保留的最后一块中超出新大小的部分清零，
+ * 之后再变大时读出来是 0。变大的部分是空洞，不分配块。
+ * 
  * @param path 相对于挂载点的路径
  * @param offset 改变后文件大小
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_truncate(const char* path, off_t offset) {
-	boolean	is_find, is_root;
-	struct newfs_dentry* dentry = lookup(path, &is_find, &is_root);
+	return newfs_ftruncate(path, offset, NULL);
+}
+
+/**
+ * @brief 改变打开着的文件的大小，已经 unlink 的文件 path 为 NULL，用 fi->fh 中的 inode
+ * 
+ * @param path 相对于挂载点的路径，可能为 NULL
+ * @param offset 改变后文件大小
+ * @param fi 文件信息，可能为 NULL
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ftruncate(const char* path, off_t offset, struct fuse_file_info* fi) {
 	struct newfs_inode*  inode;
 	
-	if (is_find == FALSE) {
+	if (NFS_FH_IS_CTL(fi) || newfs_ctl_path(path) != NFS_CTL_NONE) {	/* 控制目录只读 */
+		return -NFS_ERROR_ACCESS;
+	}
+	inode = newfs_file_inode(path, fi);
+	if (inode == NULL) {
 		return -NFS_ERROR_NOTFOUND;
 	}
-	
-	inode = dentry->inode;
 
-	if (inode->dentry->file_type == NFS_DIR) {
+	if (inode->file_type == NFS_DIR) {
 		return -NFS_ERROR_ISDIR;
 	}
 
+	if (offset > MAX_FILE_SZ()) {
+		return -NFS_ERROR_FBIG;
+	}
+
+	if (offset < inode->file_size) {
+		int keep_blks = ROUND_UP(offset, LOGIC_SZ()) / LOGIC_SZ();
+		int tail = offset % LOGIC_SZ();
+
+		free_data_from(inode, keep_blks);
+		if (tail != 0 && !BLK_IS_HOLE(inode, keep_blks - 1)) {
+			uint8_t* blk = newfs_prepare_write(inode, keep_blks - 1, FALSE);
+			if (blk == NULL) {
+				return -NFS_ERROR_IO;
+			}
+			memset(blk + tail, 0, LOGIC_SZ() - tail);
+		}
+	}
+	else if (newfs_inline_fit(inode, offset) != NFS_ERROR_NONE) {
+		return -NFS_ERROR_NOSPACE;
+	}
 	inode->file_size = offset;
 
 	return NFS_ERROR_NONE;
 }
 
+/**
+ * @brief 为文件预分配空间，或者打洞
+ * 
+ * 默认模式下 [offset, offset + len) 中的空洞一次性分配物理上连续的数据块，
+ * 之后顺序写入这些块时不再经过分配器；预分配的块在写入之前读出来是 0。
+ * FALLOC_FL_KEEP_SIZE 时不改变文件大小。
+ * FALLOC_FL_PUNCH_HOLE（必须与 FALLOC_FL_KEEP_SIZE 一起使用）释放完整覆盖的块，
+ * 两端不满一块的部分清零。
+ * 
+ * @param path 相对于挂载点的路径
+ * @param mode 0 或 FALLOC_FL_* 的组合
+ * @param offset 起始偏移
+ * @param len 长度
+ * @param fi 文件信息，已经 unlink 的文件 path 为 NULL，用 fi->fh 中的 inode
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fallocate(const char* path, int mode, off_t offset, off_t len,
+					struct fuse_file_info* fi) {
+	struct newfs_inode*  inode;
+	off_t end = offset + len;
+	int blk_idx;
+
+	if (NFS_FH_IS_CTL(fi) || newfs_ctl_path(path) != NFS_CTL_NONE) {	/* 控制目录只读 */
+		return -NFS_ERROR_ACCESS;
+	}
+	inode = newfs_file_inode(path, fi);
+	if (inode == NULL) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (inode->file_type == NFS_DIR) {
+		return -NFS_ERROR_ISDIR;
+	}
+	if (offset < 0 || len <= 0) {
+		return -NFS_ERROR_INVAL;
+	}
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -NFS_ERROR_OPNOTSUPP;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+			return -NFS_ERROR_OPNOTSUPP;
+		}
+		if (end > inode->file_size) {
+			end = inode->file_size;
+		}
+		while (offset < end) {
+			int block_offset;
+			size_t punch_size;
+
+			blk_idx = offset / LOGIC_SZ();
+			block_offset = offset % LOGIC_SZ();
+			punch_size = (end - offset < LOGIC_SZ() - block_offset) ? end - offset : LOGIC_SZ() - block_offset;
+			if (punch_size == LOGIC_SZ()) {
+				free_data(inode, blk_idx);
+			}
+			else if (!BLK_IS_HOLE(inode, blk_idx)) {
+				uint8_t* blk = newfs_prepare_write(inode, blk_idx, FALSE);
+				if (blk == NULL) {
+					return -NFS_ERROR_IO;
+				}
+				memset(blk + block_offset, 0, punch_size);
+			}
+			offset += punch_size;
+		}
+		return NFS_ERROR_NONE;
+	}
+
+	if (end > MAX_FILE_SZ()) {
+		return -NFS_ERROR_FBIG;
+	}
+	// 内联文件先把内容搬到第 0 块，再按普通文件预分配
+	if (IS_INLINE(inode) && newfs_inline_fit(inode, MAX_FILE_SZ()) != NFS_ERROR_NONE) {
+		return -NFS_ERROR_NOSPACE;
+	}
+	// 每一段连续的空洞一起分配，尽量落在连续的磁盘块上
+	blk_idx = offset / LOGIC_SZ();
+	while (blk_idx * LOGIC_SZ() < end) {
+		int run_len = 0;
+		int ret;
+
+		if (!BLK_IS_HOLE(inode, blk_idx)) {			/* 已分配或延迟分配的块 */
+			blk_idx++;
+			continue;
+		}
+		while ((blk_idx + run_len) * LOGIC_SZ() < end &&
+			   BLK_IS_HOLE(inode, blk_idx + run_len)) {
+			run_len++;
+		}
+		ret = allocate_data_run(inode, blk_idx, run_len);
+		if (ret < 0) {
+			return ret;
+		}
+		blk_idx += ret;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->file_size) {
+		inode->file_size = end;
+	}
+	return NFS_ERROR_NONE;
+}
 
 /**
  * @brief 访问文件，因为读写文件时需要查看权限
@@ -638,9 +1320,18 @@ int newfs_truncate(const char* path, off_t offset) {
 int newfs_access(const char* path, int type) {
 		boolean	is_find, is_root;
 	boolean is_access_ok = FALSE;
-	struct newfs_dentry* dentry = lookup(path, &is_find, &is_root);
+	int ctl = newfs_ctl_path(path);
+	struct newfs_dentry* dentry;
 	struct newfs_inode*  inode;
 
+	if (ctl != NFS_CTL_NONE) {
+		if (ctl == NFS_CTL_NOENT) {
+			return -NFS_ERROR_NOTFOUND;
+		}
+		return (type & W_OK) ? -NFS_ERROR_ACCESS : NFS_ERROR_NONE;
+	}
+	dentry = lookup(path, &is_find, &is_root);
+
 	switch (type)
 	{
 	case R_OK:
@@ -663,28 +1354,3 @@ int newfs_access(const char* path, int type) {
 	return is_access_ok ? NFS_ERROR_NONE : -NFS_ERROR_ACCESS;
 	return 0;
 }	
-/******************************************************************************
-* SECTION: FUSE入口
-*******************************************************************************/
-int main(int argc, char **argv)
-{
-    int ret;
-	
-	char **argv_ = malloc(sizeof(uintptr_t) * (argc + 2));
-	for (int i = 0; i < argc; i++) {
-		argv_[i] = argv[i];
-	}
-	argv_[argc] = "-f";
-	argv_[argc + 1] = "-d";
-
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv_);
-
-	newfs_options.device = strdup("/dev/ddriver");
-
-	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
-		return -1;
-	
-	ret = fuse_main(args.argc, args.argv, &operations, NULL);
-	fuse_opt_free_args(&args);
-	return ret;
-}
\ No newline at end of file
@@ -1,23 +1,37 @@
 #include "../include/newfs.h"
 #include "types.h"
 
+#include <pthread.h>
 #include <stdint.h>
 extern struct newfs_super super;
 extern struct custom_options sfs_options;
+
+/* FUSE 多线程调用，后台回收线程也会改位图，位图的修改都在这把锁下进行 */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 还能分配的数据块数：总数减去已分配的和延迟分配预留的，持有 map_lock 时使用 */
+#define DATA_AVAIL()  (super.max_data - super.sz_usage / LOGIC_SZ() - super.reserved_blks)
 /**
  * @brief 将denry插入到inode中，采用头插法
+ * 目录项按 DENTRY_PER_BLK() 个一组存放在目录的数据块中，写满一块时再申请下一块
  *
  * @param inode
  * @param dentry
- * @return int
+ * @return int 插入后的目录项数量，目录写满时返回 -NFS_ERROR_NOSPACE
  */
 int allocate_dentry(struct newfs_inode *inode, struct newfs_dentry *dentry) {
-  if (inode->dentries == NULL) {
-    inode->dentries = dentry;
-  } else {
-    dentry->brother = inode->dentries;
-    inode->dentries = dentry;
+  int blk_idx;
+  if (newfs_load_dentries(inode) != NFS_ERROR_NONE) {
+    return -NFS_ERROR_IO;
+  }
+  if (inode->dir_dentry_cnt >= DENTRY_PER_BLK() * DATA_PER_FILE) {
+    return -NFS_ERROR_NOSPACE;
   }
+  blk_idx = inode->dir_dentry_cnt / DENTRY_PER_BLK();
+  if (inode->data_block_no[blk_idx] == -1 && allocate_data(inode, blk_idx) < 0) {
+    return -NFS_ERROR_NOSPACE;
+  }
+  newfs_dentry_link(&inode->dentries, dentry);
   inode->dir_dentry_cnt++;
   return inode->dir_dentry_cnt;
 }
@@ -30,8 +44,12 @@ struct newfs_inode *allocate_inode(struct newfs_dentry *dentry) {
   int ino_cursor = 0;
   boolean is_find_free_entry = FALSE;
   // 检查位图是否有空位
-  for (byte_cursor = 0; byte_cursor < super.sz_io * 2; byte_cursor++) {
+  pthread_mutex_lock(&map_lock);
+  for (byte_cursor = 0; byte_cursor < BLKS_SZ(super.map_inode_blks); byte_cursor++) {
     for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
+      if (ino_cursor == super.max_ino) {
+        break;
+      }
       if ((super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0) {
         super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
         is_find_free_entry = TRUE;
@@ -39,15 +57,23 @@ struct newfs_inode *allocate_inode(struct newfs_dentry *dentry) {
       }
       ino_cursor++;
     }
-    if (is_find_free_entry) {
+    if (is_find_free_entry || ino_cursor == super.max_ino) {
       break;
     }
   }
-  if (!is_find_free_entry || ino_cursor == super.max_ino) {
+  pthread_mutex_unlock(&map_lock);
+  NFS_STAT_BEGIN();
+  NFS_STAT_INC(alloc_inode);
+  NFS_STAT_ADD(alloc_inode_scan, ino_cursor + is_find_free_entry);
+  if (!is_find_free_entry) {
+    NFS_STAT_INC(alloc_inode_fail);
+  }
+  NFS_STAT_END();
+  if (!is_find_free_entry) {
     printf("allocate inode failed ");
     return -NFS_ERROR_NOSPACE;
   }
-  inode = (struct newfs_inode *)malloc(sizeof(struct newfs_inode));
+  inode = new_inode();
   inode->ino = ino_cursor;
   inode->file_size = 0;
   inode->file_type = dentry->file_type;  // todo 
@@ -57,19 +83,21 @@ struct newfs_inode *allocate_inode(struct newfs_dentry *dentry) {
   dentry->inode = inode;
 
   inode->dentry = dentry;
+  inode->link = 1;
 
   inode->dir_dentry_cnt = 0;
   inode->dentries = NULL;
+  inode->dentries_loaded = TRUE;
 
   for(int j = 0;j<DATA_PER_FILE;j++){
     inode->data_block_no[j] = -1;
     inode->data[j] = NULL;
   }
-  if(inode->dentry->file_type == NFS_DIR){// 申请一个块用来存放dentry
-    allocate_data(inode);
+  if(inode->file_type == NFS_DIR){// 申请一个块用来存放dentry
+    allocate_data(inode, 0);
   }
 
-  if (inode->dentry->file_type == NFS_REG_FILE) {
+  if (inode->file_type == NFS_REG_FILE) {
     // * 空文件
     // inode->data_block_pointer =
     //     (uint8_t *)malloc(DATA_PER_FILE * super.sz_io * 2);
@@ -78,21 +106,23 @@ struct newfs_inode *allocate_inode(struct newfs_dentry *dentry) {
   return inode;
 }
 
-// 为一个 inode 分配数据块 data_block_pointer
-// 对于目录，data_block_pointer 为null
-// 对于文件，data block pointer 为指向数据块的指针
-void allocate_data(struct newfs_inode *inode) {
-  int index = 0;
-  boolean is_found = FALSE;
-  boolean is_allocated = FALSE;
-  struct newfs_inode *inode_cursor = inode;
+/**
+ * @brief 在数据位图中找第一个空闲块并置位，延迟分配预留的块不能占用
+ *
+ * @return int 块号，没有空闲块时返回 -NFS_ERROR_NOSPACE
+ */
+static int claim_data(void) {
   int byte_cursor = 0;
   int bit_cursor = 0;
   int datano_cursor = 0;
   boolean is_find_free_entry = FALSE;
-  // 检查data位图是否有空位
-  for (byte_cursor = 0; byte_cursor < super.sz_io * 2; byte_cursor++) {
+
+  pthread_mutex_lock(&map_lock);
+  for (byte_cursor = 0; DATA_AVAIL() > 0 && byte_cursor < BLKS_SZ(super.map_data_blks); byte_cursor++) {
     for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
+      if (datano_cursor == super.max_data) {
+        break;
+      }
       if ((super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {
         super.map_data[byte_cursor] |= (0x1 << bit_cursor);
         is_find_free_entry = TRUE;
@@ -100,25 +130,322 @@ void allocate_data(struct newfs_inode *inode) {
       }
       datano_cursor++;
     }
-    if (is_find_free_entry) {
+    if (is_find_free_entry || datano_cursor == super.max_data) {
       break;
     }
   }
-  if (!is_find_free_entry || datano_cursor == super.max_data) {
+  NFS_STAT_BEGIN();
+  NFS_STAT_INC(alloc_data);
+  NFS_STAT_ADD(alloc_data_scan, datano_cursor + is_find_free_entry);
+  if (!is_find_free_entry) {
+    NFS_STAT_INC(alloc_data_fail);
+  }
+  NFS_STAT_END();
+  if (!is_find_free_entry) {
+    pthread_mutex_unlock(&map_lock);
     NFS_DBG("allocate data failed ");
     return -NFS_ERROR_NOSPACE;
   }
+  super.sz_usage += LOGIC_SZ();
+  pthread_mutex_unlock(&map_lock);
+  return datano_cursor;
+}
+
+// 为 inode 的第 blk_idx 个数据块分配磁盘块，并分配一块清零的内存缓存
+// 对于目录，缓存不会被用到，目录项在 sync_inode 时按块写回
+// 对于文件，没有分配的块是空洞，读出来是 0
+int allocate_data(struct newfs_inode *inode, int blk_idx) {
+  int datano = allocate_data_no(inode, blk_idx);
+
+  if (datano < 0) {
+    return datano;
+  }
+  if (inode->data[blk_idx] == NULL) {
+    inode->data[blk_idx] = (uint8_t*)calloc(1, LOGIC_SZ());
+  }
+  SET_BLK_DIRTY(inode, blk_idx);
+  return datano;
+}
+
+/**
+ * @brief 只为 inode 的第 blk_idx 块选一个磁盘块，不分配缓存、不标记为脏，
+ * 内容由调用者马上直接写到磁盘上
+ *
+ * @return int 块号，没有空闲块时返回 -NFS_ERROR_NOSPACE
+ */
+int allocate_data_no(struct newfs_inode *inode, int blk_idx) {
+  int datano = claim_data();
+
+  if (datano >= 0) {                    // 写回的时候根据 data_block_no 计算写回位置
+    inode->data_block_no[blk_idx] = datano;
+  }
+  return datano;
+}
 
-  for (index = 0; index < DATA_PER_FILE; index++) {
-    if ((inode_cursor->data_block_no[index]) == -1) {
-      // 空闲的数据块指针
-      inode_cursor->data_block_no[index] = datano_cursor;
-      inode->data[index] = (uint8_t*)malloc(LOGIC_SZ());
-      // 分配一块内存空间，在inode中记录下这块空间的指针。
-      // 地址是内存中的不是磁盘中的！会超出磁盘大小。需要写回磁盘，我还是需要一个no来计算offset。
-      // 写回的时候根据 data_block_no 计算写回位置
-      // ? data block pointer 如何记录下来？记录 datano
+#define DATA_BIT_USED(no)  (super.map_data[(no) / UINT8_BITS] & (0x1 << ((no) % UINT8_BITS)))
+
+/**
+ * @brief 在数据位图中找一段不超过 blk_cnt 的连续空闲块并置位，持有 map_lock 时调用
+ * 找不到足够长的连续空闲块时取最长的一段
+ *
+ * @param blk_cnt 需要的块数
+ * @param start 返回这一段的起始块号
+ * @return int 这一段的长度，没有空闲块时返回 0
+ */
+static int claim_run(int blk_cnt, int *start) {
+  int run_start = 0, run_len = 0;
+  int best_start = 0, best_len = 0;
+  int datano_cursor;
+
+  for (datano_cursor = 0; datano_cursor < super.max_data; datano_cursor++) {
+    if (DATA_BIT_USED(datano_cursor)) {
+      run_len = 0;
+      continue;
+    }
+    if (run_len++ == 0) {
+      run_start = datano_cursor;
+    }
+    if (run_len > best_len) {
+      best_start = run_start;
+      best_len = run_len;
+    }
+    if (best_len == blk_cnt) {
       break;
     }
   }
-}
\ No newline at end of file
+  NFS_STAT_BEGIN();
+  NFS_STAT_INC(alloc_run);
+  NFS_STAT_ADD(alloc_run_scan, datano_cursor < super.max_data ? datano_cursor + 1 : datano_cursor);
+  NFS_STAT_END();
+  for (int i = 0; i < best_len; i++) {
+    datano_cursor = best_start + i;
+    super.map_data[datano_cursor / UINT8_BITS] |= (0x1 << (datano_cursor % UINT8_BITS));
+  }
+  super.sz_usage += best_len * LOGIC_SZ();
+  *start = best_start;
+  return best_len;
+}
+
+/**
+ * @brief 为 inode 从第 blk_idx 块开始的 blk_cnt 个空洞预分配物理上连续的磁盘块
+ * 找不到足够长的连续空闲块时，先取最长的一段，剩下的由调用者继续分配。
+ * 预分配的块不分配缓存，标记为未写入，读出来是 0。
+ *
+ * @param inode 文件 inode，[blk_idx, blk_idx + blk_cnt) 必须都是空洞
+ * @param blk_idx 文件内的起始块号
+ * @param blk_cnt 需要的块数
+ * @return int 实际分配的块数，没有空闲块时返回 -NFS_ERROR_NOSPACE
+ */
+int allocate_data_run(struct newfs_inode *inode, int blk_idx, int blk_cnt) {
+  int best_start, best_len = 0;
+
+  pthread_mutex_lock(&map_lock);
+  if (blk_cnt > DATA_AVAIL()) {
+    blk_cnt = DATA_AVAIL();
+  }
+  if (blk_cnt > 0) {
+    best_len = claim_run(blk_cnt, &best_start);
+  }
+  pthread_mutex_unlock(&map_lock);
+  if (best_len == 0) {
+    NFS_DBG("allocate data run failed ");
+    return -NFS_ERROR_NOSPACE;
+  }
+
+  for (int i = 0; i < best_len; i++) {
+    inode->data_block_no[blk_idx + i] = best_start + i;
+    SET_BLK_UNWRITTEN(inode, blk_idx + i);
+  }
+  return best_len;
+}
+
+/**
+ * @brief 延迟分配：为 inode 的第 blk_idx 块只预留一个数据块的额度，不选磁盘块
+ * 缓存清零（已有缓存时保留内容）并标记为脏，等 sync_inode 写回时再由
+ * allocate_delayed 统一分配
+ *
+ * @param inode 文件 inode，第 blk_idx 块必须是空洞（或者内联内容所在的第 0 块）
+ * @param blk_idx 文件内的块号
+ * @return int 0成功，没有空间时返回 -NFS_ERROR_NOSPACE
+ */
+int reserve_data(struct newfs_inode *inode, int blk_idx) {
+  pthread_mutex_lock(&map_lock);
+  if (DATA_AVAIL() <= 0) {
+    pthread_mutex_unlock(&map_lock);
+    return -NFS_ERROR_NOSPACE;
+  }
+  super.reserved_blks++;
+  pthread_mutex_unlock(&map_lock);
+
+  if (inode->data[blk_idx] == NULL) {
+    inode->data[blk_idx] = (uint8_t *)calloc(1, LOGIC_SZ());
+  }
+  SET_BLK_DELAYED(inode, blk_idx);
+  SET_BLK_DIRTY(inode, blk_idx);
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 归还 cnt 个延迟分配的预留额度
+ */
+void unreserve_data(int cnt) {
+  if (cnt == 0) {
+    return;
+  }
+  pthread_mutex_lock(&map_lock);
+  super.reserved_blks -= cnt;
+  pthread_mutex_unlock(&map_lock);
+}
+
+/**
+ * @brief 为 inode 所有延迟分配的块选择磁盘块，写回之前调用
+ * 所有待分配的块一次性确定，按文件内连续的段申请连续的磁盘块，
+ * 多次小写入形成的文件在磁盘上也是连续的
+ *
+ * @param inode 文件 inode
+ * @return int 0成功，否则返回对应错误号
+ */
+int allocate_delayed(struct newfs_inode *inode) {
+  int blk_idx = 0;
+
+  while (inode->delayed_blks != 0 && blk_idx < DATA_PER_FILE) {
+    int run_len = 0, got, start;
+
+    if (!BLK_DELAYED(inode, blk_idx)) {
+      blk_idx++;
+      continue;
+    }
+    while (blk_idx + run_len < DATA_PER_FILE && BLK_DELAYED(inode, blk_idx + run_len)) {
+      run_len++;
+    }
+    pthread_mutex_lock(&map_lock);
+    got = claim_run(run_len, &start);     // 用的是自己预留的额度，不检查 DATA_AVAIL()
+    super.reserved_blks -= got;
+    pthread_mutex_unlock(&map_lock);
+    if (got == 0) {
+      NFS_DBG("[%s] no space for reserved blocks\n", __func__);
+      return -NFS_ERROR_NOSPACE;
+    }
+    for (int i = 0; i < got; i++) {
+      inode->data_block_no[blk_idx + i] = start + i;
+      CLR_BLK_DELAYED(inode, blk_idx + i);
+    }
+    blk_idx += got;
+  }
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 清除数据位图中 [datano, datano + cnt) 的位
+ * 两端不满一个字节的部分逐位清除，中间整字节一次 memset
+ */
+static void clear_data_bits(int datano, int cnt) {
+  int end = datano + cnt;
+
+  while (datano < end && datano % UINT8_BITS != 0) {
+    super.map_data[datano / UINT8_BITS] &= ~(0x1 << (datano % UINT8_BITS));
+    datano++;
+  }
+  if (end - datano >= UINT8_BITS) {
+    memset(super.map_data + datano / UINT8_BITS, 0, (end - datano) / UINT8_BITS);
+    datano += (end - datano) / UINT8_BITS * UINT8_BITS;
+  }
+  while (datano < end) {
+    super.map_data[datano / UINT8_BITS] &= ~(0x1 << (datano % UINT8_BITS));
+    datano++;
+  }
+}
+
+static int cmp_datano(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief 批量归还数据块和 inode 到位图
+ * 数据块号排序后按连续段清除，整个批次只加一次锁
+ *
+ * @param datanos 要释放的数据块号，会被重新排序
+ * @param data_cnt 数据块个数
+ * @param inos 要释放的 inode 号，可以为 NULL
+ * @param ino_cnt inode 个数
+ */
+void release_blocks(int *datanos, int data_cnt, int *inos, int ino_cnt) {
+  qsort(datanos, data_cnt, sizeof(int), cmp_datano);
+  // 在清位图之前丢弃，块还没有回到空闲状态，不会被别人分配后又被抹掉
+  for (int i = 0, run = 1; super.is_discard && i < data_cnt; i += run) {
+    for (run = 1; i + run < data_cnt && datanos[i + run] == datanos[i] + run; run++)
+      ;
+    newfs_driver_discard(DATA_OFS(datanos[i]), run * LOGIC_SZ());
+  }
+  pthread_mutex_lock(&map_lock);
+  for (int i = 0, run = 1; i < data_cnt; i += run) {
+    for (run = 1; i + run < data_cnt && datanos[i + run] == datanos[i] + run; run++)
+      ;
+    clear_data_bits(datanos[i], run);
+  }
+  super.sz_usage -= data_cnt * LOGIC_SZ();
+  for (int i = 0; i < ino_cnt; i++) {
+    super.map_inode[inos[i] / UINT8_BITS] &= ~(0x1 << (inos[i] % UINT8_BITS));
+  }
+  pthread_mutex_unlock(&map_lock);
+}
+
+/**
+ * @brief 释放 inode 从第 blk_idx 块开始的所有数据块及其缓存，这些块重新成为空洞
+ * 预分配的文件磁盘块通常只有一段，位图一次清除
+ *
+ * @param inode 文件 inode
+ * @param blk_idx 文件内的起始块号
+ * @return int 释放的块数
+ */
+int free_data_from(struct newfs_inode *inode, int blk_idx) {
+  int datanos[DATA_PER_FILE];
+  int cnt = 0, delayed_cnt = 0;
+
+  for (int i = blk_idx; i < DATA_PER_FILE; i++) {
+    if (inode->data_block_no[i] != -1) {
+      datanos[cnt++] = inode->data_block_no[i];
+    }
+    if (BLK_DELAYED(inode, i)) {
+      delayed_cnt++;
+      CLR_BLK_DELAYED(inode, i);
+    }
+    free(inode->data[i]);
+    inode->data[i] = NULL;
+    inode->data_block_no[i] = -1;
+    CLR_BLK_DIRTY(inode, i);
+    CLR_BLK_UNWRITTEN(inode, i);
+  }
+  release_blocks(datanos, cnt, NULL, 0);
+  unreserve_data(delayed_cnt);
+  if (blk_idx == 0) {                   // 内联的内容放在 data[0]，已经一起释放
+    inode->flags &= ~NFS_INODE_INLINE;
+  }
+  return cnt;
+}
+
+/**
+ * @brief 释放 inode 的第 blk_idx 个数据块及其缓存，该块重新成为空洞
+ *
+ * @param inode 文件 inode
+ * @param blk_idx 文件内的块号
+ */
+void free_data(struct newfs_inode *inode, int blk_idx) {
+  int datano = inode->data_block_no[blk_idx];
+
+  if (datano != -1) {
+    release_blocks(&datano, 1, NULL, 0);
+  }
+  if (BLK_DELAYED(inode, blk_idx)) {
+    unreserve_data(1);
+    CLR_BLK_DELAYED(inode, blk_idx);
+  }
+  free(inode->data[blk_idx]);
+  inode->data[blk_idx] = NULL;
+  inode->data_block_no[blk_idx] = -1;
+  CLR_BLK_DIRTY(inode, blk_idx);
+  CLR_BLK_UNWRITTEN(inode, blk_idx);
+  if (blk_idx == 0) {
+    inode->flags &= ~NFS_INODE_INLINE;
+  }
+}
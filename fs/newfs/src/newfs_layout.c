@@ -0,0 +1,111 @@
+#include "../include/newfs.h"
+
+/*
+ * 磁盘布局的计算和校验，mkfs.newfs 和挂载共用。这里只依赖传进来的参数，
+ * 不使用全局的 super，逻辑块大小等都由调用者给出。
+ *
+ * | super(1) | inode 位图 | data 位图 | inode 表 | 数据区 |
+ */
+#define NFS_SUPER_BLKS          1
+#define DIV_ROUND_UP(a, b)      (((a) + (b) - 1) / (b))
+
+/**
+ * @brief 逻辑块大小是否合法：2 的幂，在 [NFS_MIN_BLK_SZ, NFS_MAX_BLK_SZ] 内，且是 IO 大小的整数倍
+ */
+boolean newfs_valid_blk_sz(int sz_blk, int sz_io) {
+  return sz_blk >= NFS_MIN_BLK_SZ && sz_blk <= NFS_MAX_BLK_SZ &&
+         (sz_blk & (sz_blk - 1)) == 0 && sz_io > 0 && sz_blk % sz_io == 0;
+}
+
+/**
+ * @brief 根据设备大小、逻辑块大小和 inode 比例计算布局，填写 super_d
+ * 每 inode_ratio 字节估算一个 inode，位图按要表示的 inode / 数据块数决定块数，
+ * 数据区越大 data 位图越大，反过来又挤占数据区，迭代到不再变化为止。
+ * 4M 磁盘、1K 块、默认比例时和原来挂载时自动格式化的布局完全一样
+ *
+ * @param super_d 填写的超级块，root 目录占用的 1 个数据块计入 sz_usage
+ * @param sz_disk 设备大小
+ * @param sz_io 设备 IO 大小
+ * @param sz_blk 逻辑块大小
+ * @param inode_ratio 每多少字节一个 inode
+ * @return int 0成功，参数不合法返回 -NFS_ERROR_INVAL，设备太小返回 -NFS_ERROR_NOSPACE
+ */
+int newfs_layout_init(struct newfs_super_d *super_d, int sz_disk, int sz_io,
+                      int sz_blk, int inode_ratio) {
+  int bits_per_blk = sz_blk * UINT8_BITS;
+  int total_blks, inode_num, max_ino, inode_blks, data_blks;
+  int map_inode_blks, map_data_blks = 1;
+
+  if (!newfs_valid_blk_sz(sz_blk, sz_io) || inode_ratio <= 0) {
+    return -NFS_ERROR_INVAL;
+  }
+  total_blks = sz_disk / sz_blk;
+  inode_num = sz_disk / inode_ratio;
+  map_inode_blks = inode_num > 0 ? DIV_ROUND_UP(inode_num, bits_per_blk) : 1;
+  for (;;) {
+    // 超级块和位图也按 inode 折算掉，与原来的布局保持一致
+    max_ino = inode_num - NFS_SUPER_BLKS - map_inode_blks - map_data_blks;
+    if (max_ino <= 0) {
+      return -NFS_ERROR_NOSPACE;
+    }
+    inode_blks = DIV_ROUND_UP(max_ino * NFS_INODE_SZ, sz_blk);
+    data_blks = total_blks - NFS_SUPER_BLKS - map_inode_blks - map_data_blks - inode_blks;
+    if (data_blks <= 0) {
+      return -NFS_ERROR_NOSPACE;
+    }
+    if (DIV_ROUND_UP(data_blks, bits_per_blk) <= map_data_blks) {
+      break;
+    }
+    map_data_blks = DIV_ROUND_UP(data_blks, bits_per_blk);
+  }
+
+  memset(super_d, 0, sizeof(struct newfs_super_d));
+  super_d->magic = NEWFS_MAGIC;
+  super_d->sz_usage = sz_blk;
+  super_d->map_inode_blks = map_inode_blks;
+  super_d->map_inode_offset = NFS_SUPER_BLKS * sz_blk;
+  super_d->map_data_blks = map_data_blks;
+  super_d->map_data_offset = super_d->map_inode_offset + map_inode_blks * sz_blk;
+  super_d->inode_offset = super_d->map_data_offset + map_data_blks * sz_blk;
+  super_d->data_offset = super_d->inode_offset + inode_blks * sz_blk;
+  super_d->max_inode = max_ino;
+  super_d->sz_inode = NFS_INODE_SZ;
+  super_d->sz_blk = sz_blk;
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 挂载前校验超级块：魔数、块大小以及各区域的位置和大小是否自洽
+ * 旧镜像的 sz_blk / sz_inode 为 0，按 sz_io * 2 和每 inode 一块处理
+ *
+ * @param super_d 从磁盘读出的超级块
+ * @param sz_disk 设备大小
+ * @param sz_io 设备 IO 大小
+ * @return int 0成功，不是合法的 newfs 镜像时返回 -NFS_ERROR_INVAL
+ */
+int newfs_layout_check(const struct newfs_super_d *super_d, int sz_disk, int sz_io) {
+  int sz_blk, sz_inode;
+  long long inode_end;
+
+  if (super_d->magic != NEWFS_MAGIC) {
+    return -NFS_ERROR_INVAL;
+  }
+  sz_blk = super_d->sz_blk != 0 ? (int)super_d->sz_blk : sz_io * 2;
+  sz_inode = super_d->sz_inode != 0 ? (int)super_d->sz_inode : sz_blk;
+  if (!newfs_valid_blk_sz(sz_blk, sz_io) || sz_inode > sz_blk || sz_blk % sz_inode != 0) {
+    return -NFS_ERROR_INVAL;
+  }
+  if (super_d->map_inode_blks == 0 || super_d->map_data_blks == 0 || super_d->max_inode == 0 ||
+      super_d->max_inode > super_d->map_inode_blks * (uint32_t)sz_blk * UINT8_BITS) {
+    return -NFS_ERROR_INVAL;
+  }
+  inode_end = super_d->inode_offset + (long long)super_d->max_inode * sz_inode;
+  if (super_d->map_inode_offset < (uint32_t)sz_blk ||
+      super_d->map_data_offset < super_d->map_inode_offset + super_d->map_inode_blks * sz_blk ||
+      super_d->inode_offset < super_d->map_data_offset + super_d->map_data_blks * sz_blk ||
+      super_d->data_offset < inode_end || super_d->data_offset >= (uint32_t)sz_disk ||
+      super_d->data_offset % sz_blk != 0) {
+    return -NFS_ERROR_INVAL;
+  }
+  return NFS_ERROR_NONE;
+}
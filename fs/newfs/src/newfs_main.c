@@ -0,0 +1,190 @@
+#include "newfs.h"
+
+/*
+ * newfs 的 FUSE 入口。文件系统本身（newfs.c、newfs_util.c、newfs_allocs.c 等）
+ * 编译成 newfs_core 库，这里只负责解析参数、检查设备并把操作表交给 fuse_main，
+ * 操作表中的回调经过计时包装，延迟记入 /.newfs/stats；
+ * 不经过 FUSE 的进程内基准 tools/bench_inproc.c 链接的是同一个库。
+ */
+
+/******************************************************************************
+* SECTION: 宏定义
+*******************************************************************************/
+#define OPTION(t, p)        { t, offsetof(struct custom_options, p), 1 }
+/* 计时调用 newfs_* 并记入 /.newfs/stats 的延迟直方图 */
+#define NFS_TIMED(op, call)  do { uint64_t t0 = newfs_stats_now(); int ret = (call);    \
+                                  newfs_stats_op(op, t0); return ret; } while (0)
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct custom_options newfs_options;
+
+static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
+	OPTION("--device=%s", device),
+	OPTION("--zero-copy", zero_copy),
+	OPTION("--trace=%s", trace),
+	OPTION("--discard", discard),
+	FUSE_OPT_END
+};
+/******************************************************************************
+* SECTION: 计时包装
+*******************************************************************************/
+static int timed_getattr(const char* path, struct stat* st) {
+	NFS_TIMED(NFS_OP_GETATTR, newfs_getattr(path, st));
+}
+static int timed_fgetattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_GETATTR, newfs_fgetattr(path, st, fi));
+}
+static int timed_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+						 struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_READDIR, newfs_readdir(path, buf, filler, offset, fi));
+}
+static int timed_mkdir(const char* path, mode_t mode) {
+	NFS_TIMED(NFS_OP_MKDIR, newfs_mkdir(path, mode));
+}
+static int timed_mknod(const char* path, mode_t mode, dev_t dev) {
+	NFS_TIMED(NFS_OP_MKNOD, newfs_mknod(path, mode, dev));
+}
+static int timed_write(const char* path, const char* buf, size_t size, off_t offset,
+					   struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_WRITE, newfs_write(path, buf, size, offset, fi));
+}
+static int timed_write_buf(const char* path, struct fuse_bufvec* bufv, off_t offset,
+						   struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_WRITE_BUF, newfs_write_buf(path, bufv, offset, fi));
+}
+static int timed_read(const char* path, char* buf, size_t size, off_t offset,
+					  struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_READ, newfs_read(path, buf, size, offset, fi));
+}
+static int timed_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset,
+						  struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_READ_BUF, newfs_read_buf(path, bufp, size, offset, fi));
+}
+static int timed_utimens(const char* path, const struct timespec tv[2]) {
+	NFS_TIMED(NFS_OP_UTIMENS, newfs_utimens(path, tv));
+}
+static int timed_truncate(const char* path, off_t offset) {
+	NFS_TIMED(NFS_OP_TRUNCATE, newfs_truncate(path, offset));
+}
+static int timed_ftruncate(const char* path, off_t offset, struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_TRUNCATE, newfs_ftruncate(path, offset, fi));
+}
+static int timed_fallocate(const char* path, int mode, off_t offset, off_t len,
+						   struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_FALLOCATE, newfs_fallocate(path, mode, offset, len, fi));
+}
+static int timed_unlink(const char* path) {
+	NFS_TIMED(NFS_OP_UNLINK, newfs_unlink(path));
+}
+static int timed_rmdir(const char* path) {
+	NFS_TIMED(NFS_OP_RMDIR, newfs_rmdir(path));
+}
+static int timed_rename(const char* from, const char* to) {
+	NFS_TIMED(NFS_OP_RENAME, newfs_rename(from, to));
+}
+static int timed_open(const char* path, struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_OPEN, newfs_open(path, fi));
+}
+static int timed_release(const char* path, struct fuse_file_info* fi) {
+	NFS_TIMED(NFS_OP_RELEASE, newfs_release(path, fi));
+}
+static int timed_access(const char* path, int type) {
+	NFS_TIMED(NFS_OP_ACCESS, newfs_access(path, type));
+}
+/******************************************************************************
+* SECTION: FUSE操作定义
+*******************************************************************************/
+static struct fuse_operations operations = {
+	.init = newfs_init,						 /* mount文件系统 */		
+	.destroy = newfs_destroy,				 /* umount文件系统 */
+	.mkdir = timed_mkdir,					 /* 建目录，mkdir */
+	.getattr = timed_getattr,				 /* 获取文件属性，类似stat，必须完成 */
+	.fgetattr = timed_fgetattr,				 /* fstat，已经 unlink 的打开文件也能取到 */
+	.readdir = timed_readdir,				 /* 填充dentrys */
+	.mknod = timed_mknod,					 /* 创建文件，touch相关 */
+	.write = timed_write,								  	 /* 写入文件 */
+	.write_buf = timed_write_buf,					  	 /* 写入文件，整块写入不经过缓存 */
+	.read = timed_read,								  	 /* 读文件 */
+	.read_buf = timed_read_buf,						  	 /* 读文件，把缓存块直接交给 FUSE */
+	.utimens = timed_utimens,				 /* 修改时间，忽略，避免touch报错 */
+	.truncate = timed_truncate,						  		 /* 改变文件大小 */
+	.ftruncate = timed_ftruncate,					  		 /* 按打开的文件改变大小 */
+	.fallocate = timed_fallocate,					  	 /* 预分配连续的数据块 / 打洞 */
+	.unlink = timed_unlink,						  		 /* 删除文件 */
+	.rmdir	= timed_rmdir,						  		 /* 删除目录， rm -r */
+	.rename = timed_rename,						  		 /* 重命名，mv */
+
+	.open = timed_open,							/* /.newfs/stats 在这里生成快照 */
+	.release = timed_release,					 /* 关闭文件，孤儿文件在这里回收 */
+	.opendir = NULL,
+	.access = timed_access,
+	.flag_nullpath_ok = 1						 /* 带 fi 的回调用 fi->fh，不需要路径；
+												    已经 unlink 的打开文件路径为 NULL */
+};
+/******************************************************************************
+* SECTION: FUSE入口
+*******************************************************************************/
+/**
+ * @brief 挂载前检查设备上是否有合法的 newfs 超级块，没有格式化的设备不进入 FUSE
+ * 
+ * @param device 设备路径
+ * @return int 0成功，否则返回对应错误号
+ */
+static int newfs_probe_device(const char* device) {
+	struct newfs_super_d super_d;
+	int driver_fd, sz_disk, sz_io, ret;
+	char* buf;
+
+	driver_fd = ddriver_open((char *)device);
+	if (driver_fd < 0) {
+		return -NFS_ERROR_IO;
+	}
+	ddriver_ioctl(driver_fd, IOC_REQ_DEVICE_SIZE, &sz_disk);
+	ddriver_ioctl(driver_fd, IOC_REQ_DEVICE_IO_SZ, &sz_io);
+	buf = (char *)malloc(ROUND_UP(sizeof(struct newfs_super_d), sz_io));
+	ddriver_seek(driver_fd, 0, SEEK_SET);
+	for (int i = 0; i < (int)ROUND_UP(sizeof(struct newfs_super_d), sz_io); i += sz_io) {
+		ddriver_read(driver_fd, buf + i, sz_io);
+	}
+	memcpy(&super_d, buf, sizeof(struct newfs_super_d));
+	ret = newfs_layout_check(&super_d, sz_disk, sz_io);
+	free(buf);
+	ddriver_close(driver_fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+	
+	char **argv_ = malloc(sizeof(uintptr_t) * (argc + 2));
+	for (int i = 0; i < argc; i++) {
+		argv_[i] = argv[i];
+	}
+	argv_[argc] = "-f";
+	argv_[argc + 1] = "-d";
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv_);
+
+	newfs_options.device = strdup("/dev/ddriver");
+
+	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
+		return -1;
+	if (newfs_probe_device(newfs_options.device) != NFS_ERROR_NONE) {
+		fprintf(stderr, "%s: no newfs found, format it with mkfs.newfs first\n", newfs_options.device);
+		fuse_opt_free_args(&args);
+		return -1;
+	}
+	/* 打开着的文件被 unlink 时直接发给 newfs_unlink，由孤儿计数保证 release 前可读写 */
+	fuse_opt_add_arg(&args, "-ohard_remove");
+	/* 目录树没有锁：unlink / rmdir / rename 会释放 dentry，另一个线程正在走的路径会用到
+	   已释放的内存，所以 FUSE 回调只在一个线程里执行。回收线程只释放已经摘下、
+	   没有打开的 inode，和它共享的位图与打开计数分别由 map_lock、reap_lock 保护 */
+	fuse_opt_add_arg(&args, "-s");
+	
+	ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
+}
@@ -0,0 +1,201 @@
+#include "../include/newfs.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+extern struct newfs_super super;
+
+/*
+ * 删除文件 / 目录时只把 inode 从目录树上摘下来，数据块、inode 位图和内存的释放
+ * 交给后台回收线程：攒够 NFS_REAP_BATCH 个或者每隔 NFS_REAP_INTERVAL_MS 回收一批，
+ * 一批 inode 的块号合在一起排序，按连续段清位图，整批只加一次位图锁。
+ * 还被打开着的文件 unlink 后成为孤儿，最后一次 release 时才进入回收队列。
+ * 进入队列的 inode 已经不在目录树上，也没有 fi->fh 指向它，FUSE 线程不会再访问，
+ * 所以回收不需要目录树的锁（FUSE 以 -s 单线程运行，目录树本身也不加锁）。
+ */
+#define NFS_REAP_BATCH          64
+#define NFS_REAP_INTERVAL_MS    100
+
+static pthread_mutex_t      reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       reap_cond = PTHREAD_COND_INITIALIZER;
+static struct newfs_inode*  reap_list = NULL;
+static struct newfs_inode*  orphan_list = NULL;   /* unlink 后仍被打开着的 inode，同样用 reap_next 串起来 */
+static int                  reap_cnt = 0;
+static boolean              reap_stop = FALSE;
+static boolean              reaper_running = FALSE;
+static pthread_t            reaper;
+
+/**
+ * @brief 回收一批 inode：归还数据块和 inode 号，释放缓存和内存结构
+ *
+ * @param list 通过 reap_next 串起来的 inode
+ * @param cnt inode 个数
+ */
+static void reap_inodes(struct newfs_inode *list, int cnt) {
+  int *datanos = (int *)malloc(sizeof(int) * cnt * DATA_PER_FILE);
+  int *inos = (int *)malloc(sizeof(int) * cnt);
+  int data_cnt = 0, ino_cnt = 0, delayed_cnt = 0;
+  struct newfs_inode *inode, *next;
+
+  for (inode = list; inode != NULL; inode = inode->reap_next) {
+    for (int i = 0; i < DATA_PER_FILE; i++) {
+      if (inode->data_block_no[i] != -1) {
+        datanos[data_cnt++] = inode->data_block_no[i];
+      }
+      if (BLK_DELAYED(inode, i)) {      // 没写回过的块只需归还预留额度
+        delayed_cnt++;
+      }
+    }
+    inos[ino_cnt++] = inode->ino;
+  }
+  release_blocks(datanos, data_cnt, inos, ino_cnt);
+  unreserve_data(delayed_cnt);
+
+  for (inode = list; inode != NULL; inode = next) {
+    next = inode->reap_next;
+    newfs_clear_dirty(inode, inode->dirty_blks);  // 没写回的脏块不再算在统计里
+    for (int i = 0; i < DATA_PER_FILE; i++) {
+      free(inode->data[i]);
+    }
+    free(inode);
+  }
+  free(datanos);
+  free(inos);
+}
+
+/**
+ * @brief 取下当前的回收队列并回收，调用时持有 reap_lock，回收期间释放锁
+ */
+static void reap_pending(void) {
+  struct newfs_inode *list = reap_list;
+  int cnt = reap_cnt;
+
+  if (list == NULL) {
+    return;
+  }
+  reap_list = NULL;
+  reap_cnt = 0;
+  pthread_mutex_unlock(&reap_lock);
+  reap_inodes(list, cnt);
+  pthread_mutex_lock(&reap_lock);
+}
+
+static void *reaper_main(void *arg) {
+  struct timespec deadline;
+
+  pthread_mutex_lock(&reap_lock);
+  while (!reap_stop) {
+    if (reap_cnt < NFS_REAP_BATCH) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += NFS_REAP_INTERVAL_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&reap_cond, &reap_lock, &deadline);
+    }
+    reap_pending();
+  }
+  pthread_mutex_unlock(&reap_lock);
+  return NULL;
+}
+
+/**
+ * @brief 把 inode 放进回收队列，调用时持有 reap_lock
+ * 回收线程没有启动（例如直接调用 newfs_* 的程序）时立即回收
+ */
+static void reap_enqueue(struct newfs_inode *inode) {
+  inode->reap_next = reap_list;
+  reap_list = inode;
+  reap_cnt++;
+  if (!reaper_running) {
+    reap_pending();
+  } else if (reap_cnt >= NFS_REAP_BATCH) {
+    pthread_cond_signal(&reap_cond);
+  }
+}
+
+/**
+ * @brief 启动后台回收线程，挂载时调用
+ *
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_reaper_start(void) {
+  int ret;
+
+  pthread_mutex_lock(&reap_lock);
+  reap_stop = FALSE;
+  ret = pthread_create(&reaper, NULL, reaper_main, NULL);
+  if (ret != 0) {
+    pthread_mutex_unlock(&reap_lock);
+    return -ret;
+  }
+  reaper_running = TRUE;
+  pthread_mutex_unlock(&reap_lock);
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 停止回收线程，并回收队列中剩下的以及仍被打开着的孤儿 inode
+ * 卸载时在写回位图之前调用
+ */
+void newfs_reaper_stop(void) {
+  pthread_mutex_lock(&reap_lock);
+  if (reaper_running) {
+    reap_stop = TRUE;
+    pthread_cond_signal(&reap_cond);
+    pthread_mutex_unlock(&reap_lock);
+    pthread_join(reaper, NULL);
+    pthread_mutex_lock(&reap_lock);
+    reaper_running = FALSE;
+  }
+  while (orphan_list != NULL) {
+    struct newfs_inode *inode = orphan_list;
+    orphan_list = inode->reap_next;
+    reap_enqueue(inode);
+  }
+  reap_pending();
+  pthread_mutex_unlock(&reap_lock);
+}
+
+/**
+ * @brief 文件被打开，打开计数加一
+ */
+void newfs_inode_open(struct newfs_inode *inode) {
+  pthread_mutex_lock(&reap_lock);
+  inode->open_cnt++;
+  pthread_mutex_unlock(&reap_lock);
+}
+
+/**
+ * @brief 文件被关闭，已经 unlink 的孤儿在最后一次关闭时进入回收队列
+ */
+void newfs_inode_release(struct newfs_inode *inode) {
+  pthread_mutex_lock(&reap_lock);
+  if (--inode->open_cnt == 0 && inode->link == 0) {
+    struct newfs_inode **link = &orphan_list;
+    while (*link != inode) {
+      link = &(*link)->reap_next;
+    }
+    *link = inode->reap_next;
+    reap_enqueue(inode);
+  }
+  pthread_mutex_unlock(&reap_lock);
+}
+
+/**
+ * @brief inode 已从目录树上摘下，没有被打开时进入回收队列，否则成为孤儿
+ */
+void newfs_inode_unlink(struct newfs_inode *inode) {
+  pthread_mutex_lock(&reap_lock);
+  inode->link = 0;
+  inode->dentry = NULL;
+  if (inode->open_cnt == 0) {
+    reap_enqueue(inode);
+  } else {
+    inode->reap_next = orphan_list;
+    orphan_list = inode;
+  }
+  pthread_mutex_unlock(&reap_lock);
+}
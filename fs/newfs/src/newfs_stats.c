@@ -0,0 +1,297 @@
+#include "../include/newfs.h"
+#include "types.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+extern struct newfs_super super;
+
+/*
+ * 运行时统计和控制目录 /.newfs。
+ *
+ * 各处用 NFS_STAT_ADD / NFS_STAT_INC 原子地累加 nfs_stats 中的计数器，FUSE 回调的延迟
+ * 由 newfs_main.c 中的包装函数记录。需要彼此一致的几个计数器（一次回调的次数、耗时和
+ * 直方图，一次 lookup 的各项，一次分配的次数和扫描位数，dirty.*）放在 NFS_STAT_BEGIN /
+ * NFS_STAT_END 之间更新，写的一方只多两次原子加，不加锁。
+ *
+ * 打开 /.newfs/stats 时先确认 begin == end，逐个原子读出全部计数器后再确认 begin 没有
+ * 变化，否则重试，这样同一组里的计数器不会读到一半；重试 CTL_SNAP_TRIES 次仍被打断时
+ * 用最后一次读到的值，并输出 stats.consistent 0。单独更新的计数器之间（如 drv.* 与
+ * cache.*）仍可能相差正在进行中的那几次操作。快照格式化成文本保存在这次打开里，之后的
+ * read 都从快照中取，分几次读也不会前后不一致。
+ *
+ * 输出每行一项 "名字 值"。延迟直方图一行列出非空的桶 "上界:次数"，
+ * 上界单位为 us，桶 i 统计 [2^(i-1), 2^i) us，最后一个桶为 inf。
+ */
+struct newfs_stats nfs_stats;
+struct newfs_stats_seq nfs_stats_seq;
+
+static uint64_t stats_start_ns;               /* 挂载的时间 */
+
+static const char *op_names[NFS_OP_CNT] = NFS_OP_NAMES;
+
+#define CTL_SNAP_TRIES 64                     /* 读快照时被成组更新打断的最多重试次数 */
+
+_Static_assert(sizeof(struct newfs_stats) % sizeof(uint64_t) == 0,
+               "newfs_stats must only hold uint64_t counters");
+
+struct newfs_ctl_snap {
+  size_t len;
+  char   data[];
+};
+
+uint64_t newfs_stats_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 挂载时清零全部统计
+ */
+void newfs_stats_reset(void) {
+  memset(&nfs_stats, 0, sizeof(nfs_stats));
+  stats_start_ns = newfs_stats_now();
+}
+
+/**
+ * @brief 记录一次 FUSE 回调
+ *
+ * @param op NFS_OP_*
+ * @param t0 回调开始的时间，newfs_stats_now()
+ */
+void newfs_stats_op(int op, uint64_t t0) {
+  uint64_t ns = newfs_stats_now() - t0;
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+
+  while (us != 0 && bucket < NFS_HIST_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  NFS_STAT_BEGIN();
+  NFS_STAT_INC(op_cnt[op]);
+  NFS_STAT_ADD(op_ns[op], ns);
+  NFS_STAT_INC(op_hist[op][bucket]);
+  NFS_STAT_END();
+}
+
+/**
+ * @brief 记录一次 lookup
+ *
+ * @param depth 走过的路径分量数
+ * @param scanned 比较过的目录项数
+ * @param found 是否找到
+ */
+void newfs_stats_lookup(int depth, int scanned, boolean found) {
+  uint64_t max = __atomic_load_n(&nfs_stats.lookup_depth_max, __ATOMIC_RELAXED);
+
+  NFS_STAT_BEGIN();
+  NFS_STAT_INC(lookups);
+  NFS_STAT_ADD(lookup_depth, depth);
+  NFS_STAT_ADD(lookup_scanned, scanned);
+  if (found) {
+    NFS_STAT_INC(lookup_found);
+  }
+  while (max < (uint64_t)depth &&
+         !__atomic_compare_exchange_n(&nfs_stats.lookup_depth_max, &max, depth, TRUE,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  NFS_STAT_END();
+}
+
+/**
+ * @brief path 是否在控制目录下
+ *
+ * @return int NFS_CTL_*
+ */
+int newfs_ctl_path(const char *path) {
+  size_t len = strlen(NFS_CTL_DIR);
+
+  if (path == NULL || strncmp(path, NFS_CTL_DIR, len) != 0 ||
+      (path[len] != '\0' && path[len] != '/')) {
+    return NFS_CTL_NONE;
+  }
+  if (path[len] == '\0' || strcmp(path + len, "/") == 0) {
+    return NFS_CTL_ROOT;
+  }
+  return strcmp(path, NFS_CTL_STATS) == 0 ? NFS_CTL_STAT_FILE : NFS_CTL_NOENT;
+}
+
+/**
+ * @brief 控制目录和控制文件的属性，控制文件的大小报告为 0，以 direct_io 读出
+ */
+int newfs_ctl_getattr(int ctl, struct stat *st) {
+  if (ctl == NFS_CTL_NOENT) {
+    return -NFS_ERROR_NOTFOUND;
+  }
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = ctl == NFS_CTL_ROOT ? S_IFDIR | 0555 : S_IFREG | 0444;
+  st->st_nlink = ctl == NFS_CTL_ROOT ? 2 : 1;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_atime = time(NULL);
+  st->st_mtime = st->st_atime;
+  st->st_blksize = IO_SZ() * 2;
+  return NFS_ERROR_NONE;
+}
+
+static double hit_rate(uint64_t hit, uint64_t miss) {
+  return hit + miss == 0 ? 0.0 : 100.0 * hit / (hit + miss);
+}
+
+/**
+ * @brief 把读出的计数器格式化成文本
+ */
+static void ctl_render(FILE *fp, const struct newfs_stats *st, boolean consistent) {
+  int cached = 0, dirty = 0;
+
+  // 只看指针和标志是否非零，不需要一致的视图
+  for (int i = 0; i < super.inode_blks; i++) {
+    cached += __atomic_load_n(&super.inode_cache[i], __ATOMIC_RELAXED) != NULL;
+    dirty += __atomic_load_n(&super.inode_cache_dirty[i], __ATOMIC_RELAXED) != 0;
+  }
+
+  fprintf(fp, "uptime_ms %llu\n",
+          (unsigned long long)((newfs_stats_now() - stats_start_ns) / 1000000));
+  fprintf(fp, "stats.consistent %d\n", consistent ? 1 : 0);
+  fprintf(fp, "lookup.calls %llu\n", (unsigned long long)st->lookups);
+  fprintf(fp, "lookup.found %llu\n", (unsigned long long)st->lookup_found);
+  fprintf(fp, "lookup.depth_avg %.2f\n",
+          st->lookups == 0 ? 0.0 : (double)st->lookup_depth / st->lookups);
+  fprintf(fp, "lookup.depth_max %llu\n", (unsigned long long)st->lookup_depth_max);
+  fprintf(fp, "lookup.scanned_avg %.2f\n",
+          st->lookups == 0 ? 0.0 : (double)st->lookup_scanned / st->lookups);
+
+  fprintf(fp, "cache.inode.hit %llu\n", (unsigned long long)st->inode_mem_hit);
+  fprintf(fp, "cache.inode.miss %llu\n", (unsigned long long)st->inode_mem_miss);
+  fprintf(fp, "cache.inode.hit_pct %.1f\n", hit_rate(st->inode_mem_hit, st->inode_mem_miss));
+  fprintf(fp, "cache.inode_blk.hit %llu\n", (unsigned long long)st->inode_blk_hit);
+  fprintf(fp, "cache.inode_blk.miss %llu\n", (unsigned long long)st->inode_blk_miss);
+  fprintf(fp, "cache.inode_blk.hit_pct %.1f\n", hit_rate(st->inode_blk_hit, st->inode_blk_miss));
+  fprintf(fp, "cache.inode_blk.cached %d\n", cached);
+  fprintf(fp, "cache.inode_blk.total %d\n", super.inode_blks);
+  fprintf(fp, "cache.dentries.hit %llu\n", (unsigned long long)st->dentries_hit);
+  fprintf(fp, "cache.dentries.miss %llu\n", (unsigned long long)st->dentries_miss);
+  fprintf(fp, "cache.dentries.hit_pct %.1f\n", hit_rate(st->dentries_hit, st->dentries_miss));
+  fprintf(fp, "cache.data.hit %llu\n", (unsigned long long)st->data_hit);
+  fprintf(fp, "cache.data.miss %llu\n", (unsigned long long)st->data_miss);
+  fprintf(fp, "cache.data.zero_fill %llu\n", (unsigned long long)st->data_zero);
+  fprintf(fp, "cache.data.hit_pct %.1f\n",
+          hit_rate(st->data_hit + st->data_zero, st->data_miss));
+
+  fprintf(fp, "alloc.inode.calls %llu\n", (unsigned long long)st->alloc_inode);
+  fprintf(fp, "alloc.inode.scanned %llu\n", (unsigned long long)st->alloc_inode_scan);
+  fprintf(fp, "alloc.inode.failed %llu\n", (unsigned long long)st->alloc_inode_fail);
+  fprintf(fp, "alloc.data.calls %llu\n", (unsigned long long)st->alloc_data);
+  fprintf(fp, "alloc.data.scanned %llu\n", (unsigned long long)st->alloc_data_scan);
+  fprintf(fp, "alloc.data.failed %llu\n", (unsigned long long)st->alloc_data_fail);
+  fprintf(fp, "alloc.run.calls %llu\n", (unsigned long long)st->alloc_run);
+  fprintf(fp, "alloc.run.scanned %llu\n", (unsigned long long)st->alloc_run_scan);
+
+  fprintf(fp, "dirty.inodes %llu\n", (unsigned long long)st->dirty_inodes);
+  fprintf(fp, "dirty.data_blks %llu\n", (unsigned long long)st->dirty_blks);
+  fprintf(fp, "dirty.inode_blks %d\n", dirty);
+
+  fprintf(fp, "writeback.data_bytes %llu\n", (unsigned long long)st->wb_data_bytes);
+  fprintf(fp, "writeback.dentry_bytes %llu\n", (unsigned long long)st->wb_dentry_bytes);
+  fprintf(fp, "writeback.inode_bytes %llu\n", (unsigned long long)st->wb_inode_bytes);
+  fprintf(fp, "driver.read_bytes %llu\n", (unsigned long long)st->drv_read_bytes);
+  fprintf(fp, "driver.write_bytes %llu\n", (unsigned long long)st->drv_write_bytes);
+  fprintf(fp, "driver.rmw %llu\n", (unsigned long long)st->drv_rmw);
+  fprintf(fp, "driver.discard_bytes %llu\n", (unsigned long long)st->drv_discard_bytes);
+
+  for (int op = 0; op < NFS_OP_CNT; op++) {
+    if (st->op_cnt[op] == 0) {
+      continue;
+    }
+    fprintf(fp, "op.%s.calls %llu\n", op_names[op], (unsigned long long)st->op_cnt[op]);
+    fprintf(fp, "op.%s.avg_us %.3f\n", op_names[op], st->op_ns[op] / 1e3 / st->op_cnt[op]);
+    fprintf(fp, "op.%s.hist_us", op_names[op]);
+    for (int b = 0; b < NFS_HIST_BUCKETS; b++) {
+      if (st->op_hist[op][b] == 0) {
+        continue;
+      }
+      if (b == NFS_HIST_BUCKETS - 1) {
+        fprintf(fp, " inf:%llu", (unsigned long long)st->op_hist[op][b]);
+      } else {
+        fprintf(fp, " %llu:%llu", 1ull << b, (unsigned long long)st->op_hist[op][b]);
+      }
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+/**
+ * @brief 打开 /.newfs/stats：读出全部计数器并生成这次打开的快照
+ *
+ * @param fi 文件信息，fh 保存快照
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ctl_open(struct fuse_file_info *fi) {
+  struct newfs_stats st;
+  const uint64_t *src = (const uint64_t *)&nfs_stats;
+  uint64_t *dst = (uint64_t *)&st;
+  struct newfs_ctl_snap *snap;
+  char *text = NULL;
+  size_t len = 0;
+  boolean consistent = FALSE;
+  uint64_t begin, end;
+  FILE *fp;
+
+  for (int try = 0; try < CTL_SNAP_TRIES && !consistent; try++) {
+    end = __atomic_load_n(&nfs_stats_seq.end, __ATOMIC_ACQUIRE);
+    begin = __atomic_load_n(&nfs_stats_seq.begin, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < sizeof(st) / sizeof(uint64_t); i++) {
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // 读之前没有进行中的成组更新，读的过程中也没有新开始的
+    consistent = begin == end &&
+                 __atomic_load_n(&nfs_stats_seq.begin, __ATOMIC_RELAXED) == begin;
+  }
+  fp = open_memstream(&text, &len);
+  if (fp == NULL) {
+    return -errno;
+  }
+  ctl_render(fp, &st, consistent);
+  fclose(fp);
+
+  snap = (struct newfs_ctl_snap *)malloc(sizeof(struct newfs_ctl_snap) + len);
+  if (snap == NULL) {
+    free(text);
+    return -ENOMEM;
+  }
+  snap->len = len;
+  memcpy(snap->data, text, len);
+  free(text);
+  fi->fh = (uintptr_t)snap | NFS_FH_CTL;
+  fi->direct_io = 1;                      // 大小报告为 0，不经过页缓存才能读到内容
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 从打开时的快照中读
+ *
+ * @return int 读出的字节数
+ */
+int newfs_ctl_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+  struct newfs_ctl_snap *snap = (struct newfs_ctl_snap *)(uintptr_t)(fi->fh & ~(uint64_t)NFS_FH_CTL);
+
+  if (offset >= (off_t)snap->len) {
+    return 0;
+  }
+  if (offset + size > snap->len) {
+    size = snap->len - offset;
+  }
+  memcpy(buf, snap->data + offset, size);
+  return size;
+}
+
+void newfs_ctl_release(struct fuse_file_info *fi) {
+  free((void *)(uintptr_t)(fi->fh & ~(uint64_t)NFS_FH_CTL));
+  fi->fh = 0;
+}
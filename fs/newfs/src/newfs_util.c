@@ -21,62 +21,96 @@ extern struct custom_options sfs_options;
 int sync_inode(struct newfs_inode *inode) {
   struct newfs_inode_d inode_d;
   struct newfs_dentry *dentry_cursor;
-  struct newfs_dentry_d dentry_d;
+  uint8_t *slot;
   int ino = inode->ino;
+  // 延迟分配的块先定下磁盘块号，inode 里记录的才是最终的块号
+  if (inode->file_type == NFS_REG_FILE && allocate_delayed(inode) != NFS_ERROR_NONE) {
+    return -NFS_ERROR_NOSPACE;
+  }
+  memset(&inode_d, 0, sizeof(struct newfs_inode_d));
   inode_d.ino = ino;
   inode_d.size = inode->file_size;
   // memcpy() 用于软链接的复制
-  inode_d.file_type = inode->dentry->file_type;
+  inode_d.file_type = inode->file_type;
   inode_d.dir_dentry_cnt = inode->dir_dentry_cnt;
   for(int j = 0; j < DATA_PER_FILE; j++){
     inode_d.data_block_no[j] = inode->data_block_no[j];
   }
-  int offset;
-  // inode
-  NFS_DBG("\n newfs_driver_write in sync: ino:%d, offset:%d \n", ino,
-          INO_OFS(ino));
-  if (newfs_driver_write(INO_OFS(ino), (uint8_t *)&inode_d,
-                         sizeof(struct newfs_inode_d)) != 0) {
-    NFS_DBG("[%s] io error\n", __func__);
-    return -NFS_ERROR_IO;
-  }
-  // inode 下方的 data
-  if (inode->dentry->file_type == NFS_DIR) { // 目录,将子目录的inode写回,dentry也要写回
-    dentry_cursor = inode->dentries;
-    offset = DENTRY_OFS(inode->data_block_no[0]); // todo ： dentry 所在的地方应该是data block 区域
-    // ! 好像没关系，因为dentry_cursor会是null。
-    while (dentry_cursor != NULL) {
-      memcpy(dentry_d.name, dentry_cursor->name, 128);
-      dentry_d.file_type = dentry_cursor->file_type;
-      dentry_d.ino = dentry_cursor->ino;
-      NFS_DBG("[%s] sync dentry: %s offset : %d\n", __func__, dentry_d.name,offset);
-      if (newfs_driver_write(offset, (uint8_t *)&dentry_d,
-                             sizeof(struct newfs_dentry_d)) != 0) {
-        NFS_DBG("[%s] io error\n", __func__); // 写回 dentry
-        return -NFS_ERROR_IO;
-      }
-      if (dentry_cursor->inode != NULL) {
-        sync_inode(dentry_cursor->inode);// 写回 inode
-      }
-      dentry_cursor = dentry_cursor->brother;
-      offset += sizeof(struct newfs_dentry_d);
-    }
-  } else if (inode->dentry->file_type == NFS_REG_FILE) { /* 如果当前inode是文件，那么数据是文件内容，直接写即可
-                                                          */
+  int offset, tag, ret;
+  // 文件先写回数据块，写回之后这些块不再是未写入状态，再把 inode 写回
+  if (inode->file_type == NFS_REG_FILE) {
     for (int i = 0; i < DATA_PER_FILE; i++) {
       int data_no = inode->data_block_no[i];
-      if (data_no > -1) {
+      if (data_no > -1 && inode->data[i] != NULL && BLK_DIRTY(inode, i)) { // 只写回改过的块
         NFS_DBG("\n[%s] newfs_driver_write in sync in file: ino:%d, offset:%d \n",
                 __func__,ino, DATA_OFS(data_no));
-        if (newfs_driver_write(DATA_OFS(data_no),
-                               inode->data[i],
-                               inode->file_size) != 0) { // ? filesize 是多大？
+        tag = newfs_trace_tag(NFS_TRACE_SYNC_DATA);
+        ret = newfs_driver_write(DATA_OFS(data_no), inode->data[i], LOGIC_SZ());
+        newfs_trace_tag(tag);
+        if (ret != 0) {
           NFS_DBG("[%s] io error\n", __func__);
           return -NFS_ERROR_IO;
         }
+        NFS_STAT_ADD(wb_data_bytes, LOGIC_SZ());
+        CLR_BLK_DIRTY(inode, i);
+        CLR_BLK_UNWRITTEN(inode, i);
       }
     }
   }
+  inode_d.unwritten_blks = inode->unwritten_blks;
+  inode_d.flags = inode->flags;
+  // inode 和内联数据一起写进 inode 表的块缓存，由 newfs_flush_inodes 整块写回
+  slot = newfs_inode_slot(ino);
+  if (slot == NULL) {
+    return -NFS_ERROR_IO;
+  }
+  memset(slot, 0, super.sz_inode);
+  memcpy(slot, &inode_d, sizeof(struct newfs_inode_d));
+  if (IS_INLINE(inode)) {
+    memcpy(slot + NFS_INLINE_DATA_OFS, inode->data[0], inode->file_size);
+    CLR_BLK_DIRTY(inode, 0);
+  }
+  super.inode_cache_dirty[INO_BLK(ino)] = TRUE;
+  NFS_DBG("\n sync inode: ino:%d, offset:%d \n", ino, INO_OFS(ino));
+  // inode 下方的 data
+  if (inode->file_type == NFS_DIR) { // 目录,将子目录的inode写回,dentry也要写回
+    if (!inode->dentries_loaded) {   // 目录项从未读入内存，磁盘上的内容就是最新的
+      return NFS_ERROR_NONE;
+    }
+    // 每个数据块攒满 DENTRY_PER_BLK() 个 dentry 后整块写回
+    uint8_t *blk = (uint8_t *)malloc(LOGIC_SZ());
+    struct newfs_dentry_d *dentry_ds = (struct newfs_dentry_d *)blk;
+    dentry_cursor = inode->dentries;
+    for (int j = 0; j < DATA_PER_FILE && dentry_cursor != NULL; j++) {
+      if (inode->data_block_no[j] == -1) {
+        NFS_DBG("[%s] dentry block %d not allocated\n", __func__, j);
+        free(blk);
+        return -NFS_ERROR_NOSPACE;
+      }
+      memset(blk, 0, LOGIC_SZ());
+      for (int i = 0; i < DENTRY_PER_BLK() && dentry_cursor != NULL; i++) {
+        memcpy(dentry_ds[i].name, NFS_DNAME(dentry_cursor), dentry_cursor->name_len);
+        dentry_ds[i].file_type = dentry_cursor->file_type;
+        dentry_ds[i].ino = dentry_cursor->ino;
+        if (dentry_cursor->inode != NULL) {
+          sync_inode(dentry_cursor->inode);// 写回 inode
+        }
+        dentry_cursor = dentry_cursor->brother;
+      }
+      offset = DENTRY_OFS(inode->data_block_no[j]);
+      NFS_DBG("[%s] sync dentry block %d offset : %d\n", __func__, j, offset);
+      tag = newfs_trace_tag(NFS_TRACE_SYNC_DENTRY);
+      ret = newfs_driver_write(offset, blk, LOGIC_SZ());
+      newfs_trace_tag(tag);
+      if (ret != 0) {
+        NFS_DBG("[%s] io error\n", __func__); // 写回 dentry
+        free(blk);
+        return -NFS_ERROR_IO;
+      }
+      NFS_STAT_ADD(wb_dentry_bytes, LOGIC_SZ());
+    }
+    free(blk);
+  }
   return NFS_ERROR_NONE;
 }
 
@@ -88,7 +122,7 @@ void dump_map() {
       super.map_inode_offset, super.inode_offset);
   int cnt = 0;
 
-  for (byte_cursor = 0; byte_cursor < super.sz_io * 2; byte_cursor += 4) {
+  for (byte_cursor = 0; byte_cursor < BLKS_SZ(super.map_inode_blks); byte_cursor += 4) {
     // if(byte_cursor == ROUND_UP(super.data_offset, 1024)){
     //   printf("\n\n data now \n \n ");
     // }
@@ -147,8 +181,18 @@ int newfs_driver_read(int offset, uint8_t *out_content, int size) {
   int offset_aligned = ROUND_DOWN(offset, IO_SZ()); // io
   int bias = offset - offset_aligned;
   int size_aligned = ROUND_UP((size + bias), IO_SZ());
-  uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-  uint8_t *cur = temp_content;
+  uint8_t *temp_content;
+  uint8_t *cur;
+  NFS_STAT_ADD(drv_read_bytes, size_aligned);
+  if (bias == 0 && size_aligned == size) { // 已对齐，直接读到调用者的缓冲区，省去一次拷贝
+    ddriver_seek(super.driver_fd, offset, SEEK_SET);
+    for (cur = out_content; size != 0; cur += IO_SZ(), size -= IO_SZ()) {
+      ddriver_read(super.driver_fd, (char *)cur, IO_SZ());
+    }
+    return 0;
+  }
+  temp_content = (uint8_t *)malloc(size_aligned);
+  cur = temp_content;
   if (!temp_content) {
     free(temp_content);
     return -1; // 文件指针设置失败
@@ -176,8 +220,21 @@ int newfs_driver_write(int offset, uint8_t *in_content, int size) {
   int offset_aligned = ROUND_DOWN(offset, IO_SZ());
   int bias = offset - offset_aligned;
   int size_aligned = ROUND_UP((size + bias), IO_SZ());
-  uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-  uint8_t *cur = temp_content;
+  uint8_t *temp_content;
+  uint8_t *cur;
+  int tag;
+  NFS_STAT_ADD(drv_write_bytes, size_aligned);
+  if (bias == 0 && size_aligned == size) { // 整块覆盖，不需要先读出再改写
+    ddriver_seek(super.driver_fd, offset, SEEK_SET);
+    for (cur = in_content; size != 0; cur += IO_SZ(), size -= IO_SZ()) {
+      ddriver_write(super.driver_fd, (char *)cur, IO_SZ());
+    }
+    return 0;
+  }
+  temp_content = (uint8_t *)malloc(size_aligned);
+  cur = temp_content;
+  NFS_STAT_INC(drv_rmw);
+  tag = newfs_trace_tag(super.trace_tag | NFS_TRACE_RMW);
   newfs_driver_read(
       offset_aligned, temp_content,
       size_aligned); // ddriver_read
@@ -195,9 +252,44 @@ int newfs_driver_write(int offset, uint8_t *in_content, int size) {
   }
   // NFS_DBG("-- driver write: write to offset_aligned: %d, \ncontent: %s, bias:
   // %d \n",offset_aligned,in_content,bias);
+  newfs_trace_tag(tag);
   free(temp_content);
   return 0;
 }
+/**
+ * @brief 让驱动丢弃 [offset, offset + size)，之后读出来是 0，不移动磁头
+ * 驱动不支持时关掉 --discard，以后不再尝试
+ *
+ * @param offset 按 IO 大小对齐
+ * @param size 按 IO 大小对齐
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_driver_discard(int offset, int size) {
+  struct ddriver_discard discard = { offset, size };
+
+  if (!super.is_discard) {
+    return -NFS_ERROR_UNSUPPORTED;
+  }
+  if (ddriver_ioctl(super.driver_fd, IOC_REQ_DEVICE_DISCARD, &discard) != 0) {
+    printf("driver doesn't support discard, continue without --discard\n");
+    super.is_discard = FALSE;
+    return -NFS_ERROR_UNSUPPORTED;
+  }
+  NFS_STAT_ADD(drv_discard_bytes, size);
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief --zero-copy 时 FUSE 绕过驱动直接读写了镜像中的 [offset, offset + size)，
+ * 让驱动按一次读写请求计入它的统计、跟踪和延迟模型
+ *
+ * @param op DDRIVER_TRACE_READ 或 DDRIVER_TRACE_WRITE
+ */
+void newfs_driver_direct(int op, off_t offset, size_t size) {
+  struct ddriver_direct direct = { offset, size, op };
+
+  ddriver_ioctl(super.driver_fd, IOC_REQ_DEVICE_DIRECT, &direct);
+}
 
 int calc_lvl(const char *path) {
   // char* path_cpy = (char *)malloc(strlen(path));
@@ -236,9 +328,13 @@ struct newfs_dentry *lookup(const char *path, boolean *is_find,
   int lvl = 0;
   boolean is_hit;
   char *fname = NULL;
-  char *path_cpy = (char *)malloc(sizeof(path));
+  char *save_ptr = NULL;
+  char *path_cpy = strdup(path);
+  int fname_len;
+  uint32_t fname_hash;
+  int scanned = 0;
+  *is_find = FALSE;
   *is_root = FALSE;
-  strcpy(path_cpy, path);
   // debug
   if (total_lvl == 0) {
     *is_find = TRUE;
@@ -246,58 +342,64 @@ struct newfs_dentry *lookup(const char *path, boolean *is_find,
     dentry_ret = super.root_dentry;
   }
 
-  fname = strtok(path_cpy, "/");
+  fname = strtok_r(path_cpy, "/", &save_ptr);
 
   while (fname) {
     lvl++;
+    if (dentry_cursor->inode == NULL) {
+      NFS_STAT_INC(inode_mem_miss);
+      dentry_cursor->inode = read_inode(dentry_cursor, dentry_cursor->ino);
+    }
+    else {
+      NFS_STAT_INC(inode_mem_hit);
+    }
     inode = dentry_cursor->inode;
 
-    if (inode->dentry->file_type == NFS_REG_FILE && lvl < total_lvl) {
+    if (inode->file_type == NFS_REG_FILE && lvl < total_lvl) {
       NFS_DBG("\n[%s] not a dir\n", __func__);
       dentry_ret = inode->dentry;
       break;
     }
-    if (inode->dentry->file_type == NFS_DIR) {
-      NFS_DBG("\n[%s] %s is a dir\n", __func__, inode->dentry->name);
-
+    if (inode->file_type == NFS_DIR) {
       dentry_ret = inode->dentry;
-      NFS_DBG("\n[%s] dentry_ret %s \n", __func__, dentry_ret->name);
 
+      if (newfs_load_dentries(inode) != NFS_ERROR_NONE) {
+        *is_find = FALSE;
+        break;
+      }
+      fname_len = strlen(fname);
+      fname_hash = newfs_name_hash(fname, fname_len);
       dentry_cursor = inode->dentries; // 所有目录项
       is_hit = FALSE;
 
       while (dentry_cursor) {
-
-        NFS_DBG("\n[%s] -- dentry_cursor : %s, fname:%s\n", __func__,dentry_cursor->name, fname);
-
-        if (memcmp(dentry_cursor->name, fname, strlen(fname)) == 0) {
-
+        scanned++;
+        if (newfs_dentry_match(dentry_cursor, fname, fname_len, fname_hash)) {
           is_hit = TRUE;
           break;
         }
         dentry_cursor = dentry_cursor->brother;
-        NFS_DBG("\n[%s] -- changed to brother %s", __func__,dentry_cursor->name);
       }
       if (!is_hit) {
         *is_find = FALSE;
         NFS_DBG("[%s] not found %s\n", __func__, fname);
         dentry_ret = inode->dentry;
-       NFS_DBG("\n[%s] dentry_ret %s \n", __func__, dentry_ret->name);
         break;
       }
       if (is_hit && lvl == total_lvl) {
-        NFS_DBG("\n!![%s] found %s\n", __func__, fname);
-
         *is_find = TRUE;
         dentry_ret = dentry_cursor;
-        NFS_DBG("\n[%s] dentry_ret %s \n", __func__, dentry_ret->name);
         break;
       }
     }
-    fname = strtok(NULL, "/");
+    fname = strtok_r(NULL, "/", &save_ptr);
   }
+  free(path_cpy);
+  newfs_stats_lookup(lvl, scanned, *is_find);
   if (dentry_ret->inode == NULL) {
-    NFS_DBG("\n[%s] dentry_ret:%s->inode == NULL, reading inode by inos \n", __func__);
+    NFS_STAT_INC(inode_mem_miss);
+    NFS_DBG("\n[%s] dentry_ret:%s->inode == NULL, reading inode by inos \n", __func__,
+            NFS_DNAME(dentry_ret));
     dentry_ret->inode = read_inode(dentry_ret, dentry_ret->ino);
   }
   return dentry_ret;
@@ -311,21 +413,20 @@ struct newfs_dentry *lookup(const char *path, boolean *is_find,
  * @return struct sfs_inode*
  */
 struct newfs_inode * read_inode(struct newfs_dentry *dentry, int ino) {
-  struct newfs_inode *inode =
-      (struct newfs_inode *)malloc(sizeof(struct newfs_inode));
+  struct newfs_inode *inode;
   struct newfs_inode_d inode_d;
-  struct newfs_dentry *sub_dentry;
-  struct newfs_dentry_d dentry_d;
-  int dir_cnt = 0, i;
-  /* 从磁盘读索引结点 */
+  uint8_t *slot;
+  /* 从 inode 表的块缓存中取索引结点，同一块中的其他 inode 之后不用再读盘 */
 
   NFS_DBG("[%s] reading ino : %d, offset: %d \n", __func__, ino, INO_OFS(ino));
 
-  if (newfs_driver_read(INO_OFS(ino), (uint8_t *)&inode_d,
-                        sizeof(struct newfs_inode_d)) != 0) {
+  slot = newfs_inode_slot(ino);
+  if (slot == NULL) {
     NFS_DBG("[%s] io error\n", __func__);
     return NULL;
   }
+  inode = new_inode();
+  memcpy(&inode_d, slot, sizeof(struct newfs_inode_d));
 
   NFS_DBG("[%s] just read inode_d ino : %d from offset: %d\n", __func__, ino, INO_OFS(ino));
   // 此时 inode_d 已经在内存里了，包括 data_block_no[6]
@@ -335,7 +436,8 @@ struct newfs_inode * read_inode(struct newfs_dentry *dentry, int ino) {
   inode->file_type = inode_d.file_type;// todo 
   // memcpy(inode->target_path, inode_d.target_path, SFS_MAX_FILE_NAME);
   inode->dentry = dentry;
-  NFS_DBG("[%s] just set inode's dentry : %s\n", __func__, dentry->name);
+  inode->link = 1;
+  NFS_DBG("[%s] just set inode's dentry : %s\n", __func__, NFS_DNAME(dentry));
   inode->dentries = NULL;
   // inode->file_type = inode_d.file_type;
   NFS_DBG("[%s] just set inode's filetype : %c\n", __func__, inode->file_type);
@@ -343,54 +445,161 @@ struct newfs_inode * read_inode(struct newfs_dentry *dentry, int ino) {
   for (int i = 0; i < DATA_PER_FILE; i++) {
     inode->data_block_no[i] = inode_d.data_block_no[i];
   }
+  inode->unwritten_blks = inode_d.unwritten_blks;
+  inode->flags = inode_d.flags;
   /* 内存中的inode的数据或子目录项部分也需要读出 */
-  if (inode->dentry->file_type ==NFS_DIR) { // inode 指向一个包含了若干dentry的数据块
-    NFS_DBG("\n---read_inode: reading DIR\n");
-    dir_cnt = inode_d.dir_dentry_cnt;
-    int k = 0;
-    for (int j = 0; j < DATA_PER_FILE; j++) { // 读每一个数据块
-      if (inode->data_block_no[j] == -1) {
-        break;
-      }
-      //
-      if (k == dir_cnt) {
-        break;
-      }
-      //
-      for (i = 0; i < 128;i++) { // todo 
-      if(k >= dir_cnt){
-        break;
-      }
-        NFS_DBG("\n--- dir: i : %d\n", i);
-        if (newfs_driver_read(DATA_OFS(inode->data_block_no[j]) +
-                                  i * sizeof(struct newfs_dentry_d),
-                              (uint8_t *)&dentry_d,
-                              sizeof(struct newfs_dentry_d)) != 0) {
-          return NULL;
-        }
-        sub_dentry = new_dentry(dentry_d.name, dentry_d.file_type);
-        sub_dentry->parent = inode->dentry;
-        sub_dentry->ino = dentry_d.ino;
-        allocate_dentry(inode, sub_dentry);
-        k++;
-      }
-    }
-  } else if (inode->dentry->file_type == NFS_REG_FILE) {
-    NFS_DBG("\n---read_inode: reading FILE\n");
+  if (inode->file_type ==NFS_DIR) { // 目录项推迟到第一次访问时由 newfs_load_dentries 读入
+    inode->dir_dentry_cnt = inode_d.dir_dentry_cnt;
+    inode->dentries_loaded = FALSE;
+  } else if (inode->file_type == NFS_REG_FILE) { // 文件数据块在读写时由 newfs_load_data 按需读入
     for (int i = 0; i < DATA_PER_FILE; i++) {
-      if (inode->data_block_no[i] > -1) {
-        inode->data[i] = (uint8_t *)malloc(LOGIC_SZ());
-        if (newfs_driver_read(super.data_offset +
-                                  inode->data_block_no[i] * LOGIC_SZ(),
-                              inode->data[i], LOGIC_SZ()) != NFS_ERROR_NONE) {
-          NFS_DBG("[%s] io error\n", __func__);
-        }
-      }
+      inode->data[i] = NULL;
+    }
+    if (IS_INLINE(inode)) {                        // 内联数据已经随 inode 一起读出
+      inode->data[0] = (uint8_t *)calloc(1, LOGIC_SZ());
+      memcpy(inode->data[0], slot + NFS_INLINE_DATA_OFS, inode->file_size);
     }
   }
   return inode;
 }
 
+/**
+ * @brief 根据写入后的文件末尾 end 决定文件内容是否内联在 inode 槽中
+ * 空文件第一次写入且 end 不超过 NFS_INLINE_DATA_SZ() 时转为内联；
+ * 内联文件的 end 超出时把内容搬到第 0 个数据块，之后按普通文件处理
+ *
+ * @param inode 文件 inode
+ * @param end 本次操作之后文件内容的末尾
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_inline_fit(struct newfs_inode *inode, off_t end) {
+  if (IS_INLINE(inode)) {
+    if (end <= NFS_INLINE_DATA_SZ()) {
+      return NFS_ERROR_NONE;
+    }
+    if (reserve_data(inode, 0) < 0) {    // data[0] 已有内容，直接成为第 0 块的缓存
+      return -NFS_ERROR_NOSPACE;
+    }
+    inode->flags &= ~NFS_INODE_INLINE;
+    return NFS_ERROR_NONE;
+  }
+  if (inode->file_size != 0 || end > NFS_INLINE_DATA_SZ()) {
+    return NFS_ERROR_NONE;
+  }
+  for (int i = 0; i < DATA_PER_FILE; i++) {
+    if (!BLK_IS_HOLE(inode, i)) {        // 预分配过块的文件不内联
+      return NFS_ERROR_NONE;
+    }
+  }
+  inode->data[0] = (uint8_t *)calloc(1, LOGIC_SZ());
+  inode->flags |= NFS_INODE_INLINE;
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 取得文件第 blk_idx 个数据块的缓存，未缓存时整块直接读入缓存
+ * 预分配未写入的块不读盘，缓存清零
+ *
+ * @param inode 文件 inode
+ * @param blk_idx 文件内的块号
+ * @return uint8_t* 缓存的块，该块未分配或读失败时返回 NULL
+ */
+uint8_t *newfs_load_data(struct newfs_inode *inode, int blk_idx) {
+  int tag, ret;
+
+  if (inode->data[blk_idx] != NULL) {
+    NFS_STAT_INC(data_hit);
+    return inode->data[blk_idx];
+  }
+  if (inode->data_block_no[blk_idx] == -1) {
+    return NULL;
+  }
+  if (BLK_UNWRITTEN(inode, blk_idx)) {
+    NFS_STAT_INC(data_zero);
+    inode->data[blk_idx] = (uint8_t *)calloc(1, LOGIC_SZ());
+    return inode->data[blk_idx];
+  }
+  NFS_STAT_INC(data_miss);
+  inode->data[blk_idx] = (uint8_t *)malloc(LOGIC_SZ());
+  tag = newfs_trace_tag(NFS_TRACE_LOAD_DATA);
+  ret = newfs_driver_read(DATA_OFS(inode->data_block_no[blk_idx]), inode->data[blk_idx],
+                          LOGIC_SZ());
+  newfs_trace_tag(tag);
+  if (ret != NFS_ERROR_NONE) {
+    NFS_DBG("[%s] io error\n", __func__);
+    free(inode->data[blk_idx]);
+    inode->data[blk_idx] = NULL;
+  }
+  return inode->data[blk_idx];
+}
+
+/**
+ * @brief 取得要写入的第 blk_idx 个数据块的缓存并标记为脏
+ * 整块覆盖时不读旧内容，只分配缓存
+ *
+ * @param inode 文件 inode，blk_idx 块必须已经分配
+ * @param blk_idx 文件内的块号
+ * @param is_full 本次写入是否覆盖整个块
+ * @return uint8_t* 缓存的块，读失败时返回 NULL
+ */
+uint8_t *newfs_prepare_write(struct newfs_inode *inode, int blk_idx, boolean is_full) {
+  if (inode->data[blk_idx] == NULL && is_full) {
+    inode->data[blk_idx] = (uint8_t *)malloc(LOGIC_SZ());
+  }
+  if (newfs_load_data(inode, blk_idx) == NULL) {
+    return NULL;
+  }
+  SET_BLK_DIRTY(inode, blk_idx);
+  return inode->data[blk_idx];
+}
+
+/**
+ * @brief 读入目录的全部目录项，每个目录数据块只读一次并原地解析
+ *
+ * @param inode 目录 inode
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_load_dentries(struct newfs_inode *inode) {
+  struct newfs_dentry_d *dentry_ds;
+  struct newfs_dentry *sub_dentry;
+  struct newfs_dentry *tail = NULL;
+  uint8_t *blk;
+  int k = 0, tag, ret;
+
+  if (inode->dentries_loaded) {
+    NFS_STAT_INC(dentries_hit);
+    return NFS_ERROR_NONE;
+  }
+  NFS_STAT_INC(dentries_miss);
+  blk = (uint8_t *)malloc(LOGIC_SZ());
+  dentry_ds = (struct newfs_dentry_d *)blk;
+  for (int j = 0; j < DATA_PER_FILE && k < inode->dir_dentry_cnt; j++) {
+    if (inode->data_block_no[j] == -1) {
+      break;
+    }
+    tag = newfs_trace_tag(NFS_TRACE_LOAD_DENTRY);
+    ret = newfs_driver_read(DENTRY_OFS(inode->data_block_no[j]), blk, LOGIC_SZ());
+    newfs_trace_tag(tag);
+    if (ret != 0) {
+      NFS_DBG("[%s] io error\n", __func__);
+      free(blk);
+      return -NFS_ERROR_IO;
+    }
+    for (int i = 0; i < DENTRY_PER_BLK() && k < inode->dir_dentry_cnt; i++, k++) {
+      sub_dentry = new_dentry(dentry_ds[i].name, dentry_ds[i].file_type);
+      sub_dentry->parent = inode->dentry;
+      sub_dentry->ino = dentry_ds[i].ino;
+      // 按磁盘上的顺序挂到链表尾部
+      newfs_dentry_link(tail == NULL ? &inode->dentries : &tail->brother, sub_dentry);
+      tail = sub_dentry;
+    }
+  }
+  free(blk);
+  inode->dir_dentry_cnt = k;
+  inode->dentries_loaded = TRUE;
+  return NFS_ERROR_NONE;
+}
+
 /**
  * @brief
  *
@@ -399,8 +608,12 @@ struct newfs_inode * read_inode(struct newfs_dentry *dentry, int ino) {
  * @return struct sfs_dentry*
  */
 struct newfs_dentry *get_dentry(struct newfs_inode *inode, int dir) {
-  struct newfs_dentry *dentry_cursor = inode->dentries;
+  struct newfs_dentry *dentry_cursor;
   int cnt = 0;
+  if (newfs_load_dentries(inode) != NFS_ERROR_NONE) {
+    return NULL;
+  }
+  dentry_cursor = inode->dentries;
   while (dentry_cursor) {
     if (dir == cnt) {
       return dentry_cursor;
@@ -409,4 +622,131 @@ struct newfs_dentry *get_dentry(struct newfs_inode *inode, int dir) {
     dentry_cursor = dentry_cursor->brother;
   }
   return NULL;
-}
\ No newline at end of file
+}
+/**
+ * @brief 将dentry从目录inode的dentries中取出，通过 pprev 直接摘下，不遍历链表
+ * 目录数据块按顺序重新打包写回，空出来的块留给之后的目录项
+ *
+ * @param inode 一个目录的索引结点
+ * @param dentry 该目录下的一个目录项
+ * @return int 取出后的目录项数量，dentry 不在任何目录中时返回 -NFS_ERROR_NOTFOUND
+ */
+int newfs_drop_dentry(struct newfs_inode *inode, struct newfs_dentry *dentry) {
+  if (dentry->pprev == NULL) {
+    return -NFS_ERROR_NOTFOUND;
+  }
+  newfs_dentry_unlink(dentry);
+  inode->dir_dentry_cnt--;
+  return inode->dir_dentry_cnt;
+}
+
+/**
+ * @brief 取得 ino 在 inode 表块缓存中的位置，所在的块未缓存时整块读入
+ *
+ * @param ino inode 号
+ * @return uint8_t* 该 inode 槽的起始地址，读失败时返回 NULL
+ */
+uint8_t *newfs_inode_slot(int ino) {
+  int blk = INO_BLK(ino), tag, ret;
+
+  if (super.inode_cache[blk] == NULL) {
+    uint8_t *buf = (uint8_t *)malloc(LOGIC_SZ());
+    NFS_STAT_INC(inode_blk_miss);
+    tag = newfs_trace_tag(NFS_TRACE_INODE_READ);
+    ret = newfs_driver_read(super.inode_offset + blk * LOGIC_SZ(), buf, LOGIC_SZ());
+    newfs_trace_tag(tag);
+    if (ret != 0) {
+      NFS_DBG("[%s] io error\n", __func__);
+      free(buf);
+      return NULL;
+    }
+    super.inode_cache[blk] = buf;
+  }
+  else {
+    NFS_STAT_INC(inode_blk_hit);
+  }
+  return super.inode_cache[blk] + INO_BLK_OFS(ino);
+}
+
+/**
+ * @brief 把 inode 表块缓存中改过的块写回磁盘
+ *
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_flush_inodes(void) {
+  int tag = newfs_trace_tag(NFS_TRACE_INODE_FLUSH);
+
+  for (int i = 0; i < super.inode_blks; i++) {
+    if (!super.inode_cache_dirty[i]) {
+      continue;
+    }
+    if (newfs_driver_write(super.inode_offset + i * LOGIC_SZ(), super.inode_cache[i],
+                           LOGIC_SZ()) != 0) {
+      NFS_DBG("[%s] io error\n", __func__);
+      newfs_trace_tag(tag);
+      return -NFS_ERROR_IO;
+    }
+    NFS_STAT_ADD(wb_inode_bytes, LOGIC_SZ());
+    super.inode_cache_dirty[i] = FALSE;
+  }
+  newfs_trace_tag(tag);
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 设置之后驱动请求的跟踪标记，没有开启跟踪时什么也不做
+ *
+ * @param tag NFS_TRACE_*，可以带 NFS_TRACE_RMW
+ * @return int 原来的标记，用完后再设置回去
+ */
+int newfs_trace_tag(int tag) {
+  int old = super.trace_tag;
+
+  if (super.is_tracing && tag != old) {
+    ddriver_ioctl(super.driver_fd, IOC_REQ_TRACE_TAG, &tag);
+    super.trace_tag = tag;
+  }
+  return old;
+}
+
+/**
+ * @brief 取出驱动记录的请求，写到 path：newfs_trace_hdr 之后是按时间先后的记录
+ *
+ * @param path 跟踪文件
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_trace_save(const char *path) {
+  struct ddriver_trace_dump dump;
+  struct newfs_trace_hdr hdr;
+  FILE *fp;
+  int ret = NFS_ERROR_NONE;
+
+  dump.max = DDRIVER_TRACE_DEF_RECS;
+  dump.recs = (struct ddriver_trace_rec *)malloc(sizeof(struct ddriver_trace_rec) * dump.max);
+  if (ddriver_ioctl(super.driver_fd, IOC_REQ_TRACE_DUMP, &dump) != 0) {
+    free(dump.recs);
+    return -NFS_ERROR_IO;
+  }
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    free(dump.recs);
+    return -errno;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = NFS_TRACE_MAGIC;
+  hdr.version = NFS_TRACE_VERSION;
+  hdr.rec_sz = sizeof(struct ddriver_trace_rec);
+  hdr.sz_io = super.sz_io;
+  hdr.sz_disk = super.sz_disk;
+  hdr.cnt = dump.cnt;
+  hdr.total = dump.total;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      fwrite(dump.recs, sizeof(struct ddriver_trace_rec), dump.cnt, fp) != dump.cnt) {
+    ret = -NFS_ERROR_IO;
+  }
+  if (fclose(fp) != 0) {
+    ret = -NFS_ERROR_IO;
+  }
+  free(dump.recs);
+  return ret;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# 在新格式化的 ddriver 上挂载 newfs，跑 bench.newfs，结果写到 JSON 文件
+# 用法: ./bench.sh [结果文件] [bench.newfs 的其他参数...]
+# 环境变量: MKFS_ARGS 传给 mkfs.newfs，MOUNT_ARGS 传给 newfs（默认关掉内核的
+# 属性 / 目录项缓存并用 direct_io，让每次操作都落到 newfs 上），
+#           DDRIVER_LATENCY 选择用户态 ddriver 的延迟模型（legacy/hdd/ssd/nvme/none）
+#           DDRIVER_CLOCK=virtual 时驱动不睡眠，这里经过 FUSE 按真实时间计时，模拟的
+#           设备时间只有 bench-inproc.newfs 和 ddtrace replay 能算进结果
+
+ROOT_PATH=$(cd "$(dirname "$0")" && pwd)
+BUILD_PATH="$ROOT_PATH"/../build
+MNTPOINT="$ROOT_PATH"/mnt
+OUTPUT=${1:-"$ROOT_PATH"/bench.json}
+shift
+MOUNT_ARGS=${MOUNT_ARGS:-"-o entry_timeout=0,attr_timeout=0,direct_io"}
+
+for bin in newfs mkfs.newfs bench.newfs; do
+    if [ ! -x "$BUILD_PATH/$bin" ]; then
+        echo "找不到 $BUILD_PATH/$bin, 请先编译"
+        exit 1
+    fi
+done
+
+mkdir -p "$MNTPOINT"
+if mount | grep "$MNTPOINT" >/dev/null; then
+    fusermount -u "$MNTPOINT"
+fi
+
+ddriver -r >/dev/null
+# shellcheck disable=SC2086
+"$BUILD_PATH"/mkfs.newfs -q $MKFS_ARGS "$HOME"/ddriver || exit 1
+# shellcheck disable=SC2086
+"$BUILD_PATH"/newfs --device="$HOME"/ddriver $MOUNT_ARGS "$MNTPOINT" || exit 1
+
+"$BUILD_PATH"/bench.newfs -o "$OUTPUT" -u "fusermount -u $MNTPOINT" "$@" "$MNTPOINT"
+RET=$?
+if mount | grep "$MNTPOINT" >/dev/null; then
+    fusermount -u "$MNTPOINT"
+fi
+[ $RET -eq 0 ] && echo "结果: $OUTPUT"
+exit $RET
@@ -147,6 +147,7 @@ function test_main() {
     # ddriver -r
     rm ~/ddriver -f
     touch ~/ddriver 
+    ../build/mkfs.${PROJECT_NAME} -q "$HOME"/ddriver
     
     test_mount "[all-the-mount-test]"
     echo ""
@@ -81,6 +81,7 @@ function core_tester() {
 function clean_ddriver() {
     sleep 1
     ddriver -r > /dev/null
+    "$ROOT_PATH"/../build/mkfs.newfs -q "$HOME"/ddriver > /dev/null
 }
 
 function pass() {
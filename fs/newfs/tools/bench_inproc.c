@@ -0,0 +1,409 @@
+#include "../include/newfs.h"
+#include "newfs_bench.h"
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * bench-inproc.newfs：不经过 FUSE，在同一进程里直接调用 newfs_mknod / newfs_write /
+ * lookup 等，对 ddriver 镜像跑和 bench.newfs 相同的基准，JSON 格式见 newfs_bench.c。
+ * 去掉了内核往返之后，分配器、块缓存和 lookup 的改动可以单独比较和 profile。
+ *
+ * 镜像需要先用 mkfs.newfs 格式化。newfs 的调试输出写到 stdout，运行期间 stdout
+ * 重定向到 /dev/null（-v 时保留），结果写到 -o 指定的文件或原来的 stdout。
+ *
+ * 比 bench.newfs 多出的几项：
+ *   lookup      只做路径解析，不填 stat
+ *   sync_inode  每轮重写整个文件后写回一次，包含延迟分配的块在这时落盘
+ *   unmount     newfs_destroy，写回剩余的 inode、位图和超级块
+ *
+ * 驱动用虚拟时钟时按驱动的时钟计时，模拟的延迟不用真的等。
+ * -z 时整块的读写不经过 ddriver_read / ddriver_write，而是直接读写镜像，newfs 再用
+ * IOC_REQ_DEVICE_DIRECT 把它们记到驱动的统计（direct_bytes）和延迟模型上，
+ * 所以结果和不加 -z 时可比。
+ */
+#define BENCH_MAX_SIZES         16
+#define BENCH_DIR               "/nfs-bench"
+
+extern struct newfs_super super;
+extern struct custom_options newfs_options;
+
+struct bench_opts {
+  int       dir_sizes[BENCH_MAX_SIZES];
+  int       n_dir_sizes;
+  int       file_sizes[BENCH_MAX_SIZES];
+  int       n_file_sizes;
+  int       chunk;
+  int       rounds;
+  unsigned  seed;
+};
+
+static struct bench_out out;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-d dir_sizes] [-f file_sizes] [-c chunk] [-r rounds] [-s seed]\n"
+          "       [-o output] [-t trace] [-z] [-v] [device]\n"
+          "  -d  entries per directory, comma separated (default: 8,16,32)\n"
+          "  -f  file sizes in bytes, comma separated (default: 128,4096,6144)\n"
+          "  -c  bytes per read / write call (default: 1024)\n"
+          "  -r  rounds of lookup / readdir / data passes (default: 10)\n"
+          "  -s  seed of the random offsets (default: 1)\n"
+          "  -o  write JSON here instead of stdout\n"
+          "  -t  mount with --trace=trace, see ddtrace\n"
+          "  -z  mount with --zero-copy, the direct IO is still charged to the driver\n"
+          "  -v  keep the debug output of newfs on stdout\n"
+          "  device defaults to $HOME/ddriver, formatted by mkfs.newfs\n",
+          prog);
+}
+
+static uint64_t driver_clock(void) {
+  unsigned long long ns = 0;
+
+  ddriver_ioctl(super.driver_fd, IOC_REQ_DEVICE_CLOCK, &ns);
+  return ns;
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  (*(int *)buf)++;
+  return 0;
+}
+
+/**
+ * @brief 目录规模为 n 时的 mknod / lookup / getattr / readdir / unlink
+ */
+static int bench_meta(const struct bench_opts *opts, int n) {
+  char dir[64], path[96];
+  struct bench_lat lat;
+  struct stat st;
+  boolean is_find, is_root;
+  uint64_t t0;
+  int created = 0, err = 0, ret, cnt;
+
+  snprintf(dir, sizeof(dir), "%s/meta-%d", BENCH_DIR, n);
+  ret = newfs_mkdir(dir, S_IFDIR | 0777);
+  if (ret != NFS_ERROR_NONE) {
+    return ret;
+  }
+
+  bench_lat_begin(&lat, n);
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+    t0 = bench_now_ns();
+    ret = newfs_mknod(path, S_IFREG | 0644, 0);
+    if (ret != NFS_ERROR_NONE) {
+      err = -ret;
+      break;
+    }
+    bench_lat_add(&lat, t0);
+    created++;
+  }
+  bench_lat_report(&out, &lat, "create", "entries", created, n, err);
+
+  err = 0;
+  bench_lat_begin(&lat, created * opts->rounds);
+  for (int r = 0; r < opts->rounds && err == 0; r++) {
+    for (int i = 0; i < created; i++) {
+      snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+      t0 = bench_now_ns();
+      lookup(path, &is_find, &is_root);
+      if (!is_find) {
+        err = NFS_ERROR_NOTFOUND;
+        break;
+      }
+      bench_lat_add(&lat, t0);
+    }
+  }
+  bench_lat_report(&out, &lat, "lookup", "entries", created, n, err);
+
+  err = 0;
+  bench_lat_begin(&lat, created * opts->rounds);
+  for (int r = 0; r < opts->rounds && err == 0; r++) {
+    for (int i = 0; i < created; i++) {
+      snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+      t0 = bench_now_ns();
+      ret = newfs_getattr(path, &st);
+      if (ret != NFS_ERROR_NONE) {
+        err = -ret;
+        break;
+      }
+      bench_lat_add(&lat, t0);
+    }
+  }
+  bench_lat_report(&out, &lat, "stat", "entries", created, n, err);
+
+  // FUSE 按偏移逐项调用 readdir，一次操作是从头列到没有新目录项为止
+  err = 0;
+  bench_lat_begin(&lat, opts->rounds);
+  for (int r = 0; r < opts->rounds && err == 0; r++) {
+    t0 = bench_now_ns();
+    for (off_t ofs = 0;; ofs++) {
+      cnt = 0;
+      ret = newfs_readdir(dir, &cnt, count_filler, ofs, NULL);
+      if (ret != NFS_ERROR_NONE) {
+        err = -ret;
+        break;
+      }
+      if (cnt == 0) {
+        break;
+      }
+    }
+    if (err == 0) {
+      bench_lat_add(&lat, t0);
+    }
+  }
+  bench_lat_report(&out, &lat, "readdir", "entries", created, n, err);
+
+  err = 0;
+  bench_lat_begin(&lat, created);
+  for (int i = 0; i < created; i++) {
+    snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+    t0 = bench_now_ns();
+    ret = newfs_unlink(path);
+    if (ret != NFS_ERROR_NONE) {
+      err = -ret;
+      break;
+    }
+    bench_lat_add(&lat, t0);
+  }
+  bench_lat_report(&out, &lat, "unlink", "entries", created, n, err);
+
+  newfs_rmdir(dir);
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 按 chunk 粒度读 / 写整个文件，shuffle 时偏移打乱成随机排列，lat 为 NULL 时不计时
+ */
+static int file_pass(const struct bench_opts *opts, struct fuse_file_info *fi, int size,
+                     boolean write_op, boolean shuffle, char *buf, struct bench_lat *lat,
+                     unsigned *seed) {
+  int chunks = (size + opts->chunk - 1) / opts->chunk;
+  int *order = (int *)malloc(sizeof(int) * chunks);
+  uint64_t t0;
+  int ret = NFS_ERROR_NONE;
+
+  for (int i = 0; i < chunks; i++) {
+    order[i] = i;
+  }
+  for (int i = chunks - 1; shuffle && i > 0; i--) {
+    int j = rand_r(seed) % (i + 1), tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (int i = 0; i < chunks; i++) {
+    off_t ofs = (off_t)order[i] * opts->chunk;
+    size_t len = size - ofs < opts->chunk ? size - ofs : opts->chunk;
+
+    t0 = bench_now_ns();
+    ret = write_op ? newfs_write(NULL, buf, len, ofs, fi) : newfs_read(NULL, buf, len, ofs, fi);
+    if (ret != (int)len) {
+      ret = ret < 0 ? ret : -NFS_ERROR_IO;
+      break;
+    }
+    ret = NFS_ERROR_NONE;
+    if (lat != NULL) {
+      bench_lat_add(lat, t0);
+    }
+  }
+  free(order);
+  return ret;
+}
+
+static void bench_rw(const struct bench_opts *opts, struct fuse_file_info *fi, const char *name,
+                     int size, int requested, boolean write_op, boolean shuffle, char *buf) {
+  int chunks = (size + opts->chunk - 1) / opts->chunk;
+  unsigned seed = opts->seed;
+  struct bench_lat lat;
+  int ret = NFS_ERROR_NONE;
+
+  bench_lat_begin(&lat, chunks * opts->rounds);
+  for (int r = 0; r < opts->rounds && ret == NFS_ERROR_NONE; r++) {
+    ret = file_pass(opts, fi, size, write_op, shuffle, buf, &lat, &seed);
+  }
+  bench_lat_report(&out, &lat, name, "file_size", size, requested, -ret);
+}
+
+/**
+ * @brief 文件大小为 size 时的顺序 / 随机读写和 sync_inode
+ * 先整个写一遍建立文件，超过 MAX_FILE_SZ 时以实际写入的大小继续
+ */
+static int bench_data(const struct bench_opts *opts, int size) {
+  struct fuse_file_info fi;
+  struct newfs_inode *inode;
+  struct bench_lat lat;
+  char path[64];
+  char *buf = (char *)malloc(opts->chunk);
+  int done = 0, len, ret;
+  uint64_t t0;
+
+  snprintf(path, sizeof(path), "%s/data-%d", BENCH_DIR, size);
+  memset(&fi, 0, sizeof(fi));
+  ret = newfs_mknod(path, S_IFREG | 0644, 0);
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_open(path, &fi);
+  }
+  if (ret != NFS_ERROR_NONE) {
+    free(buf);
+    return ret;
+  }
+  inode = (struct newfs_inode *)(uintptr_t)fi.fh;
+  for (int i = 0; i < opts->chunk; i++) {
+    buf[i] = (char)('a' + i % 26);
+  }
+  while (done < size) {
+    len = size - done < opts->chunk ? size - done : opts->chunk;
+    ret = newfs_write(NULL, buf, len, done, &fi);
+    if (ret <= 0) {
+      break;
+    }
+    done += ret;
+  }
+
+  if (done > 0) {
+    bench_rw(opts, &fi, "seq_write", done, size, TRUE, FALSE, buf);
+    bench_rw(opts, &fi, "seq_read", done, size, FALSE, FALSE, buf);
+    bench_rw(opts, &fi, "rand_write", done, size, TRUE, TRUE, buf);
+    bench_rw(opts, &fi, "rand_read", done, size, FALSE, TRUE, buf);
+
+    // 每轮先把整个文件重新弄脏，只计 sync_inode 本身
+    ret = NFS_ERROR_NONE;
+    bench_lat_begin(&lat, opts->rounds);
+    for (int r = 0; r < opts->rounds && ret == NFS_ERROR_NONE; r++) {
+      ret = file_pass(opts, &fi, done, TRUE, FALSE, buf, NULL, NULL);
+      if (ret == NFS_ERROR_NONE) {
+        t0 = bench_now_ns();
+        ret = sync_inode(inode);
+        bench_lat_add(&lat, t0);
+      }
+    }
+    bench_lat_report(&out, &lat, "sync_inode", "file_size", done, size, ret < 0 ? -ret : 0);
+  }
+  newfs_release(NULL, &fi);
+  newfs_unlink(path);
+  free(buf);
+  return done > 0 ? NFS_ERROR_NONE : -NFS_ERROR_NOSPACE;
+}
+
+int main(int argc, char **argv) {
+  struct bench_opts opts = {
+    .dir_sizes = {8, 16, 32}, .n_dir_sizes = 3,
+    .file_sizes = {128, 4096, 6144}, .n_file_sizes = 3,
+    .chunk = 1024, .rounds = 10, .seed = 1,
+  };
+  const char *output = NULL;
+  char device[PATH_MAX];
+  boolean verbose = FALSE;
+  struct bench_lat lat;
+  struct ddriver_state_v2 drv_stats;
+  time_t now = time(NULL);
+  uint64_t t0;
+  FILE *fp;
+  int opt, ret = 0;
+
+  while ((opt = getopt(argc, argv, "d:f:c:r:s:o:t:zvh")) != -1) {
+    switch (opt) {
+    case 'd':
+      opts.n_dir_sizes = bench_parse_sizes(optarg, opts.dir_sizes, BENCH_MAX_SIZES);
+      break;
+    case 'f':
+      opts.n_file_sizes = bench_parse_sizes(optarg, opts.file_sizes, BENCH_MAX_SIZES);
+      break;
+    case 'c':
+      opts.chunk = atoi(optarg);
+      break;
+    case 'r':
+      opts.rounds = atoi(optarg);
+      break;
+    case 's':
+      opts.seed = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 't':
+      newfs_options.trace = optarg;
+      break;
+    case 'z':
+      newfs_options.zero_copy = TRUE;
+      break;
+    case 'v':
+      verbose = TRUE;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc - 1 || opts.n_dir_sizes < 0 || opts.n_file_sizes < 0 ||
+      opts.chunk <= 0 || opts.rounds <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (optind == argc - 1) {
+    snprintf(device, sizeof(device), "%s", argv[optind]);
+  } else {
+    snprintf(device, sizeof(device), "%s/ddriver", getenv("HOME") != NULL ? getenv("HOME") : ".");
+  }
+  newfs_options.device = device;
+
+  fp = output != NULL ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+  if (fp == NULL) {
+    fprintf(stderr, "%s: can't open %s: %s\n", argv[0], output, strerror(errno));
+    return 1;
+  }
+  if (!verbose) {
+    fflush(stdout);
+    freopen("/dev/null", "w", stdout);
+  }
+
+  newfs_init(NULL);
+  if (!super.is_mounted) {
+    fprintf(stderr, "%s: can't mount %s, format it with mkfs.newfs first\n", argv[0], device);
+    fclose(fp);
+    return 1;
+  }
+  ret = newfs_mkdir(BENCH_DIR, S_IFDIR | 0777);
+  if (ret != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: can't create %s: %s\n", argv[0], BENCH_DIR, strerror(-ret));
+    newfs_destroy(NULL);
+    fclose(fp);
+    return 1;
+  }
+  if (ddriver_ioctl(super.driver_fd, IOC_REQ_DEVICE_STATE_V2, &drv_stats) == 0 &&
+      drv_stats.clock_virtual) {
+    bench_set_clock(driver_clock);
+  }
+
+  bench_out_begin(&out, fp);
+  fprintf(fp, "  \"fs\": \"newfs\",\n  \"mode\": \"inproc\",\n  \"device\": \"%s\",\n", device);
+  fprintf(fp, "  \"block_size\": %d,\n  \"zero_copy\": %s,\n", super.sz_blk,
+          newfs_options.zero_copy ? "true" : "false");
+  fprintf(fp, "  \"timestamp\": %lld,\n  \"chunk\": %d,\n  \"rounds\": %d,\n  \"seed\": %u,\n",
+          (long long)now, opts.chunk, opts.rounds, opts.seed);
+  bench_out_results(&out);
+  ret = 0;
+  for (int i = 0; i < opts.n_dir_sizes; i++) {
+    if (bench_meta(&opts, opts.dir_sizes[i]) != NFS_ERROR_NONE) {
+      fprintf(stderr, "%s: metadata bench of %d entries failed\n", argv[0], opts.dir_sizes[i]);
+      ret = 1;
+    }
+  }
+  for (int i = 0; i < opts.n_file_sizes; i++) {
+    if (bench_data(&opts, opts.file_sizes[i]) != NFS_ERROR_NONE) {
+      fprintf(stderr, "%s: data bench of %d bytes failed\n", argv[0], opts.file_sizes[i]);
+      ret = 1;
+    }
+  }
+  newfs_rmdir(BENCH_DIR);
+
+  bench_lat_begin(&lat, 1);
+  t0 = bench_now_ns();
+  newfs_destroy(NULL);
+  bench_lat_add(&lat, t0);
+  bench_lat_report(&out, &lat, "unmount", NULL, 0, 0, 0);
+  bench_out_end(&out);
+  fclose(fp);
+  return ret;
+}
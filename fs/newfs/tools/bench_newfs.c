@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "newfs_bench.h"
+
+/*
+ * bench.newfs：在已挂载的 newfs 上跑微基准，结果以 JSON 输出。
+ *
+ * 元数据：对每个目录规模 N，在新建的目录里依次 create N 个文件、stat 每个文件、
+ *         整个目录 readdir、unlink 全部文件，分别对应 mknod / lookup / readdir / unlink。
+ * 数据：  对每个文件大小 S，按 -c 的粒度顺序写、顺序读、随机写、随机读，
+ *         覆盖 write_buf / read_buf 以及下面的块缓存和驱动封装。
+ * -u 给出卸载命令时最后计时执行一次，脏 inode 和数据块在卸载时由 sync_inode 写回。
+ *
+ * 每一项记录每次操作的延迟，输出格式见 newfs_bench.c。
+ * 目录或文件超过 newfs 的上限（目录项块数、MAX_FILE_SZ）时按实际达到的规模记录，
+ * 并标记 "truncated"。
+ */
+#define BENCH_MAX_SIZES         16
+#define BENCH_DIR               "nfs-bench"
+
+struct bench_opts {
+  const char *mnt;
+  int         dir_sizes[BENCH_MAX_SIZES];
+  int         n_dir_sizes;
+  int         file_sizes[BENCH_MAX_SIZES];
+  int         n_file_sizes;
+  int         chunk;
+  int         rounds;
+  unsigned    seed;
+  const char *unmount_cmd;
+};
+
+static struct bench_out out;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-d dir_sizes] [-f file_sizes] [-c chunk] [-r rounds] [-s seed]\n"
+          "       [-o output] [-u unmount_cmd] mountpoint\n"
+          "  -d  entries per directory, comma separated (default: 8,16,32)\n"
+          "  -f  file sizes in bytes, comma separated (default: 128,4096,6144)\n"
+          "  -c  bytes per read / write call (default: 1024)\n"
+          "  -r  rounds of stat / readdir / data passes (default: 10)\n"
+          "  -s  seed of the random offsets (default: 1)\n"
+          "  -o  write JSON here instead of stdout\n"
+          "  -u  command run and timed at the end, e.g. \"fusermount -u mnt\"\n",
+          prog);
+}
+
+/**
+ * @brief 目录规模为 n 时的 create / stat / readdir / unlink
+ */
+static int bench_meta(const struct bench_opts *opts, int n) {
+  char dir[PATH_MAX], path[PATH_MAX + 32];
+  struct bench_lat lat;
+  struct stat st;
+  struct dirent *de;
+  DIR *dp;
+  uint64_t t0;
+  int created = 0, err = 0, fd;
+
+  snprintf(dir, sizeof(dir), "%s/%s/meta-%d", opts->mnt, BENCH_DIR, n);
+  if (mkdir(dir, 0777) != 0) {
+    return -errno;
+  }
+
+  bench_lat_begin(&lat, n);
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+    t0 = bench_now_ns();
+    fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) {
+      err = errno;
+      break;
+    }
+    close(fd);
+    bench_lat_add(&lat, t0);
+    created++;
+  }
+  bench_lat_report(&out, &lat, "create", "entries", created, n, err);
+
+  // 反复 stat 同一批文件，每次都要在父目录里 lookup
+  err = 0;
+  bench_lat_begin(&lat, created * opts->rounds);
+  for (int r = 0; r < opts->rounds && err == 0; r++) {
+    for (int i = 0; i < created; i++) {
+      snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+      t0 = bench_now_ns();
+      if (stat(path, &st) != 0) {
+        err = errno;
+        break;
+      }
+      bench_lat_add(&lat, t0);
+    }
+  }
+  bench_lat_report(&out, &lat, "stat", "entries", created, n, err);
+
+  // 一次操作是完整列出整个目录
+  err = 0;
+  bench_lat_begin(&lat, opts->rounds);
+  for (int r = 0; r < opts->rounds; r++) {
+    t0 = bench_now_ns();
+    dp = opendir(dir);
+    if (dp == NULL) {
+      err = errno;
+      break;
+    }
+    while ((de = readdir(dp)) != NULL) {
+    }
+    closedir(dp);
+    bench_lat_add(&lat, t0);
+  }
+  bench_lat_report(&out, &lat, "readdir", "entries", created, n, err);
+
+  err = 0;
+  bench_lat_begin(&lat, created);
+  for (int i = 0; i < created; i++) {
+    snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+    t0 = bench_now_ns();
+    if (unlink(path) != 0) {
+      err = errno;
+      break;
+    }
+    bench_lat_add(&lat, t0);
+  }
+  bench_lat_report(&out, &lat, "unlink", "entries", created, n, err);
+
+  rmdir(dir);
+  return 0;
+}
+
+/**
+ * @brief 按 chunk 粒度读 / 写整个文件 rounds 遍，shuffle 时偏移打乱成随机排列
+ */
+static void bench_rw(const struct bench_opts *opts, int fd, const char *name, int size,
+                     int requested, int write_op, int shuffle, char *buf) {
+  int chunks = (size + opts->chunk - 1) / opts->chunk;
+  int *order = (int *)malloc(sizeof(int) * chunks);
+  unsigned seed = opts->seed;
+  struct bench_lat lat;
+  uint64_t t0;
+  ssize_t ret;
+  int err = 0;
+
+  for (int i = 0; i < chunks; i++) {
+    order[i] = i;
+  }
+  bench_lat_begin(&lat, chunks * opts->rounds);
+  for (int r = 0; r < opts->rounds && err == 0; r++) {
+    for (int i = chunks - 1; shuffle && i > 0; i--) {
+      int j = rand_r(&seed) % (i + 1), tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+    for (int i = 0; i < chunks; i++) {
+      off_t ofs = (off_t)order[i] * opts->chunk;
+      size_t len = size - ofs < opts->chunk ? size - ofs : opts->chunk;
+
+      t0 = bench_now_ns();
+      ret = write_op ? pwrite(fd, buf, len, ofs) : pread(fd, buf, len, ofs);
+      if (ret != (ssize_t)len) {
+        err = ret < 0 ? errno : EIO;
+        break;
+      }
+      bench_lat_add(&lat, t0);
+    }
+  }
+  bench_lat_report(&out, &lat, name, "file_size", size, requested, err);
+  free(order);
+}
+
+/**
+ * @brief 文件大小为 size 时的顺序 / 随机读写
+ * 先整个写一遍建立文件，超过 MAX_FILE_SZ 时以实际写入的大小继续
+ */
+static int bench_data(const struct bench_opts *opts, int size) {
+  char path[PATH_MAX];
+  char *buf = (char *)malloc(opts->chunk);
+  int fd, len, done = 0;
+  ssize_t ret;
+
+  snprintf(path, sizeof(path), "%s/%s/data-%d", opts->mnt, BENCH_DIR, size);
+  fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0) {
+    free(buf);
+    return -errno;
+  }
+  for (int i = 0; i < opts->chunk; i++) {
+    buf[i] = (char)('a' + i % 26);
+  }
+  while (done < size) {
+    len = size - done < opts->chunk ? size - done : opts->chunk;
+    ret = pwrite(fd, buf, len, done);
+    if (ret <= 0) {
+      break;
+    }
+    done += ret;
+  }
+
+  if (done > 0) {
+    bench_rw(opts, fd, "seq_write", done, size, 1, 0, buf);
+    bench_rw(opts, fd, "seq_read", done, size, 0, 0, buf);
+    bench_rw(opts, fd, "rand_write", done, size, 1, 1, buf);
+    bench_rw(opts, fd, "rand_read", done, size, 0, 1, buf);
+  }
+  close(fd);
+  unlink(path);
+  free(buf);
+  return done > 0 ? 0 : -ENOSPC;
+}
+
+/**
+ * @brief 计时执行卸载命令，dirty 的元数据和数据块在这时写回
+ */
+static void bench_unmount(const struct bench_opts *opts) {
+  struct bench_lat lat;
+  uint64_t t0;
+  int err = 0;
+
+  bench_lat_begin(&lat, 1);
+  t0 = bench_now_ns();
+  if (system(opts->unmount_cmd) != 0) {
+    err = EIO;
+  } else {
+    bench_lat_add(&lat, t0);
+  }
+  bench_lat_report(&out, &lat, "unmount", NULL, 0, 0, err);
+}
+
+int main(int argc, char **argv) {
+  struct bench_opts opts = {
+    .dir_sizes = {8, 16, 32}, .n_dir_sizes = 3,
+    .file_sizes = {128, 4096, 6144}, .n_file_sizes = 3,
+    .chunk = 1024, .rounds = 10, .seed = 1,
+  };
+  const char *output = NULL;
+  char top[PATH_MAX];
+  FILE *fp;
+  time_t now = time(NULL);
+  int opt, ret = 0;
+
+  while ((opt = getopt(argc, argv, "d:f:c:r:s:o:u:h")) != -1) {
+    switch (opt) {
+    case 'd':
+      opts.n_dir_sizes = bench_parse_sizes(optarg, opts.dir_sizes, BENCH_MAX_SIZES);
+      break;
+    case 'f':
+      opts.n_file_sizes = bench_parse_sizes(optarg, opts.file_sizes, BENCH_MAX_SIZES);
+      break;
+    case 'c':
+      opts.chunk = atoi(optarg);
+      break;
+    case 'r':
+      opts.rounds = atoi(optarg);
+      break;
+    case 's':
+      opts.seed = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'u':
+      opts.unmount_cmd = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || opts.n_dir_sizes < 0 || opts.n_file_sizes < 0 ||
+      opts.chunk <= 0 || opts.rounds <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  opts.mnt = argv[optind];
+
+  snprintf(top, sizeof(top), "%s/%s", opts.mnt, BENCH_DIR);
+  if (mkdir(top, 0777) != 0) {
+    fprintf(stderr, "%s: can't create %s: %s\n", argv[0], top, strerror(errno));
+    return 1;
+  }
+  fp = output != NULL ? fopen(output, "w") : stdout;
+  if (fp == NULL) {
+    fprintf(stderr, "%s: can't open %s: %s\n", argv[0], output, strerror(errno));
+    rmdir(top);
+    return 1;
+  }
+
+  bench_out_begin(&out, fp);
+  fprintf(fp, "  \"fs\": \"newfs\",\n  \"mountpoint\": \"%s\",\n", opts.mnt);
+  fprintf(fp, "  \"timestamp\": %lld,\n  \"chunk\": %d,\n  \"rounds\": %d,\n  \"seed\": %u,\n",
+          (long long)now, opts.chunk, opts.rounds, opts.seed);
+  bench_out_results(&out);
+  for (int i = 0; i < opts.n_dir_sizes; i++) {
+    if (bench_meta(&opts, opts.dir_sizes[i]) != 0) {
+      fprintf(stderr, "%s: metadata bench of %d entries failed\n", argv[0], opts.dir_sizes[i]);
+      ret = 1;
+    }
+  }
+  for (int i = 0; i < opts.n_file_sizes; i++) {
+    if (bench_data(&opts, opts.file_sizes[i]) != 0) {
+      fprintf(stderr, "%s: data bench of %d bytes failed\n", argv[0], opts.file_sizes[i]);
+      ret = 1;
+    }
+  }
+  rmdir(top);
+  if (opts.unmount_cmd != NULL) {
+    bench_unmount(&opts);
+  }
+  bench_out_end(&out);
+  if (fp != stdout) {
+    fclose(fp);
+  }
+  return ret;
+}
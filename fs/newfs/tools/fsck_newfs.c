@@ -0,0 +1,578 @@
+#include "newfs_tool.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+
+/*
+ * fsck.newfs：离线检查 newfs，-y 时修复。
+ *
+ * 1. 超级块、两个位图和整个 inode 表各用一次大块读读入内存；
+ * 2. 多线程扫描 inode 表，inode 位图中置位的 inode 逐个检查类型、大小、块号范围和内联标志；
+ * 3. 从根目录出发遍历目录树，检查每个目录项指向的 inode，记下可达的 inode；
+ * 4. 多线程统计可达 inode 引用的数据块，同一块被多个 inode 引用即重复分配，
+ *    再和数据位图逐块比对：置位却没人引用的是泄漏，有人引用却没置位的是丢失。
+ *    不可达却仍在 inode 位图里的 inode（例如崩溃时仍被打开着的已删除文件）也会报告。
+ *
+ * 修复：越界的块号和重复引用中编号较大的 inode 的那一块改成空洞，删除坏的目录项，
+ * 释放不可达的 inode，最后按可达的 inode 重建两个位图和超级块里的使用量。
+ */
+#define FSCK_MAX_JOBS           16
+
+/* 退出码，与 e2fsck 一致 */
+#define FSCK_OK                 0
+#define FSCK_FIXED              1
+#define FSCK_UNCORRECTED        4
+#define FSCK_ERROR              8
+
+/* ino_state */
+#define INO_BAD                 0x1     /* 位图中置位但内容损坏 */
+#define INO_REACHED             0x2     /* 从根目录可达 */
+
+#define BIT_TEST(map, n)        ((map)[(n) / UINT8_BITS] & (0x1 << ((n) % UINT8_BITS)))
+#define BIT_SET(map, n)         ((map)[(n) / UINT8_BITS] |= (0x1 << ((n) % UINT8_BITS)))
+#define BIT_CLR(map, n)         ((map)[(n) / UINT8_BITS] &= ~(0x1 << ((n) % UINT8_BITS)))
+
+struct fsck {
+  struct newfs_dev      dev;
+  struct newfs_super_d  super_d;
+  int       sz_blk;
+  int       sz_inode;
+  int       max_ino;
+  int       max_data;
+  int       dentry_per_blk;
+  uint8_t*  map_inode;
+  uint8_t*  map_data;
+  uint8_t*  itable;             /* 整个 inode 表 */
+  int       itable_blks;
+  uint8_t*  itable_dirty;       /* 修复时改过的 inode 表块 */
+  uint8_t*  ino_state;
+  uint16_t* data_ref;           /* 每个数据块被多少个 inode 引用 */
+  int*      data_owner;         /* 引用该块的最小 inode 号 */
+  boolean   repair;
+  boolean   verbose;
+  int       found;
+  int       left;               /* 没有修复的问题 */
+  pthread_mutex_t log_lock;
+};
+
+struct fsck_range {
+  int       start;
+  int       end;
+  int       used;               /* 本段内统计出的使用数 */
+  pthread_t tid;
+};
+
+static struct fsck fs = { .log_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void problem(boolean fixable, const char *fmt, ...) {
+  va_list ap;
+
+  pthread_mutex_lock(&fs.log_lock);
+  fs.found++;
+  if (!(fixable && fs.repair)) {
+    fs.left++;
+  }
+  if (fs.verbose || fs.found <= 100) {
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(fixable && fs.repair ? " (fixed)\n" : "\n");
+  }
+  else if (fs.found == 101) {
+    printf("... more problems, use -v to see all\n");
+  }
+  pthread_mutex_unlock(&fs.log_lock);
+}
+
+/* 读入内存的目录块里第 i 个目录项，每块放 dentry_per_blk 个，块尾可能有空隙 */
+#define FSCK_DENTRY(buf, i)     ((struct newfs_dentry_d *)((buf) + (size_t)((i) / fs.dentry_per_blk) * fs.sz_blk) + \
+                                 (i) % fs.dentry_per_blk)
+
+static inline struct newfs_inode_d *fsck_inode(int ino) {
+  return (struct newfs_inode_d *)(fs.itable + (size_t)ino * fs.sz_inode);
+}
+
+static inline void fsck_inode_dirty(int ino) {
+  fs.itable_dirty[(size_t)ino * fs.sz_inode / fs.sz_blk] = TRUE;
+}
+
+/**
+ * @brief 目录能读出来的目录项数：dir_dentry_cnt 个，遇到没有分配或者指到数据区之外的
+ * 目录块为止（只检查不修复时坏的块号还留在 inode 里，不能去读）
+ */
+static int fsck_dir_entries(struct newfs_inode_d *d) {
+  int cnt = 0;
+
+  for (int j = 0; j < DATA_PER_FILE && cnt < (int)d->dir_dentry_cnt; j++) {
+    int datano = (int)d->data_block_no[j];
+    if (datano < 0 || datano >= fs.max_data) {
+      break;
+    }
+    cnt += fs.dentry_per_blk;
+  }
+  return cnt < (int)d->dir_dentry_cnt ? cnt : (int)d->dir_dentry_cnt;
+}
+
+/**
+ * @brief 把 [0, total) 按 align 对齐切成 jobs 段，每段一个线程执行 fn，返回各段 used 之和
+ */
+static int fsck_parallel(void *(*fn)(void *), int total, int align, int jobs) {
+  struct fsck_range range[FSCK_MAX_JOBS];
+  int slice = ROUND_UP((total + jobs - 1) / jobs, align);
+  int used = 0;
+
+  for (int i = 0; i < jobs; i++) {
+    range[i].start = i * slice < total ? i * slice : total;
+    range[i].end = range[i].start + slice < total ? range[i].start + slice : total;
+    range[i].used = 0;
+    if (pthread_create(&range[i].tid, NULL, fn, &range[i]) != 0) {
+      fn(&range[i]);
+      range[i].tid = 0;
+    }
+  }
+  for (int i = 0; i < jobs; i++) {
+    if (range[i].tid != 0) {
+      pthread_join(range[i].tid, NULL);
+    }
+    used += range[i].used;
+  }
+  return used;
+}
+
+/* 第 2 步：检查 inode 表里每个已分配 inode 自身的内容 */
+static void *check_inodes(void *arg) {
+  struct fsck_range *range = (struct fsck_range *)arg;
+
+  for (int ino = range->start; ino < range->end; ino++) {
+    struct newfs_inode_d *d;
+    boolean bad = FALSE;
+
+    if (!BIT_TEST(fs.map_inode, ino)) {
+      continue;
+    }
+    range->used++;
+    d = fsck_inode(ino);
+    if ((int)d->ino != ino || (d->file_type != NFS_REG_FILE && d->file_type != NFS_DIR)) {
+      problem(TRUE, "inode %d: bad header (ino %u, type %d)", ino, d->ino, d->file_type);
+      fs.ino_state[ino] |= INO_BAD;
+      continue;
+    }
+    if (d->file_type == NFS_REG_FILE && d->size > (uint32_t)DATA_PER_FILE * fs.sz_blk) {
+      problem(TRUE, "inode %d: size %u larger than %d blocks", ino, d->size, DATA_PER_FILE);
+      bad = TRUE;
+    }
+    if (d->file_type == NFS_DIR &&
+        d->dir_dentry_cnt > (uint32_t)fs.dentry_per_blk * DATA_PER_FILE) {
+      problem(TRUE, "inode %d: %u entries do not fit in a directory", ino, d->dir_dentry_cnt);
+      bad = TRUE;
+    }
+    if (d->flags & NFS_INODE_INLINE) {
+      boolean has_blk = FALSE;
+      for (int i = 0; i < DATA_PER_FILE; i++) {
+        has_blk |= (int)d->data_block_no[i] != -1;
+      }
+      if (d->file_type != NFS_REG_FILE || has_blk ||
+          d->size > (uint32_t)(fs.sz_inode - NFS_INLINE_DATA_OFS)) {
+        problem(TRUE, "inode %d: bad inline data", ino);
+        bad = TRUE;
+      }
+    }
+    if (bad) {
+      fs.ino_state[ino] |= INO_BAD;
+      continue;
+    }
+    for (int i = 0; i < DATA_PER_FILE; i++) {
+      int datano = (int)d->data_block_no[i];
+      if (datano != -1 && (datano < 0 || datano >= fs.max_data)) {
+        problem(TRUE, "inode %d: block %d points to %d outside the data area", ino, i, datano);
+        if (fs.repair) {
+          d->data_block_no[i] = -1;
+          d->unwritten_blks &= ~(1u << i);
+          fsck_inode_dirty(ino);
+        }
+      }
+    }
+    if (d->file_type == NFS_DIR && fsck_dir_entries(d) < (int)d->dir_dentry_cnt) {
+      problem(TRUE, "inode %d: directory blocks for %u entries are missing", ino,
+              d->dir_dentry_cnt - fsck_dir_entries(d));
+      if (fs.repair) {
+        d->dir_dentry_cnt = fsck_dir_entries(d);
+        fsck_inode_dirty(ino);
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief 第 3 步：从根目录出发遍历目录树，坏的目录项在修复时删除并重写目录块
+ *
+ * @return int 0成功，根目录损坏时返回 -NFS_ERROR_INVAL，读写失败返回 -NFS_ERROR_IO
+ */
+static int walk_tree(void) {
+  int *stack = (int *)malloc(sizeof(int) * fs.max_ino);
+  int top = 0;
+  uint8_t *blk = (uint8_t *)malloc((size_t)fs.sz_blk * DATA_PER_FILE);
+  uint8_t *out = (uint8_t *)malloc((size_t)fs.sz_blk * DATA_PER_FILE);
+  int ret = NFS_ERROR_NONE;
+
+  if (!BIT_TEST(fs.map_inode, 0) || (fs.ino_state[0] & INO_BAD) ||
+      fsck_inode(0)->file_type != NFS_DIR) {
+    printf("root inode is damaged, can't check the tree\n");
+    free(stack);
+    free(blk);
+    free(out);
+    return -NFS_ERROR_INVAL;
+  }
+  fs.ino_state[0] |= INO_REACHED;
+  stack[top++] = 0;
+  while (top > 0 && ret == NFS_ERROR_NONE) {
+    int dir = stack[--top];
+    struct newfs_inode_d *d = fsck_inode(dir);
+    int cnt = fsck_dir_entries(d);
+    int kept = 0;
+
+    memset(out, 0, (size_t)fs.sz_blk * DATA_PER_FILE);
+    for (int j = 0; j * fs.dentry_per_blk < cnt; j++) {
+      if (newfs_dev_read(&fs.dev, fs.super_d.data_offset + (off_t)d->data_block_no[j] * fs.sz_blk,
+                         blk + (size_t)j * fs.sz_blk, fs.sz_blk) != NFS_ERROR_NONE) {
+        ret = -NFS_ERROR_IO;
+        break;
+      }
+    }
+    for (int i = 0; i < cnt && ret == NFS_ERROR_NONE; i++) {
+      struct newfs_dentry_d *e = FSCK_DENTRY(blk, i);
+      int len = strnlen(e->name, MAX_NAME_LEN);
+      const char *why = NULL;
+
+      if (len == 0 || len == MAX_NAME_LEN) {
+        why = "has a bad name";
+      }
+      else if (e->ino < 0 || e->ino >= fs.max_ino || !BIT_TEST(fs.map_inode, e->ino)) {
+        why = "points to a free inode";
+      }
+      else if (fs.ino_state[e->ino] & INO_BAD) {
+        why = "points to a damaged inode";
+      }
+      else if (fsck_inode(e->ino)->file_type != e->file_type) {
+        why = "has the wrong file type";
+      }
+      else if (fs.ino_state[e->ino] & INO_REACHED) {
+        why = "links an inode that is already in the tree";
+      }
+      else {
+        for (int k = 0; k < kept; k++) {
+          if (strncmp(FSCK_DENTRY(out, k)->name, e->name, MAX_NAME_LEN) == 0) {
+            why = "duplicates another name";
+            break;
+          }
+        }
+      }
+      if (why != NULL) {
+        problem(TRUE, "directory %d: entry '%.*s' (inode %d) %s", dir, len, e->name, e->ino, why);
+        continue;
+      }
+      fs.ino_state[e->ino] |= INO_REACHED;
+      if (e->file_type == NFS_DIR) {
+        stack[top++] = e->ino;
+      }
+      *FSCK_DENTRY(out, kept) = *e;
+      kept++;
+    }
+    // 留下的目录项往前挪，重写用到的目录块
+    if (ret == NFS_ERROR_NONE && kept != cnt && fs.repair) {
+      for (int j = 0; j * fs.dentry_per_blk < cnt; j++) {
+        if (newfs_dev_write(&fs.dev, fs.super_d.data_offset + (off_t)d->data_block_no[j] * fs.sz_blk,
+                            out + (size_t)j * fs.sz_blk, fs.sz_blk) != NFS_ERROR_NONE) {
+          ret = -NFS_ERROR_IO;
+          break;
+        }
+      }
+      d->dir_dentry_cnt = kept;
+      fsck_inode_dirty(dir);
+    }
+  }
+  free(stack);
+  free(blk);
+  free(out);
+  return ret;
+}
+
+/* 修复时只有可达的 inode 留下；只检查不修复时不可达的 inode 仍然占着它的块 */
+static inline boolean ino_live(int ino) {
+  if (fs.ino_state[ino] & INO_REACHED) {
+    return TRUE;
+  }
+  return !fs.repair && BIT_TEST(fs.map_inode, ino) && !(fs.ino_state[ino] & INO_BAD);
+}
+
+/* 第 4 步前半：报告不可达的 inode，统计每个数据块的引用 */
+static void *count_refs(void *arg) {
+  struct fsck_range *range = (struct fsck_range *)arg;
+
+  for (int ino = range->start; ino < range->end; ino++) {
+    struct newfs_inode_d *d = fsck_inode(ino);
+
+    if (BIT_TEST(fs.map_inode, ino) && !(fs.ino_state[ino] & INO_REACHED)) {
+      problem(TRUE, "inode %d is not attached to the tree", ino);
+    }
+    if (!ino_live(ino)) {
+      continue;
+    }
+    range->used++;
+    for (int i = 0; i < DATA_PER_FILE; i++) {
+      int datano = (int)d->data_block_no[i];
+      int owner;
+      if (datano < 0 || datano >= fs.max_data) {
+        continue;
+      }
+      __atomic_fetch_add(&fs.data_ref[datano], 1, __ATOMIC_RELAXED);
+      owner = __atomic_load_n(&fs.data_owner[datano], __ATOMIC_RELAXED);
+      while ((owner == -1 || ino < owner) &&
+             !__atomic_compare_exchange_n(&fs.data_owner[datano], &owner, ino, FALSE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+  }
+  return NULL;
+}
+
+/* 第 4 步后半：数据位图逐块和引用计数比对 */
+static void *check_data_map(void *arg) {
+  struct fsck_range *range = (struct fsck_range *)arg;
+
+  for (int datano = range->start; datano < range->end; datano++) {
+    int ref = fs.data_ref[datano];
+    boolean used = BIT_TEST(fs.map_data, datano) != 0;
+
+    if (ref > 1) {
+      problem(TRUE, "block %d is claimed by %d inodes, kept by inode %d", datano, ref,
+              fs.data_owner[datano]);
+    }
+    if (ref > 0 && !used) {
+      problem(TRUE, "block %d is in use but free in the data map", datano);
+    }
+    if (ref == 0 && used) {
+      problem(TRUE, "block %d is marked used but not referenced", datano);
+    }
+    range->used += ref > 0;
+  }
+  return NULL;
+}
+
+/* 修复：重复引用的块只留给编号最小的 inode，其余的改成空洞 */
+static void *drop_shared(void *arg) {
+  struct fsck_range *range = (struct fsck_range *)arg;
+
+  for (int ino = range->start; ino < range->end; ino++) {
+    struct newfs_inode_d *d = fsck_inode(ino);
+
+    if (!ino_live(ino)) {
+      continue;
+    }
+    for (int i = 0; i < DATA_PER_FILE; i++) {
+      int datano = (int)d->data_block_no[i];
+      if (datano >= 0 && datano < fs.max_data && fs.data_owner[datano] != ino) {
+        d->data_block_no[i] = -1;
+        d->unwritten_blks &= ~(1u << i);
+        fsck_inode_dirty(ino);
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief 按可达的 inode 重建位图，写回改过的 inode 表块、位图和超级块
+ */
+static int write_back(int used_blks) {
+  size_t map_inode_sz = (size_t)fs.super_d.map_inode_blks * fs.sz_blk;
+  size_t map_data_sz = (size_t)fs.super_d.map_data_blks * fs.sz_blk;
+  uint8_t *blk;
+  int ret = NFS_ERROR_NONE;
+
+  memset(fs.map_inode, 0, map_inode_sz);
+  for (int ino = 0; ino < fs.max_ino; ino++) {
+    if (ino_live(ino)) {
+      BIT_SET(fs.map_inode, ino);
+    }
+  }
+  memset(fs.map_data, 0, map_data_sz);
+  for (int datano = 0; datano < fs.max_data; datano++) {
+    if (fs.data_ref[datano] > 0) {
+      BIT_SET(fs.map_data, datano);
+    }
+  }
+  for (int i = 0; i < fs.itable_blks && ret == NFS_ERROR_NONE; i++) {
+    if (fs.itable_dirty[i]) {
+      ret = newfs_dev_write(&fs.dev, fs.super_d.inode_offset + (off_t)i * fs.sz_blk,
+                            fs.itable + (size_t)i * fs.sz_blk, fs.sz_blk);
+    }
+  }
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_write(&fs.dev, fs.super_d.map_inode_offset, fs.map_inode, map_inode_sz);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_write(&fs.dev, fs.super_d.map_data_offset, fs.map_data, map_data_sz);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    blk = (uint8_t *)calloc(1, fs.sz_blk);
+    if (newfs_dev_read(&fs.dev, 0, blk, fs.sz_blk) != NFS_ERROR_NONE) {
+      ret = -NFS_ERROR_IO;
+    }
+    else {
+      fs.super_d.sz_usage = (uint32_t)used_blks * fs.sz_blk;
+      memcpy(blk, &fs.super_d, sizeof(struct newfs_super_d));
+      ret = newfs_dev_write(&fs.dev, 0, blk, fs.sz_blk);
+    }
+    free(blk);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_sync(&fs.dev);
+  }
+  return ret;
+}
+
+/**
+ * @brief 读入超级块、位图和 inode 表
+ */
+static int load_metadata(void) {
+  uint8_t *blk = (uint8_t *)malloc(fs.dev.sz_io);
+  int ret;
+
+  ret = newfs_dev_read(&fs.dev, 0, blk, fs.dev.sz_io);
+  memcpy(&fs.super_d, blk, sizeof(struct newfs_super_d));
+  free(blk);
+  if (ret != NFS_ERROR_NONE) {
+    return ret;
+  }
+  if (newfs_layout_check(&fs.super_d, fs.dev.sz_disk, fs.dev.sz_io) != NFS_ERROR_NONE) {
+    return -NFS_ERROR_INVAL;
+  }
+  // 旧镜像没有记录逻辑块大小和 inode 槽大小
+  fs.sz_blk = fs.super_d.sz_blk != 0 ? (int)fs.super_d.sz_blk : fs.dev.sz_io * 2;
+  fs.sz_inode = fs.super_d.sz_inode != 0 ? (int)fs.super_d.sz_inode : fs.sz_blk;
+  fs.max_ino = fs.super_d.max_inode;
+  fs.max_data = (fs.dev.sz_disk - fs.super_d.data_offset) / fs.sz_blk;
+  if (fs.max_data > (int)fs.super_d.map_data_blks * fs.sz_blk * UINT8_BITS) {
+    fs.max_data = fs.super_d.map_data_blks * fs.sz_blk * UINT8_BITS;
+  }
+  fs.dentry_per_blk = fs.sz_blk / sizeof(struct newfs_dentry_d);
+  fs.itable_blks = ROUND_UP(fs.max_ino * fs.sz_inode, fs.sz_blk) / fs.sz_blk;
+
+  fs.map_inode = (uint8_t *)malloc((size_t)fs.super_d.map_inode_blks * fs.sz_blk);
+  fs.map_data = (uint8_t *)malloc((size_t)fs.super_d.map_data_blks * fs.sz_blk);
+  fs.itable = (uint8_t *)malloc((size_t)fs.itable_blks * fs.sz_blk);
+  fs.itable_dirty = (uint8_t *)calloc(fs.itable_blks, 1);
+  fs.ino_state = (uint8_t *)calloc(fs.max_ino, 1);
+  fs.data_ref = (uint16_t *)calloc(fs.max_data, sizeof(uint16_t));
+  fs.data_owner = (int *)malloc(sizeof(int) * fs.max_data);
+  memset(fs.data_owner, 0xff, sizeof(int) * fs.max_data);
+
+  ret = newfs_dev_read(&fs.dev, fs.super_d.map_inode_offset, fs.map_inode,
+                       (size_t)fs.super_d.map_inode_blks * fs.sz_blk);
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_read(&fs.dev, fs.super_d.map_data_offset, fs.map_data,
+                         (size_t)fs.super_d.map_data_blks * fs.sz_blk);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_read(&fs.dev, fs.super_d.inode_offset, fs.itable,
+                         (size_t)fs.itable_blks * fs.sz_blk);
+  }
+  return ret;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n | -y] [-j jobs] [-v] device\n"
+          "  -n  check only, never write (default)\n"
+          "  -y  repair every problem found\n"
+          "  -j  threads used to scan the inode table and bitmaps (default: online cpus)\n"
+          "  -v  print every problem\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int live_inos, used_blks, opt, ret;
+
+  while ((opt = getopt(argc, argv, "nyj:vh")) != -1) {
+    switch (opt) {
+    case 'n':
+      fs.repair = FALSE;
+      break;
+    case 'y':
+      fs.repair = TRUE;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'v':
+      fs.verbose = TRUE;
+      break;
+    default:
+      usage(argv[0]);
+      return FSCK_ERROR;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return FSCK_ERROR;
+  }
+  jobs = jobs < 1 ? 1 : (jobs > FSCK_MAX_JOBS ? FSCK_MAX_JOBS : jobs);
+
+  if (newfs_dev_open(&fs.dev, argv[optind]) != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], argv[optind]);
+    return FSCK_ERROR;
+  }
+  ret = load_metadata();
+  if (ret == -NFS_ERROR_INVAL) {
+    fprintf(stderr, "%s: %s has no valid newfs superblock\n", argv[0], argv[optind]);
+    newfs_dev_close(&fs.dev);
+    return FSCK_UNCORRECTED;
+  }
+  if (ret != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: can't read %s\n", argv[0], argv[optind]);
+    newfs_dev_close(&fs.dev);
+    return FSCK_ERROR;
+  }
+
+  // 按 inode 表块对齐切分，修复时各线程改的 inode 表块互不重叠
+  fsck_parallel(check_inodes, fs.max_ino, fs.sz_blk / fs.sz_inode, jobs);
+  ret = walk_tree();
+  if (ret == -NFS_ERROR_INVAL) {
+    newfs_dev_close(&fs.dev);
+    return FSCK_UNCORRECTED;
+  }
+  if (ret != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: io error while walking the tree\n", argv[0]);
+    newfs_dev_close(&fs.dev);
+    return FSCK_ERROR;
+  }
+  live_inos = fsck_parallel(count_refs, fs.max_ino, fs.sz_blk / fs.sz_inode, jobs);
+  used_blks = fsck_parallel(check_data_map, fs.max_data, UINT8_BITS, jobs);
+  if (fs.super_d.sz_usage != (uint32_t)used_blks * fs.sz_blk) {
+    problem(TRUE, "superblock usage %u, counted %d", fs.super_d.sz_usage, used_blks * fs.sz_blk);
+  }
+
+  if (fs.repair && fs.found > 0) {
+    fsck_parallel(drop_shared, fs.max_ino, fs.sz_blk / fs.sz_inode, jobs);
+    if (write_back(used_blks) != NFS_ERROR_NONE) {
+      fprintf(stderr, "%s: io error while writing repairs\n", argv[0]);
+      newfs_dev_close(&fs.dev);
+      return FSCK_ERROR;
+    }
+  }
+  newfs_dev_close(&fs.dev);
+
+  printf("%s: %d/%d inodes, %d/%d blocks, %d problem(s)", argv[optind], live_inos, fs.max_ino,
+         used_blks, fs.max_data, fs.found);
+  if (fs.found > 0) {
+    printf(", %d fixed", fs.found - fs.left);
+  }
+  printf("\n");
+  if (fs.left > 0) {
+    return FSCK_UNCORRECTED;
+  }
+  return fs.found > 0 ? FSCK_FIXED : FSCK_OK;
+}
@@ -0,0 +1,197 @@
+#include "newfs_tool.h"
+#include <getopt.h>
+#include <pthread.h>
+
+/*
+ * mkfs.newfs：在 ddriver 设备上建立 newfs。
+ *
+ * 布局由 newfs_layout_init 按设备大小、块大小和 inode 比例算出。需要清零的只有
+ * 位图、inode 表和根目录的数据块。驱动 fd 是普通文件（用户态 ddriver）时先试着打洞，
+ * 文件系统不支持打洞就把这段区域切成几片，由多个线程用大块 pwrite 并行清零；否则一次
+ * seek 之后按 IO 大小顺序写。数据区的内容不影响正确性，默认顺手丢弃掉（-K 保留），
+ * 镜像文件因此保持稀疏。最后写入超级块、两个位图里根目录占用的位和根目录 inode。
+ */
+#define MKFS_MAX_JOBS           16
+#define NFS_INODE_RATIO(sz_io)  ((INODE_PER_FILE + DATA_PER_FILE) * (sz_io) * 2)
+
+struct mkfs_job {
+  struct newfs_dev *dev;
+  off_t     start;
+  off_t     end;
+  int       ret;
+  pthread_t tid;
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-b block_size] [-i bytes_per_inode] [-j jobs] [-K] [-q] device\n"
+          "  -b  logical block size, power of two in [%d, %d] (default: 2 * io size)\n"
+          "  -i  one inode per this many bytes of disk (default: %d * block size)\n"
+          "  -j  threads used to zero the metadata area (default: online cpus)\n"
+          "  -K  keep the data area instead of discarding it\n"
+          "  -q  quiet\n",
+          prog, NFS_MIN_BLK_SZ, NFS_MAX_BLK_SZ, INODE_PER_FILE + DATA_PER_FILE);
+}
+
+static void *zero_range(void *arg) {
+  struct mkfs_job *job = (struct mkfs_job *)arg;
+
+  job->ret = newfs_dev_write(job->dev, job->start, NULL, job->end - job->start);
+  return NULL;
+}
+
+/**
+ * @brief 清零 [start, end)，普通文件先试打洞，不行再按块对齐切成 jobs 片并行写
+ */
+static int zero_metadata(struct newfs_dev *dev, int sz_blk, off_t start, off_t end, int jobs) {
+  struct mkfs_job job[MKFS_MAX_JOBS];
+  off_t slice;
+  int ret = NFS_ERROR_NONE;
+
+  if (dev->is_file && newfs_dev_discard(dev, start, end - start) == NFS_ERROR_NONE) {
+    return NFS_ERROR_NONE;
+  }
+  if (!dev->is_file || jobs <= 1) {
+    return newfs_dev_write(dev, start, NULL, end - start);
+  }
+  slice = ROUND_UP((end - start + jobs - 1) / jobs, (off_t)sz_blk);
+  for (int i = 0; i < jobs; i++) {
+    job[i].dev = dev;
+    job[i].start = start + i * slice < end ? start + i * slice : end;
+    job[i].end = job[i].start + slice < end ? job[i].start + slice : end;
+    job[i].ret = NFS_ERROR_NONE;
+    if (pthread_create(&job[i].tid, NULL, zero_range, &job[i]) != 0) {
+      zero_range(&job[i]);
+      job[i].tid = 0;
+    }
+  }
+  for (int i = 0; i < jobs; i++) {
+    if (job[i].tid != 0) {
+      pthread_join(job[i].tid, NULL);
+    }
+    if (job[i].ret != NFS_ERROR_NONE) {
+      ret = job[i].ret;
+    }
+  }
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  struct newfs_super_d super_d;
+  struct newfs_inode_d root_d;
+  struct newfs_dev dev;
+  int sz_disk, sz_io, sz_blk = 0, inode_ratio = 0;
+  int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  boolean quiet = FALSE, keep_data = FALSE;
+  uint8_t *blk;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "b:i:j:Kqh")) != -1) {
+    switch (opt) {
+    case 'b':
+      sz_blk = atoi(optarg);
+      break;
+    case 'i':
+      inode_ratio = atoi(optarg);
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'K':
+      keep_data = TRUE;
+      break;
+    case 'q':
+      quiet = TRUE;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  jobs = jobs < 1 ? 1 : (jobs > MKFS_MAX_JOBS ? MKFS_MAX_JOBS : jobs);
+
+  if (newfs_dev_open(&dev, argv[optind]) != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+  sz_disk = dev.sz_disk;
+  sz_io = dev.sz_io;
+  sz_blk = sz_blk != 0 ? sz_blk : sz_io * 2;
+  inode_ratio = inode_ratio != 0 ? inode_ratio : NFS_INODE_RATIO(sz_io);
+
+  ret = newfs_layout_init(&super_d, sz_disk, sz_io, sz_blk, inode_ratio);
+  if (ret == -NFS_ERROR_INVAL) {
+    fprintf(stderr, "%s: invalid block size %d or inode ratio %d\n", argv[0], sz_blk, inode_ratio);
+    newfs_dev_close(&dev);
+    return 1;
+  }
+  if (ret != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: device of %d bytes is too small\n", argv[0], sz_disk);
+    newfs_dev_close(&dev);
+    return 1;
+  }
+
+  // 先抹掉旧的超级块，再清零位图、inode 表和根目录的第 0 个数据块
+  ret = newfs_dev_write(&dev, 0, NULL, sz_blk);
+  if (ret == NFS_ERROR_NONE) {
+    ret = zero_metadata(&dev, sz_blk, super_d.map_inode_offset,
+                        (off_t)super_d.data_offset + sz_blk, jobs);
+  }
+  // 旧文件系统留在数据区的内容没人再读，驱动不支持丢弃就算了
+  if (ret == NFS_ERROR_NONE && !keep_data) {
+    newfs_dev_discard(&dev, (off_t)super_d.data_offset + sz_blk,
+                      sz_disk - (super_d.data_offset + sz_blk));
+  }
+
+  // 根目录占用 0 号 inode 和 0 号数据块，目录项为空
+  blk = (uint8_t *)calloc(1, sz_blk);
+  if (ret == NFS_ERROR_NONE) {
+    blk[0] = 0x1;
+    ret = newfs_dev_write(&dev, super_d.map_inode_offset, blk, sz_io);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_write(&dev, super_d.map_data_offset, blk, sz_io);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    memset(&root_d, 0, sizeof(struct newfs_inode_d));
+    root_d.ino = 0;
+    root_d.file_type = NFS_DIR;
+    root_d.data_block_no[0] = 0;
+    for (int i = 1; i < DATA_PER_FILE; i++) {
+      root_d.data_block_no[i] = -1;
+    }
+    memset(blk, 0, sz_blk);
+    memcpy(blk, &root_d, sizeof(struct newfs_inode_d));
+    ret = newfs_dev_write(&dev, super_d.inode_offset, blk, sz_io);
+  }
+  // 超级块最后写，中途失败的设备不会被当成 newfs 挂载
+  if (ret == NFS_ERROR_NONE) {
+    memset(blk, 0, sz_blk);
+    memcpy(blk, &super_d, sizeof(struct newfs_super_d));
+    ret = newfs_dev_write(&dev, 0, blk, sz_blk);
+  }
+  if (ret == NFS_ERROR_NONE) {
+    ret = newfs_dev_sync(&dev);
+  }
+  free(blk);
+  newfs_dev_close(&dev);
+  if (ret != NFS_ERROR_NONE) {
+    fprintf(stderr, "%s: failed to write %s: %s\n", argv[0], argv[optind], strerror(-ret));
+    return 1;
+  }
+
+  if (!quiet) {
+    printf("%s: %d bytes, block size %d\n", argv[optind], sz_disk, sz_blk);
+    printf("  inode map  %u block(s) at %u\n", super_d.map_inode_blks, super_d.map_inode_offset);
+    printf("  data map   %u block(s) at %u\n", super_d.map_data_blks, super_d.map_data_offset);
+    printf("  inodes     %u (%u bytes each) at %u\n", super_d.max_inode, super_d.sz_inode,
+           super_d.inode_offset);
+    printf("  data       %u block(s) at %u\n", (sz_disk - super_d.data_offset) / sz_blk,
+           super_d.data_offset);
+  }
+  return 0;
+}
@@ -0,0 +1,143 @@
+#include "newfs_bench.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * 基准结果的格式：
+ * { 头部字段..., "results": [ {"name", 规模参数, "ops", "ops_per_sec", "lat_ns": {...}}, ... ] }
+ * ops_per_sec 是操作数除以该项的总耗时，延迟分位数的单位是纳秒。
+ * 用户态 ddriver 用虚拟时钟（DDRIVER_CLOCK=virtual）时，同一进程里的基准改用驱动的
+ * 时钟计时，"clock" 为 "virtual"，结果里的时间是模拟出来的设备时间加上真实的 CPU 时间。
+ */
+
+static uint64_t (*bench_clock)(void);
+
+/**
+ * @brief 之后的计时改用 clock，必须在 bench_out_begin 之前调用
+ */
+void bench_set_clock(uint64_t (*clock)(void)) {
+  bench_clock = clock;
+}
+
+uint64_t bench_now_ns(void) {
+  struct timespec ts;
+
+  if (bench_clock != NULL) {
+    return bench_clock();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 解析逗号分隔的正整数列表
+ * @return int 个数，格式不对或超过 max 个时返回 -1
+ */
+int bench_parse_sizes(const char *arg, int *sizes, int max) {
+  char *dup = strdup(arg), *save = NULL, *tok;
+  int n = 0;
+
+  for (tok = strtok_r(dup, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    if (n == max || atoi(tok) <= 0) {
+      free(dup);
+      return -1;
+    }
+    sizes[n++] = atoi(tok);
+  }
+  free(dup);
+  return n;
+}
+
+void bench_lat_begin(struct bench_lat *lat, int cap) {
+  lat->cap = cap > 0 ? cap : 1;
+  lat->ns = (uint64_t *)malloc(sizeof(uint64_t) * lat->cap);
+  lat->cnt = 0;
+  lat->t_start = bench_now_ns();
+}
+
+/**
+ * @brief 记录一次从 t0 开始、到现在结束的操作
+ */
+void bench_lat_add(struct bench_lat *lat, uint64_t t0) {
+  uint64_t t1 = bench_now_ns();
+
+  if (lat->cnt == lat->cap) {
+    lat->cap *= 2;
+    lat->ns = (uint64_t *)realloc(lat->ns, sizeof(uint64_t) * lat->cap);
+  }
+  lat->ns[lat->cnt++] = t1 - t0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint64_t percentile(const struct bench_lat *lat, int pct) {
+  int idx = (int)(((int64_t)lat->cnt * pct + 99) / 100) - 1;
+
+  return lat->ns[idx < 0 ? 0 : idx];
+}
+
+/**
+ * @brief 结束一项基准，输出一条 JSON 记录并释放样本
+ *
+ * @param param 规模参数的名字，NULL 时不输出
+ * @param value 实际达到的规模
+ * @param requested 要求的规模，和 value 不同时标记 "truncated"
+ * @param err 中途失败时的 errno，0 表示全部完成
+ */
+void bench_lat_report(struct bench_out *out, struct bench_lat *lat, const char *name,
+                      const char *param, int value, int requested, int err) {
+  double secs = (bench_now_ns() - lat->t_start) / 1e9;
+  uint64_t sum = 0;
+
+  fprintf(out->fp, "%s\n    {\"name\": \"%s\"", out->n_results++ ? "," : "", name);
+  if (param != NULL) {
+    fprintf(out->fp, ", \"%s\": %d", param, value);
+  }
+  if (requested != value) {
+    fprintf(out->fp, ", \"requested\": %d, \"truncated\": true", requested);
+  }
+  fprintf(out->fp, ", \"ops\": %d", lat->cnt);
+  if (err != 0) {
+    fprintf(out->fp, ", \"error\": \"%s\"", strerror(err));
+  }
+  if (lat->cnt > 0) {
+    qsort(lat->ns, lat->cnt, sizeof(uint64_t), cmp_u64);
+    for (int i = 0; i < lat->cnt; i++) {
+      sum += lat->ns[i];
+    }
+    fprintf(out->fp, ", \"ops_per_sec\": %.1f, \"lat_ns\": {\"min\": %llu, \"mean\": %llu, "
+            "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+            secs > 0 ? lat->cnt / secs : 0.0,
+            (unsigned long long)lat->ns[0], (unsigned long long)(sum / lat->cnt),
+            (unsigned long long)percentile(lat, 50), (unsigned long long)percentile(lat, 90),
+            (unsigned long long)percentile(lat, 99), (unsigned long long)lat->ns[lat->cnt - 1]);
+  }
+  fprintf(out->fp, "}");
+  fflush(out->fp);
+  free(lat->ns);
+  lat->ns = NULL;
+}
+
+/* 调用者在 begin 和 results 之间输出自己的头部字段，每行以 ",\n" 结尾 */
+void bench_out_begin(struct bench_out *out, FILE *fp) {
+  const char *lat = getenv("DDRIVER_LATENCY");     /* 用户态 ddriver 的延迟模型 */
+
+  out->fp = fp;
+  out->n_results = 0;
+  fprintf(fp, "{\n  \"latency\": \"%s\",\n  \"clock\": \"%s\",\n",
+          lat != NULL && *lat != '\0' ? lat : "legacy", bench_clock != NULL ? "virtual" : "real");
+}
+
+void bench_out_results(struct bench_out *out) {
+  fprintf(out->fp, "  \"results\": [");
+}
+
+void bench_out_end(struct bench_out *out) {
+  fprintf(out->fp, "\n  ]\n}\n");
+  fflush(out->fp);
+}
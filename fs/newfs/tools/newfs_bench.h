@@ -0,0 +1,31 @@
+#ifndef _NEWFS_BENCH_H_
+#define _NEWFS_BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* bench.newfs / bench-inproc.newfs 共用的计时和 JSON 输出 */
+struct bench_lat {
+  uint64_t *ns;         /* 每次操作的延迟样本 */
+  int       cnt;
+  int       cap;
+  uint64_t  t_start;
+};
+
+struct bench_out {
+  FILE     *fp;
+  int       n_results;
+};
+
+uint64_t bench_now_ns(void);
+void bench_set_clock(uint64_t (*clock)(void));
+int  bench_parse_sizes(const char *arg, int *sizes, int max);
+void bench_lat_begin(struct bench_lat *lat, int cap);
+void bench_lat_add(struct bench_lat *lat, uint64_t t0);
+void bench_lat_report(struct bench_out *out, struct bench_lat *lat, const char *name,
+                      const char *param, int value, int requested, int err);
+void bench_out_begin(struct bench_out *out, FILE *fp);
+void bench_out_results(struct bench_out *out);
+void bench_out_end(struct bench_out *out);
+
+#endif  /* _NEWFS_BENCH_H_ */
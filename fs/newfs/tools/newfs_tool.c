@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "newfs_tool.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * 驱动 fd 是普通文件时直接按任意大小 pread / pwrite，一次读写整段区域；
+ * 否则（内核 ddriver）一次 seek 之后按 IO 大小顺序读写，ofs 和 len 必须按 IO 大小对齐。
+ * 普通文件清零时直接打洞；内核 ddriver 的丢弃用 IOC_REQ_DEVICE_DISCARD，旧模块对不认识的
+ * 请求也返回 0，所以只用来丢弃不要求读出 0 的区域，清零仍然老老实实地写。
+ */
+#define NFS_TOOL_CHUNK_SZ       (1 << 20)
+
+int newfs_dev_open(struct newfs_dev *dev, char *path) {
+  struct stat driver_stat;
+
+  dev->fd = ddriver_open(path);
+  if (dev->fd < 0) {
+    return -NFS_ERROR_IO;
+  }
+  ddriver_ioctl(dev->fd, IOC_REQ_DEVICE_SIZE, &dev->sz_disk);
+  ddriver_ioctl(dev->fd, IOC_REQ_DEVICE_IO_SZ, &dev->sz_io);
+  dev->is_file = fstat(dev->fd, &driver_stat) == 0 && S_ISREG(driver_stat.st_mode);
+  return NFS_ERROR_NONE;
+}
+
+void newfs_dev_close(struct newfs_dev *dev) {
+  ddriver_close(dev->fd);
+}
+
+int newfs_dev_read(struct newfs_dev *dev, off_t ofs, uint8_t *buf, size_t len) {
+  if (dev->is_file) {
+    while (len > 0) {
+      ssize_t n = pread(dev->fd, buf, len, ofs);
+      if (n <= 0) {
+        return -NFS_ERROR_IO;
+      }
+      buf += n;
+      ofs += n;
+      len -= n;
+    }
+    return NFS_ERROR_NONE;
+  }
+  if (ddriver_seek(dev->fd, ofs, SEEK_SET) < 0) {
+    return -NFS_ERROR_SEEK;
+  }
+  for (size_t i = 0; i < len; i += dev->sz_io) {
+    if (ddriver_read(dev->fd, (char *)buf + i, dev->sz_io) < 0) {
+      return -NFS_ERROR_IO;
+    }
+  }
+  return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 丢弃设备上 [ofs, ofs + len)，之后读出来是 0
+ *
+ * 普通文件不经过驱动的 ioctl，自己打洞：旧的用户态 ddriver 对不认识的请求也返回 0
+ * @return int 0成功，不支持时返回 -NFS_ERROR_UNSUPPORTED；只有普通文件保证成功后读出 0
+ */
+int newfs_dev_discard(struct newfs_dev *dev, off_t ofs, size_t len) {
+  struct ddriver_discard discard = { (unsigned int)ofs, (unsigned int)len };
+
+  if (dev->is_file) {
+    return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, len) == 0
+               ? NFS_ERROR_NONE
+               : -NFS_ERROR_UNSUPPORTED;
+  }
+  return ddriver_ioctl(dev->fd, IOC_REQ_DEVICE_DISCARD, &discard) == 0 ? NFS_ERROR_NONE
+                                                                        : -NFS_ERROR_UNSUPPORTED;
+}
+
+/**
+ * @brief 把 buf 写到设备的 ofs 处，buf 为 NULL 时清零，普通文件能打洞就不写
+ */
+int newfs_dev_write(struct newfs_dev *dev, off_t ofs, const uint8_t *buf, size_t len) {
+  size_t zero_sz = dev->is_file ? NFS_TOOL_CHUNK_SZ : (size_t)dev->sz_io;
+  uint8_t *zero;
+  int ret = NFS_ERROR_NONE;
+
+  if (buf == NULL && dev->is_file && newfs_dev_discard(dev, ofs, len) == NFS_ERROR_NONE) {
+    return NFS_ERROR_NONE;
+  }
+  zero = buf == NULL ? (uint8_t *)calloc(1, zero_sz) : NULL;
+  if (dev->is_file) {
+    while (len > 0) {
+      size_t cur = buf != NULL ? len : (len < zero_sz ? len : zero_sz);
+      ssize_t n = pwrite(dev->fd, buf != NULL ? buf : zero, cur, ofs);
+      if (n <= 0) {
+        ret = -NFS_ERROR_IO;
+        break;
+      }
+      if (buf != NULL) {
+        buf += n;
+      }
+      ofs += n;
+      len -= n;
+    }
+    free(zero);
+    return ret;
+  }
+  if (ddriver_seek(dev->fd, ofs, SEEK_SET) < 0) {
+    free(zero);
+    return -NFS_ERROR_SEEK;
+  }
+  for (size_t i = 0; i < len; i += dev->sz_io) {
+    if (ddriver_write(dev->fd, (char *)(buf != NULL ? buf + i : zero), dev->sz_io) < 0) {
+      ret = -NFS_ERROR_IO;
+      break;
+    }
+  }
+  free(zero);
+  return ret;
+}
+
+int newfs_dev_sync(struct newfs_dev *dev) {
+  if (dev->is_file && fsync(dev->fd) != 0) {
+    return -NFS_ERROR_IO;
+  }
+  return NFS_ERROR_NONE;
+}
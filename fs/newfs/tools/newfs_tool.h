@@ -0,0 +1,21 @@
+#ifndef _NEWFS_TOOL_H_
+#define _NEWFS_TOOL_H_
+
+#include "../include/newfs.h"
+
+/* mkfs.newfs / fsck.newfs 共用的设备访问 */
+struct newfs_dev {
+  int     fd;
+  boolean is_file;      /* 驱动 fd 是普通文件（用户态 ddriver），可以任意大小 pread / pwrite */
+  int     sz_disk;
+  int     sz_io;
+};
+
+int  newfs_dev_open(struct newfs_dev *dev, char *path);
+void newfs_dev_close(struct newfs_dev *dev);
+int  newfs_dev_read(struct newfs_dev *dev, off_t ofs, uint8_t *buf, size_t len);
+int  newfs_dev_write(struct newfs_dev *dev, off_t ofs, const uint8_t *buf, size_t len);
+int  newfs_dev_discard(struct newfs_dev *dev, off_t ofs, size_t len);
+int  newfs_dev_sync(struct newfs_dev *dev);
+
+#endif  /* _NEWFS_TOOL_H_ */